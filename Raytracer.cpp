@@ -7,14 +7,53 @@
 #include "hittables/quad.h"
 #include "hittables/triangle.h"
 #include "hittables/translate.h"
+#include "hittables/transform.h"
 #include "hittables/rotate.h"
 #include "hittables/constant_medium.h"
+#include "hittables/grid_medium.h"
 #include "load_gltf.h"
+#include "gltf_sequence.h"
+#include "scene_cache.h"
+#include "baked_texture.h"
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
 
 using namespace tinygltf;
 
-Model model;
-TinyGLTF loader;
+gltf_asset asset;
+scene_cache cache;
+bool use_scene_cache = true;
+// Upper bound on texture memory when rendering from the scene cache, e.g.
+// RT_TEXTURE_CACHE_MB=64. Unset reads textures straight from the mapped cache file.
+size_t texture_cache_bytes = getenv("RT_TEXTURE_CACHE_MB") ? size_t(atoll(getenv("RT_TEXTURE_CACHE_MB"))) << 20 : 0;
+// Equirectangular image (e.g. an .hdr probe) lighting glTF scenes instead of the flat
+// background, e.g. RT_ENVIRONMENT=images/sky.hdr
+const char *environment_file = getenv("RT_ENVIRONMENT");
+// Part of the glTF scene's first animation to render, motion blurred, as
+// RT_SHUTTER=open,close in seconds, or RT_SHUTTER=time for a still frame
+gltf_shutter shutter_from_env()
+{
+    gltf_shutter shutter;
+    const char *value = getenv("RT_SHUTTER");
+    if (!value)
+    {
+        return shutter;
+    }
+    shutter.animation = 0;
+    if (sscanf(value, "%lf,%lf", &shutter.open, &shutter.close) < 2)
+    {
+        shutter.close = shutter.open;
+    }
+    return shutter;
+}
+gltf_shutter shutter = shutter_from_env();
+// Renders the whole first animation of the glTF scene into out/frames/ at this many frames
+// per second, e.g. RT_SEQUENCE=24, with the shutter open for RT_SHUTTER_ANGLE degrees
+// (default 180) of each frame. With RT_LAYERS set, each frame's layers go next to it.
+double sequence_fps = getenv("RT_SEQUENCE") ? atof(getenv("RT_SEQUENCE")) : 0;
+double shutter_angle = getenv("RT_SHUTTER_ANGLE") ? atof(getenv("RT_SHUTTER_ANGLE")) : 180;
 std::string err;
 std::string warn;
 
@@ -154,13 +193,85 @@ void fantasy_planet(int chunk)
     cam.render(world, chunk);
 }
 
+// How the small sphere in perlin_spheres gets its noise: evaluated at every hit (live,
+// the default), or baked once into a grid around the sphere (RT_BAKE=grid) or an image
+// over its uvs (RT_BAKE=uv). Bakes are approximate and only pay off for costly textures
+// like many octaves of turbulence; --compare-bakes prints what each costs per lookup and
+// how far it is from the live noise.
+const char *small_sphere_bake = getenv("RT_BAKE") ? getenv("RT_BAKE") : "live";
+
+shared_ptr<texture> bake_small_sphere(shared_ptr<texture> source, const std::string &bake)
+{
+    const point3 center(0, 2, 0);
+    const double radius = 2;
+    if (bake == "grid")
+    {
+        return make_shared<baked_texture>(source, aabb(center - vec3(radius), center + vec3(radius)), 128);
+    }
+    if (bake == "uv")
+    {
+        return make_shared<baked_texture>(source, 2048, 1024, center, radius);
+    }
+    return source;
+}
+
+int compare_bakes()
+{
+    // A grid of uvs over the small sphere, looked up row by row like neighbouring pixels
+    const int width = 1024, height = 512;
+    std::vector<point3> points;
+    std::vector<double> us, vs;
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            us.push_back((x + 0.5) / width);
+            vs.push_back((y + 0.5) / height);
+            points.push_back(point3(0, 2, 0) + 2 * sphere::unit_point_at_uv(us.back(), vs.back()));
+        }
+    }
+
+    for (int octaves : {1, 7})
+    {
+        auto live = make_shared<noise_texture>(10.0, octaves);
+        std::vector<color> reference;
+        std::clog << "noise_texture(10, " << octaves << ")" << std::endl;
+        for (const char *bake : {"live", "grid", "uv"})
+        {
+            auto bake_start = std::chrono::steady_clock::now();
+            shared_ptr<texture> tex = bake_small_sphere(live, bake);
+            auto lookup_start = std::chrono::steady_clock::now();
+            std::vector<color> values(points.size());
+            for (size_t i = 0; i < points.size(); i++)
+            {
+                values[i] = tex->value(us[i], vs[i], points[i]);
+            }
+            auto lookup_end = std::chrono::steady_clock::now();
+            if (reference.empty())
+            {
+                reference = values;
+            }
+            double error = 0;
+            for (size_t i = 0; i < points.size(); i++)
+            {
+                error += std::fabs(values[i].x() - reference[i].x());
+            }
+            auto bake_ms = std::chrono::duration_cast<std::chrono::milliseconds>(lookup_start - bake_start).count();
+            auto lookup_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(lookup_end - lookup_start).count() / double(points.size());
+            std::clog << "  " << bake << ": " << lookup_ns << " ns per lookup, mean error " << error / points.size() << ", baked in " << bake_ms << " ms" << std::endl;
+        }
+    }
+    return 0;
+}
+
 void perlin_spheres(int chunk)
 {
     hittable_list world;
 
     auto pertext = make_shared<noise_texture>(10.0);
+    shared_ptr<texture> small_sphere_texture = bake_small_sphere(pertext, small_sphere_bake);
     world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(pertext)));
-    world.add(make_shared<sphere>(point3(0, 2, 0), 2, make_shared<lambertian>(pertext)));
+    world.add(make_shared<sphere>(point3(0, 2, 0), 2, make_shared<lambertian>(small_sphere_texture)));
 
     camera cam;
 
@@ -298,6 +409,11 @@ void cornell_box(int chunk)
 
     cam.defocus_angle = 0;
     world = hittable_list(make_shared<bvh_node>(world));
+
+    // Sample the ceiling light directly
+    light_list lights;
+    lights.build(world);
+    cam.lights = &lights;
     cam.render(world, chunk, true);
 }
 
@@ -347,6 +463,59 @@ void cornell_smoke(int chunk)
     cam.render(world, chunk, true);
 }
 
+// Cornell box with a cloud of smoke in it, whose density comes from turbulence and
+// fades out towards the edge of a sphere
+void cornell_cloud(int chunk)
+{
+    hittable_list world;
+
+    auto red = make_shared<lambertian>(color(.65, .05, .05));
+    auto white = make_shared<lambertian>(color(.73, .73, .73));
+    auto green = make_shared<lambertian>(color(.12, .45, .15));
+    auto light = make_shared<diffuse_light>(color(15));
+
+    world.add(make_shared<quad>(point3(555, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), green));
+    world.add(make_shared<quad>(point3(0, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), red));
+    world.add(make_shared<quad>(point3(343, 554, 332), vec3(-130, 0, 0), vec3(0, 0, -105), light));
+    world.add(make_shared<quad>(point3(0, 555, 0), vec3(555, 0, 0), vec3(0, 0, 555), white));
+    world.add(make_shared<quad>(point3(0, 0, 0), vec3(555, 0, 0), vec3(0, 0, 555), white));
+    world.add(make_shared<quad>(point3(0, 0, 555), vec3(555, 0, 0), vec3(0, 555, 0), white));
+
+    perlin noise;
+    point3 center(278, 250, 278);
+    double radius = 200;
+    auto cloud = make_shared<sparse_grid>(aabb(center - vec3(radius), center + vec3(radius)), 128, 128, 128, [&](const point3 &p)
+                                          {
+                                              double falloff = 1 - (p - center).length() / radius;
+                                              if (falloff <= 0)
+                                              {
+                                                  return 0.0;
+                                              }
+                                              return std::fmax(0.0, 2 * falloff - 0.4 + noise.turb(p * 0.015, 5)); });
+    world.add(make_shared<grid_medium>(cloud, 0.02, color(.9)));
+
+    camera cam;
+
+    cam.aspect_ratio = 1.0;
+    cam.image_width = 600;
+    cam.samples_per_pixel = 1000;
+    cam.max_depth = 50;
+    cam.background = color(0, 0, 0);
+
+    cam.vfov = 40;
+    cam.lookfrom = point3(278, 278, -800);
+    cam.lookat = point3(278, 278, 0);
+    cam.vup = vec3(0, 1, 0);
+
+    cam.defocus_angle = 0;
+    world = hittable_list(make_shared<bvh_node>(world));
+
+    light_list lights;
+    lights.build(world);
+    cam.lights = &lights;
+    cam.render(world, chunk, true);
+}
+
 void rotate_test(int chunk)
 {
     hittable_list world;
@@ -439,13 +608,16 @@ void book_2_final_scene(int chunk)
     world.add(make_shared<sphere>(
         point3(0, 150, 145), 50, make_shared<metal>(color(0.8, 0.8, 0.9), .1)));
 
-    // Subsurface sphere is a dielectric sphere right around a volumetric sphere
+    // Subsurface sphere is a dielectric sphere filled with a volume
     auto boundary = make_shared<sphere>(point3(360, 150, 145), 70, make_shared<dielectric>(1.5));
-    world.add(boundary);
-    world.add(make_shared<constant_medium>(boundary, 0.01, color(0.9, 0.2, 0.4)));
-    // Also add fog to ~the entire scene
-    boundary = make_shared<sphere>(point3(0), 5000, make_shared<dielectric>(1.5)); // don't think dielectric matters here
-    world.add(make_shared<constant_medium>(boundary, 0.0001, color(1)));
+    world.add(make_shared<constant_medium>(boundary, 0.01, color(0.9, 0.2, 0.4), true));
+    // Also add fog to ~the entire scene. A grid medium over a box only needs a slab test
+    // per ray, where a 5000 radius boundary sphere needed two sphere intersections. The
+    // camera is inside it.
+    auto fog = make_shared<sparse_grid>(aabb(point3(-5000), point3(5000)), 1, 1, 1, [](const point3 &)
+                                        { return 1.0; });
+    auto fog_volume = make_shared<grid_medium>(fog, 0.0001, color(1));
+    world.add(fog_volume);
 
     // Add fantasy globe
     // auto worldmap = make_shared<lambertian>(make_shared<image_texture>("textures/Map-111.png"));
@@ -492,6 +664,7 @@ void book_2_final_scene(int chunk)
     cam.lookfrom = point3(478, 278, -600);
     cam.lookat = point3(278, 278, 0);
     cam.vup = vec3(0, 1, 0);
+    cam.camera_medium = fog_volume->inside();
 
     cam.defocus_angle = 0;
 
@@ -567,6 +740,65 @@ void triangles(int chunk)
     cam.render(world, chunk, true);
 }
 
+// Renders every frame of the loaded asset's first animation, see sequence_fps. The scene
+// is built once and only what the animation moves is updated between frames.
+int render_gltf_sequence(const gltf_material_table &materials)
+{
+    gltf_sequence sequence(asset, materials, 0);
+    int success = sequence.build();
+    if (success != 0)
+    {
+        return success;
+    }
+
+    std::unique_ptr<environment_map> environment;
+    if (environment_file)
+    {
+        environment = std::make_unique<environment_map>(environment_file);
+    }
+
+    std::filesystem::create_directories("out/frames");
+    int frames = int(std::floor(gltf_animation_duration(asset, 0) * sequence_fps + 1e-6)) + 1;
+    for (int frame = 0; frame < frames; frame++)
+    {
+        auto update_start = std::chrono::steady_clock::now();
+        double open = frame / sequence_fps;
+        sequence.set_time(open, open + shutter_angle / 360 / sequence_fps);
+
+        camera cam;
+        sequence.place_camera(cam);
+        cam.seed = frame;
+        light_list lights;
+        lights.build(sequence.world());
+        if (!lights.empty())
+        {
+            cam.lights = &lights;
+        }
+        if (environment && environment->valid())
+        {
+            cam.environment = environment.get();
+        }
+        auto render_start = std::chrono::steady_clock::now();
+
+        char path[64];
+        if (!cam.layers_path.empty())
+        {
+            snprintf(path, sizeof(path), "out/frames/%04d.exr", frame);
+            cam.layers_path = path;
+        }
+        snprintf(path, sizeof(path), "out/frames/%04d.ppm", frame);
+        std::ofstream out(path);
+        cam.render(sequence.world(), -1, true, out);
+
+        auto render_end = std::chrono::steady_clock::now();
+        auto update_ms = std::chrono::duration_cast<std::chrono::milliseconds>(render_start - update_start).count();
+        auto render_ms = std::chrono::duration_cast<std::chrono::milliseconds>(render_end - render_start).count();
+        std::clog << "\nFrame " << frame + 1 << "/" << frames << " written to " << path << ": scene updated in " << update_ms << " ms, rendered in " << render_ms << " ms" << std::endl;
+    }
+    std::clog << "BVHs rebuilt after refitting: " << sequence.rebuilds << std::endl;
+    return 0;
+}
+
 int simple_gltf(int chunk)
 {
     // vec3 p = vec3(0, 1, 0);
@@ -595,49 +827,132 @@ int simple_gltf(int chunk)
     //                           return true; }, nullptr);
 
     auto white = make_shared<lambertian>(.73);
-    // bool ret = loader.LoadASCIIFromFile(&model, &err, &warn, "gltf/2CylinderEngine.gltf");
-    // bool ret = loader.LoadASCIIFromFile(&model, &err, &warn, "gltf/uv.gltf");
-    // bool ret = loader.LoadASCIIFromFile(&model, &err, &warn, "gltf/sphere.gltf");
-    bool ret = loader.LoadASCIIFromFile(&model, &err, &warn, "gltf/snowman.gltf");
-    // bool ret = loader.LoadASCIIFromFile(&model, &err, &warn, "gltf/book.gltf");
-    // bool ret = loader.LoadASCIIFromFile(&model, &err, &warn, "gltf/axes.gltf");
-
-    if (!warn.empty())
+    auto load_start = std::chrono::steady_clock::now();
+    // std::string filename = "gltf/2CylinderEngine.gltf";
+    // std::string filename = "gltf/uv.gltf";
+    // std::string filename = "gltf/sphere.gltf";
+    std::string filename = "gltf/snowman.gltf";
+    // std::string filename = "gltf/snowman.glb";
+    // std::string filename = "gltf/book.gltf";
+    // std::string filename = "gltf/axes.gltf";
+
+    hittable_list world;
+    camera cam;
+
+    // Reuse the built scene from an earlier run (or from the header pass of multiprocess.py).
+    // The cache holds the rest pose only, so animated renders always load the file.
+    uint64_t cache_key = scene_cache::key(filename);
+    bool use_cache = use_scene_cache && shutter.animation < 0 && sequence_fps <= 0;
+    bool cached = use_cache && cache.load(cache_key, world, cam, texture_cache_bytes);
+    if (!cached)
     {
-        printf("Warn: %s\n", warn.c_str());
-    }
+        bool ret = asset.load(filename, err, warn);
+
+        if (!warn.empty())
+        {
+            printf("Warn: %s\n", warn.c_str());
+        }
+
+        if (!err.empty())
+        {
+            printf("Err: %s\n", err.c_str());
+        }
+
+        if (!ret)
+        {
+            printf("Failed to parse glTF\n");
+            return -1;
+        }
+
+        gltf_material_table materials = gltf_materials(asset.model);
+        if (sequence_fps > 0)
+        {
+            return render_gltf_sequence(materials);
+        }
+        int success = add_gltf_to_world(world, asset, materials, shutter);
+        if (success != 0)
+        {
+            return success;
+        }
+        auto root = make_shared<bvh_node>(world);
+        world = hittable_list(root);
+        set_camera_from_gltf(cam, asset.model);
 
-    if (!err.empty())
+        if (use_cache && !scene_cache::save(cache_key, root, materials, cam))
+        {
+            std::clog << "Could not write scene cache for " << filename << std::endl;
+        }
+    }
+    // Emissive triangles are sampled directly instead of only being found by chance
+    light_list lights;
+    lights.build(world);
+    if (!lights.empty())
     {
-        printf("Err: %s\n", err.c_str());
+        cam.lights = &lights;
     }
-
-    if (!ret)
+    std::unique_ptr<environment_map> environment;
+    if (environment_file)
     {
-        printf("Failed to parse glTF\n");
-        return -1;
+        environment = std::make_unique<environment_map>(environment_file);
+        if (environment->valid())
+        {
+            cam.environment = environment.get();
+        }
     }
 
-    hittable_list world;
-    camera cam;
-    int success = add_gltf_to_world(world, model);
-    if (success != 0)
+    if (chunk < 0)
     {
-        return success;
+        auto load_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - load_start).count();
+        std::clog << "Scene " << (cached ? "loaded from cache" : "loaded") << " in " << load_ms << " ms, " << lights.size() << " emissive triangles" << std::endl;
     }
-    world = hittable_list(make_shared<bvh_node>(world));
-    set_camera_from_gltf(cam, model);
 
     cam.render(world, chunk, true);
 
+    if (chunk < 0 && cache.texture_tiles())
+    {
+        const texture_cache *tiles = cache.texture_tiles();
+        std::clog << "\nTexture cache: " << tiles->hits << " hits, " << tiles->misses << " misses" << std::endl;
+    }
+
     return 0;
 
     // std::cout << "Mesh mode is " << primitive.mode << std::endl;
 }
 
+// Puts together the buffers that the chunks of a render wrote to directory (see
+// camera::aov_directory), prints the image, denoised with RT_DENOISE, and writes the
+// output layers with RT_LAYERS
+int combine_chunks(const std::string &directory)
+{
+    aov_image image;
+    if (!read_aov_chunks(directory, image))
+    {
+        std::clog << "No complete set of chunk buffers in " << directory << std::endl;
+        return 1;
+    }
+    std::cout << "P3\n"
+              << image.width << ' ' << image.height << "\n255\n";
+    std::vector<color> denoised;
+    if (getenv("RT_DENOISE"))
+    {
+        denoised = denoiser().denoise(image);
+    }
+    for (size_t i = 0; i < image.pixels.size(); i++)
+    {
+        write_color(std::cout, denoised.empty() ? image.pixels[i].value : denoised[i]);
+    }
+    const char *layers_path = getenv("RT_LAYERS");
+    if (layers_path && !write_layers(layers_path, image, denoised))
+    {
+        std::clog << "Could not write " << layers_path << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
-    // parse --chunk=int from argv
+    // parse --chunk=int from argv, or --combine=directory, or --compare-bakes
     int chunk = -1;
     if (argc > 1)
     {
@@ -646,6 +961,14 @@ int main(int argc, char **argv)
         {
             chunk = std::stoi(arg.substr(8));
         }
+        else if (arg.find("--combine=") == 0)
+        {
+            return combine_chunks(arg.substr(10));
+        }
+        else if (arg == "--compare-bakes")
+        {
+            return compare_bakes();
+        }
     }
 
     switch (12)
@@ -685,6 +1008,9 @@ int main(int argc, char **argv)
         break;
     case 12:
         return simple_gltf(chunk);
+    case 13:
+        cornell_cloud(chunk);
+        break;
     }
 }
 
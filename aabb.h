@@ -45,6 +45,12 @@ public:
   // as we iterate through the axes, which shrinks with each iteration. This starts off
   // as ray_t
   bool hit(const ray &r, interval ray_t) const
+  {
+    return clip(r, ray_t);
+  }
+
+  // Same test as hit, leaving ray_t narrowed to the part of the ray inside the box
+  bool clip(const ray &r, interval &ray_t) const
   {
     const point3 &ray_origin = r.origin();
     const vec3 &ray_dir = r.direction();
@@ -90,6 +96,11 @@ public:
     return 2;
   }
 
+  double surface_area() const
+  {
+    return 2 * (x.size() * y.size() + y.size() * z.size() + z.size() * x.size());
+  }
+
   static const aabb empty, universe;
 
 private:
@@ -112,6 +123,17 @@ private:
 const aabb aabb::empty = aabb(interval::empty, interval::empty, interval::empty);
 const aabb aabb::universe = aabb(interval::universe, interval::universe, interval::universe);
 
+// Box between start (t = 0) and end (t = 1). Both are already padded, and so is
+// anything in between, so this skips the constructor's padding.
+inline aabb interpolate(const aabb &start, const aabb &end, double t)
+{
+  aabb box;
+  box.x = interval(start.x.min + (end.x.min - start.x.min) * t, start.x.max + (end.x.max - start.x.max) * t);
+  box.y = interval(start.y.min + (end.y.min - start.y.min) * t, start.y.max + (end.y.max - start.y.max) * t);
+  box.z = interval(start.z.min + (end.z.min - start.z.min) * t, start.z.max + (end.z.max - start.z.max) * t);
+  return box;
+}
+
 aabb operator+(const aabb &bbox, const vec3 &offset)
 {
   return aabb(bbox.x + offset.x(), bbox.y + offset.y(), bbox.z + offset.z());
@@ -0,0 +1,285 @@
+#ifndef BAKED_TEXTURE_H
+#define BAKED_TEXTURE_H
+
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "hittables/sphere.h"
+#include "texture.h"
+
+// Bump whenever the baked layout or how a bake is sampled changes
+const uint32_t bake_cache_version = 2;
+
+// Values sampled once on a regular grid over a box and trilinearly interpolated
+// afterwards, for procedural textures that don't change during a render. A lookup costs
+// 8 reads per channel instead of evaluating the texture. Points outside the box clamp to
+// its edge, so the box should cover everything the texture is applied to.
+class sample_grid
+{
+public:
+  sample_grid() {}
+
+  // resolution: samples along the longest side of bounds
+  sample_grid(const aabb &bounds, int resolution, int channels) : bounds(bounds), channels(channels)
+  {
+    double longest = std::fmax(bounds.x.size(), std::fmax(bounds.y.size(), bounds.z.size()));
+    for (int a = 0; a < 3; a++)
+    {
+      samples[a] = std::max(2, int(std::ceil(resolution * bounds.axis_interval(a).size() / longest)) + 1);
+      cell_size[a] = bounds.axis_interval(a).size() / (samples[a] - 1);
+    }
+    values.resize(size_t(samples[0]) * samples[1] * samples[2] * channels);
+  }
+
+  // Sets every grid point to sample(p, out), which writes channels floats to out
+  template <typename sample_function>
+  void fill(sample_function sample)
+  {
+    for (int z = 0; z < samples[2]; z++)
+    {
+      for (int y = 0; y < samples[1]; y++)
+      {
+        for (int x = 0; x < samples[0]; x++)
+        {
+          point3 p(bounds.x.min + x * cell_size[0], bounds.y.min + y * cell_size[1], bounds.z.min + z * cell_size[2]);
+          sample(p, &values[index(x, y, z)]);
+        }
+      }
+    }
+  }
+
+  void lookup(const point3 &p, float *out) const
+  {
+    int cell[3];
+    float t[3];
+    for (int a = 0; a < 3; a++)
+    {
+      double f = cell_size[a] > 0 ? (p[a] - bounds.axis_interval(a).min) / cell_size[a] : 0;
+      f = std::clamp(f, 0.0, double(samples[a] - 1));
+      cell[a] = std::min(int(f), samples[a] - 2);
+      t[a] = f - cell[a];
+    }
+
+    // corner c is offset by (c >> 2, (c >> 1) & 1, c & 1) cells from the base corner
+    const float *base = &values[index(cell[0], cell[1], cell[2])];
+    size_t stride_x = channels, stride_y = size_t(samples[0]) * channels, stride_z = stride_y * samples[1];
+    const float *corners[8] = {base, base + stride_z, base + stride_y, base + stride_y + stride_z,
+                               base + stride_x, base + stride_x + stride_z, base + stride_x + stride_y, base + stride_x + stride_y + stride_z};
+    for (int i = 0; i < channels; i++)
+    {
+      float x00 = corners[0][i] + t[0] * (corners[4][i] - corners[0][i]);
+      float x01 = corners[1][i] + t[0] * (corners[5][i] - corners[1][i]);
+      float x10 = corners[2][i] + t[0] * (corners[6][i] - corners[2][i]);
+      float x11 = corners[3][i] + t[0] * (corners[7][i] - corners[3][i]);
+      float y0 = x00 + t[1] * (x10 - x00);
+      float y1 = x01 + t[1] * (x11 - x01);
+      out[i] = y0 + t[2] * (y1 - y0);
+    }
+  }
+
+  // Every sample, e.g. for caching a filled grid
+  std::vector<float> &data() { return values; }
+  const std::vector<float> &data() const { return values; }
+
+private:
+  aabb bounds;
+  int channels = 1;
+  int samples[3] = {0, 0, 0};
+  double cell_size[3] = {0, 0, 0};
+  std::vector<float> values;
+
+  size_t index(int x, int y, int z) const
+  {
+    return ((size_t(z) * samples[1] + y) * samples[0] + x) * channels;
+  }
+};
+
+// A procedural texture rasterized once, either into a 3D grid over a box (for textures
+// that depend on the hit point, like noise and checkers) or into an image over a
+// sphere's uvs, and looked up with interpolation from then on.
+//
+// Bakes are cached by a hash of the source texture's content_hash and the bake settings,
+// both in memory so textures used on several objects are only baked once, and in cache/
+// so later runs and the other multiprocess.py chunks can read them instead of baking
+// again. Changing the texture changes the hash, so a stale bake is never picked up.
+// Textures that can't be hashed, like images, are baked every time.
+class baked_texture : public texture
+{
+public:
+  // 3D grid over bounds with resolution samples along its longest side
+  baked_texture(shared_ptr<texture> source, const aabb &bounds, int resolution)
+  {
+    uint64_t hash = bake_hash(source->content_hash(), 0, {bounds.x.min, bounds.y.min, bounds.z.min, bounds.x.max, bounds.y.max, bounds.z.max, double(resolution)});
+    grid = cached_bake(baked_grids(), hash, [&]
+                       {
+                         auto baked = make_shared<sample_grid>(bounds, resolution, 3);
+                         if (!load_bake(hash, baked->data()))
+                         {
+                           baked->fill([&](const point3 &p, float *out)
+                                       {
+                                         color c = source->value(0, 0, p);
+                                         out[0] = c.x();
+                                         out[1] = c.y();
+                                         out[2] = c.z(); });
+                           save_bake(hash, baked->data());
+                         }
+                         return baked; });
+  }
+
+  // width x height image over the uvs of a sphere, with the source evaluated at the
+  // points of the sphere those uvs map to
+  baked_texture(shared_ptr<texture> source, int width, int height, const point3 &center, double radius)
+  {
+    uint64_t hash = bake_hash(source->content_hash(), 1, {double(width), double(height), center.x(), center.y(), center.z(), radius});
+    image = cached_bake(baked_images(), hash, [&]
+                        {
+                          std::vector<float> rgba(4 * size_t(width) * height);
+                          if (!load_bake(hash, rgba))
+                          {
+                            for (int y = 0; y < height; y++)
+                            {
+                              for (int x = 0; x < width; x++)
+                              {
+                                // texel centers, with v flipped to match image_texture
+                                double u = (x + 0.5) / width;
+                                double v = 1.0 - (y + 0.5) / height;
+                                color c = source->value(u, v, center + radius * sphere::unit_point_at_uv(u, v));
+                                float *texel = &rgba[4 * (size_t(y) * width + x)];
+                                texel[0] = c.x();
+                                texel[1] = c.y();
+                                texel[2] = c.z();
+                                texel[3] = 1;
+                              }
+                            }
+                            save_bake(hash, rgba);
+                          }
+                          return make_shared<mip_chain>(width, height, std::move(rgba)); });
+  }
+
+  color value(double u, double v, const point3 &p) const override
+  {
+    return value(u, v, p, 0);
+  }
+
+  color value(double u, double v, const point3 &p, double uv_footprint) const override
+  {
+    float rgba[4];
+    if (image)
+    {
+      image->trilinear(interval(0, 1).clamp(u), 1.0 - interval(0, 1).clamp(v), uv_footprint, rgba);
+    }
+    else
+    {
+      grid->lookup(p, rgba);
+    }
+    return color(rgba[0], rgba[1], rgba[2]);
+  }
+
+private:
+  shared_ptr<const sample_grid> grid;
+  shared_ptr<const mip_chain> image;
+
+  struct bake_header
+  {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t hash;
+    uint64_t count; // floats that follow
+  };
+
+  static std::unordered_map<uint64_t, std::weak_ptr<const sample_grid>> &baked_grids()
+  {
+    static std::unordered_map<uint64_t, std::weak_ptr<const sample_grid>> grids;
+    return grids;
+  }
+
+  static std::unordered_map<uint64_t, std::weak_ptr<const mip_chain>> &baked_images()
+  {
+    static std::unordered_map<uint64_t, std::weak_ptr<const mip_chain>> images;
+    return images;
+  }
+
+  // 0 if the source has no content hash, which turns caching off
+  static uint64_t bake_hash(uint64_t source_hash, uint32_t kind, std::initializer_list<double> settings)
+  {
+    if (source_hash == 0)
+      return 0;
+    uint64_t hash = fnv1a(&bake_cache_version, sizeof(bake_cache_version));
+    hash = fnv1a(&source_hash, sizeof(source_hash), hash);
+    hash = fnv1a(&kind, sizeof(kind), hash);
+    for (double setting : settings)
+      hash = fnv1a(&setting, sizeof(setting), hash);
+    return hash;
+  }
+
+  // The bake for hash from bakes if it's still in use, or else bake()
+  template <typename T, typename bake_function>
+  static shared_ptr<const T> cached_bake(std::unordered_map<uint64_t, std::weak_ptr<const T>> &bakes, uint64_t hash, bake_function bake)
+  {
+    if (hash != 0)
+    {
+      if (auto cached = bakes[hash].lock())
+        return cached;
+    }
+    shared_ptr<const T> baked = bake();
+    if (hash != 0)
+      bakes[hash] = baked;
+    return baked;
+  }
+
+  static std::string bake_path(uint64_t hash)
+  {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash);
+    return std::string("cache/") + name + ".rtbake";
+  }
+
+  // Fill values from the cached bake for hash, if there is one of the right size
+  static bool load_bake(uint64_t hash, std::vector<float> &values)
+  {
+    if (hash == 0)
+      return false;
+    std::ifstream in(bake_path(hash), std::ios::binary);
+    bake_header h;
+    if (!in.read(reinterpret_cast<char *>(&h), sizeof(h)))
+      return false;
+    if (memcmp(h.magic, "RTBAKE", 7) != 0 || h.version != bake_cache_version || h.hash != hash || h.count != values.size())
+      return false;
+    return bool(in.read(reinterpret_cast<char *>(values.data()), values.size() * sizeof(float)));
+  }
+
+  static void save_bake(uint64_t hash, const std::vector<float> &values)
+  {
+    if (hash == 0)
+      return;
+    bake_header h = {};
+    memcpy(h.magic, "RTBAKE", 7);
+    h.version = bake_cache_version;
+    h.hash = hash;
+    h.count = values.size();
+
+    // Same temporary file and rename as the scene cache, since chunks bake in parallel
+    std::filesystem::create_directories("cache");
+    std::string path = bake_path(hash);
+    std::string temp_path = path + "." + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + ".tmp";
+    {
+      std::ofstream out(temp_path, std::ios::binary);
+      out.write(reinterpret_cast<const char *>(&h), sizeof(h));
+      out.write(reinterpret_cast<const char *>(values.data()), values.size() * sizeof(float));
+      if (!out)
+      {
+        std::filesystem::remove(temp_path);
+        return;
+      }
+    }
+    std::filesystem::rename(temp_path, path);
+  }
+};
+
+#endif
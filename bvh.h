@@ -43,11 +43,22 @@ public:
       left = make_shared<bvh_node>(objects, start, middle_index);
       right = make_shared<bvh_node>(objects, middle_index, end);
     }
+    set_motion_bounds();
+  }
+
+  // Node with children that are already built, e.g. when reading the scene cache
+  bvh_node(shared_ptr<hittable> left, shared_ptr<hittable> right) : left(left), right(right)
+  {
+    bbox = aabb(left->bounding_box(), right->bounding_box());
+    set_motion_bounds();
   }
 
   bool hit(const ray &r, interval ray_t, hit_record &rec) const override
   {
-    if (!bbox.hit(r, ray_t))
+    if (rec.bvh_visits)
+      ++*rec.bvh_visits;
+    // Nodes with moving objects test the box they have at the ray's time
+    if (!(moving ? interpolate(start_bbox, end_bbox, r.time()) : bbox).hit(r, ray_t))
     {
       return false;
     }
@@ -63,10 +74,76 @@ public:
     return bbox;
   }
 
+  void motion_bounds(aabb &start, aabb &end) const override
+  {
+    start = start_bbox;
+    end = end_bbox;
+  }
+
+  // Recomputes the boxes of this node and the BVH nodes under it once the objects in
+  // them have moved, e.g. between frames of an animation, keeping the tree as it is.
+  // Other objects must already report their new bounds.
+  void refit()
+  {
+    if (auto node = dynamic_cast<bvh_node *>(left.get()))
+      node->refit();
+    if (right != left)
+    {
+      if (auto node = dynamic_cast<bvh_node *>(right.get()))
+        node->refit();
+    }
+    bbox = aabb(left->bounding_box(), right->bounding_box());
+    set_motion_bounds();
+  }
+
+  // Expected number of boxes and objects a ray through this node tests below it: their
+  // summed surface area relative to this node's. Refitting stretches boxes over objects
+  // that move apart and this goes up, so comparing it with its value right after a build
+  // tells when building the tree again would pay off.
+  double traversal_cost() const
+  {
+    double area = bbox.surface_area();
+    return area > 0 ? area_below() / area : 0;
+  }
+
 private:
+  friend class scene_cache;
+  friend class light_list;
+
   shared_ptr<hittable> left;
   shared_ptr<hittable> right;
   aabb bbox;
+  aabb start_bbox, end_bbox; // see motion_bounds
+  bool moving;
+
+  void set_motion_bounds()
+  {
+    aabb left_start, left_end, right_start, right_end;
+    left->motion_bounds(left_start, left_end);
+    right->motion_bounds(right_start, right_end);
+    start_bbox = aabb(left_start, right_start);
+    end_bbox = aabb(left_end, right_end);
+    moving = false;
+    for (int axis = 0; axis < 3; axis++)
+    {
+      const interval &a = start_bbox.axis_interval(axis), &b = end_bbox.axis_interval(axis);
+      moving = moving || a.min != b.min || a.max != b.max;
+    }
+  }
+
+  double area_below() const
+  {
+    double area = 0;
+    for (const hittable *child : {left.get(), right.get()})
+    {
+      area += child->bounding_box().surface_area();
+      if (auto node = dynamic_cast<const bvh_node *>(child))
+        area += node->area_below();
+      if (right == left)
+        break;
+    }
+    return area;
+  }
 
   static bool box_compare(
       const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis_index)
@@ -1,8 +1,16 @@
 #ifndef CAMERA_H
 #define CAMERA_H
 
+#include "bvh.h"
+#include "denoiser.h"
+#include "environment.h"
+#include "filter.h"
 #include "hittable.h"
+#include "layers.h"
+#include "lights.h"
 #include "material.h"
+#include "medium.h"
+#include "sampler.h"
 
 class camera
 {
@@ -21,13 +29,40 @@ public:
     int samples_per_pixel = 10;
     int max_depth = 10; // max number of bounces for each ray
 
-    void render(const hittable &world, int chunk, bool use_background = false)
+    // Lights sampled directly at every diffuse or glossy bounce, if set. Light hit by
+    // chance is combined with it by multiple importance sampling.
+    const light_list *lights = nullptr;
+    // Replaces the background for rays that escape, and is sampled like the lights
+    const environment_map *environment = nullptr;
+    // Medium the camera is inside of, if any. Paths only notice other media by crossing
+    // their boundaries.
+    const medium *camera_medium = nullptr;
+    // Where the numbers for pixel positions, lens, time and every bounce come from. seed
+    // changes the scrambling, e.g. between frames of an animation.
+    sampler_type sampling = default_sampler_type();
+    uint32_t seed = 0;
+    // How samples are weighted into the pixels around them, and how far they reach in
+    // pixels (0 for the filter's usual radius)
+    filter_type filter = default_filter_type();
+    double filter_radius = 0;
+    // Run the denoiser over the finished image, guided by the albedo, normal and depth
+    // the camera rays see (RT_DENOISE=1). A chunk can't be denoised without the rows
+    // around it, so when rendering in chunks each one writes its rows' buffers to
+    // aov_directory/<chunk>.aov instead (RT_AOV_DIR), for a --combine run to put together.
+    bool denoise = getenv("RT_DENOISE") != nullptr;
+    const char *aov_directory = getenv("RT_AOV_DIR");
+    // OpenEXR file to write the image to along with those buffers, the material and
+    // primitive IDs, BVH visits and sample counts, a layer each (RT_LAYERS=out/render.exr).
+    // Chunks leave it to the --combine run too.
+    std::string layers_path = getenv("RT_LAYERS") ? getenv("RT_LAYERS") : "";
+
+    void render(const hittable &world, int chunk, bool use_background = false, std::ostream &out = std::cout)
     {
         initialize();
 
         if (chunk < 0)
         {
-            std::cout << "P3\n"
+            out << "P3\n"
                       << image_width << ' ' << image_height << "\n255\n";
             if (chunk == -2)
             {
@@ -35,6 +70,12 @@ public:
             }
         }
 
+        medium_stack camera_media;
+        if (camera_medium)
+        {
+            camera_media.push(camera_medium);
+        }
+
         int num_chunks = 20;
         int rows_per_chunk = int(image_height / num_chunks);
         int chunk_start = chunk == -1 ? 0 : rows_per_chunk * chunk;
@@ -42,7 +83,21 @@ public:
                         : chunk == num_chunks - 1 ? image_height
                                                   : chunk_start + rows_per_chunk;
 
-        for (int j = chunk_start; j < chunk_end; j++)
+        // Samples are splatted into every pixel of the chunk the filter reaches from them,
+        // so the rows just outside the chunk are rendered too, and a row is written as soon
+        // as the last row that reaches it is done. Denoised rows have to wait for the
+        // whole image.
+        int reach = film_filter.reach();
+        film_start = chunk_start;
+        film_end = chunk_end;
+        film.assign(size_t(chunk_end - chunk_start) * image_width, film_pixel());
+        keep_aovs = chunk == -1 ? denoise || !layers_path.empty() : aov_directory != nullptr;
+        bool stream_rows = chunk != -1 || !denoise;
+        int next_row = chunk_start;
+
+        sampler samples(sampling, samples_per_pixel, seed);
+        int last_row = std::min(image_height, chunk_end + reach);
+        for (int j = std::max(0, chunk_start - reach); j < last_row; j++)
         {
             if (chunk == -1)
             {
@@ -50,19 +105,71 @@ public:
             }
             for (int i = 0; i < image_width; i++)
             {
-                color pixel_color = color();
                 for (int sample = 0; sample < samples_per_pixel; sample++)
                 {
-                    ray r = get_ray(i, j);
-                    pixel_color += ray_color(r, world, max_depth, use_background);
+                    samples.start_pixel_sample(i, j, sample);
+                    vec3 pixel_offset = sample_square(samples);
+                    ray r = get_ray(i, j, pixel_offset, samples);
+                    aov_sample aov;
+                    bvh_visits = keep_aovs ? &aov.bvh_visits : nullptr;
+                    color sample_color = ray_color(r, world, max_depth, use_background, camera_media, samples, 0, keep_aovs ? &aov : nullptr);
+                    splat(i, j, pixel_offset, sample_color, aov);
                 }
+            }
+
+            for (; stream_rows && next_row < chunk_end && next_row + reach <= j; next_row++)
+            {
+                write_row(out, next_row);
+            }
+        }
 
-                write_color(std::cout, pixel_color / samples_per_pixel);
+        for (; stream_rows && next_row < chunk_end; next_row++)
+        {
+            write_row(out, next_row);
+        }
+        if (!keep_aovs)
+        {
+            return;
+        }
+
+        aov_image image;
+        image.width = image_width;
+        image.height = chunk_end - chunk_start;
+        for (const film_pixel &pixel : film)
+        {
+            image.pixels.push_back(resolve(pixel));
+        }
+        if (chunk >= 0)
+        {
+            std::string path = std::string(aov_directory) + "/" + std::to_string(chunk) + ".aov";
+            if (!write_aov_chunk(path, image_width, image_height, chunk_start, image.pixels))
+            {
+                std::clog << "Could not write " << path << std::endl;
             }
+            return;
+        }
+
+        std::vector<color> denoised;
+        if (denoise)
+        {
+            std::clog << "\rDenoising...                 " << std::flush;
+            denoised = denoiser().denoise(image);
+            for (const color &pixel_color : denoised)
+            {
+                write_color(out, pixel_color);
+            }
+        }
+        if (!layers_path.empty() && !write_layers(layers_path, image, denoised))
+        {
+            std::clog << "\nCould not write " << layers_path << std::endl;
         }
     }
 
 private:
+    // Limit on invisible medium boundaries passed through in a row, against rays that get
+    // stuck on one
+    static constexpr int max_crossings = 64;
+
     int image_height;
     point3 camera_center;
     point3 pixel00_loc;
@@ -71,8 +178,36 @@ private:
     vec3 u, v, w; // camera frame basis vectors
     vec3 defocus_disk_u, defocus_disk_v;
 
+    // Weighted sums of the samples landing around a pixel
+    struct film_pixel
+    {
+        color value;
+        double weight = 0, weight_squared = 0;
+        double luminance_squared = 0; // for the variance
+        // of aov_sample, if keep_aovs
+        color albedo;
+        vec3 normal;
+        double depth = 0, depth_weight = 0; // only over samples that hit a surface
+        color emission;
+        // of the samples taken in the pixel itself
+        uint32_t samples = 0;
+        uint64_t bvh_visits = 0;
+        double center_distance = infinity; // of the sample the IDs come from
+        uint32_t material_id = 0, primitive_id = 0;
+    };
+
+    pixel_filter film_filter;
+    // Rows film_start up to film_end
+    int film_start, film_end;
+    std::vector<film_pixel> film;
+    bool keep_aovs = false;
+    // Where the rays of the current sample count the BVH nodes they test, while AOVs are kept
+    uint64_t *bvh_visits = nullptr;
+
     void initialize()
     {
+        film_filter = pixel_filter(filter, filter_radius);
+
         image_height = std::max(1, int(image_width / aspect_ratio));
         camera_center = lookfrom;
 
@@ -109,7 +244,10 @@ private:
         pixel00_loc = viewport_upper_left + 0.5 * (pixel_delta_u + pixel_delta_v);
     }
 
-    color ray_color(const ray &r, const hittable &world, int bounces_remaining, bool use_background) const
+    // media are the media r starts out in. scatter_pdf is the density the previous bounce
+    // sampled r's direction with, when that bounce also sampled the lights, and 0 otherwise.
+    // aov, if given, is filled in from what r hits, looking through mirrors and glass.
+    color ray_color(const ray &r, const hittable &world, int bounces_remaining, bool use_background, medium_stack media, sampler &samples, double scatter_pdf = 0, aov_sample *aov = nullptr) const
     {
         if (bounces_remaining <= 0)
         {
@@ -117,9 +255,11 @@ private:
         }
 
         hit_record rec;
-        // Ignore very close intersections since that could be "shadow acne" (close intersections due to rounding error)
-        if (world.hit(r, interval(0.001, infinity), rec))
+        rec.bvh_visits = bvh_visits;
+        samples.start_bounce(max_depth - bounces_remaining);
+        if (next_interaction(r, world, media, samples.get_1d(), rec))
         {
+            rec.set_differentials(r);
             // Red sphere
             // return vec3(1, 0.0, 0.0);
             // Normals sphere
@@ -133,30 +273,95 @@ private:
             // Use hit objects' material
             ray scattered_ray;
             color attenuation;
-            color color_from_emission = rec.mat->emitted(r, rec, rec.u, rec.v, rec.p);
+            color color_from_emission = rec.mat->is_emissive() ? rec.mat->emitted(r, rec, rec.u, rec.v, rec.p) : color();
+            if (scatter_pdf > 0 && lights && rec.light >= 0)
+            {
+                // The previous bounce could also have sampled this point on the light directly
+                color_from_emission *= power_heuristic(scatter_pdf, lights->pdf(r.origin(), rec));
+            }
+
+            // The light and the environment have fixed slots in the bounce's dimensions,
+            // skipped when unused, so the material always reads the same ones
+            bool sample_lights = (lights || environment) && rec.mat->samples_lights();
+            color color_from_lights;
+            if (sample_lights && lights)
+            {
+                color_from_lights += sample_one_light(r, rec, world, media, samples);
+            }
+            else
+            {
+                samples.skip(3);
+            }
+            if (sample_lights && environment)
+            {
+                color_from_lights += sample_environment(r, rec, world, media, samples);
+            }
+            else
+            {
+                samples.skip(3);
+            }
 
-            bool scatters = rec.mat->scatter(r, rec, attenuation, scattered_ray);
+            double pdf, u1 = samples.get_1d(), u2, u3;
+            samples.get_2d(u2, u3);
+            bool scatters = rec.mat->scatter(r, rec, u1, u2, u3, attenuation, scattered_ray, pdf);
+            bool look_through = false;
+            if (aov)
+            {
+                if (aov->material_id == 0)
+                {
+                    aov->material_id = rec.mat->id;
+                    aov->primitive_id = rec.primitive;
+                }
+                aov->emission += aov->albedo * color_from_emission;
+                look_through = scatters && (rec.mat->type == material_type::dielectric || (rec.mat->type == material_type::metal && rec.mat->fuzz_factor == 0));
+                aov->albedo = aov->albedo * (look_through ? attenuation : rec.mat->albedo(rec));
+                // A point in a medium has no surface to guide the denoiser with
+                bool surface = rec.mat->type != material_type::isotropic;
+                if (surface && aov->depth == 0)
+                {
+                    aov->depth = rec.t * r.direction().length();
+                }
+                if (surface && !look_through)
+                {
+                    aov->normal = rec.normal;
+                }
+            }
             if (scatters)
             {
-                color color_from_scatter = attenuation * ray_color(scattered_ray, world, bounces_remaining - 1, use_background);
-                return color_from_scatter + color_from_emission;
+                // Transmission through a medium's boundary takes the path into or out of it
+                medium_stack scattered_media = media;
+                if (rec.interior && dot(scattered_ray.direction(), rec.normal) < 0)
+                {
+                    scattered_media.cross(rec);
+                }
+                color color_from_scatter = attenuation * ray_color(scattered_ray, world, bounces_remaining - 1, use_background, scattered_media, samples, sample_lights ? pdf : 0, look_through ? aov : nullptr);
+                return color_from_scatter + color_from_emission + color_from_lights;
             }
             else
             {
-                return color_from_emission;
+                return color_from_emission + color_from_lights;
             }
         }
+        else if (environment)
+        {
+            color radiance = environment->value(r.direction());
+            if (scatter_pdf > 0)
+            {
+                radiance *= power_heuristic(scatter_pdf, environment->pdf(unit_vector(r.direction())));
+            }
+            return escaped(radiance, aov);
+        }
         else
         {
             if (use_background)
             {
-                return background;
+                return escaped(background, aov);
             }
             else
             {
                 vec3 unit_direction = unit_vector(r.direction());
                 double a = 0.5 * (unit_direction.y() + 1.0); // scale from (-1, 1) to (0, 1)
-                return (1.0 - a) * color(1.0, 1.0, 1.0) + a * color(0.5, 0.7, 1.0);
+                return escaped((1.0 - a) * color(1.0, 1.0, 1.0) + a * color(0.5, 0.7, 1.0), aov);
             }
         }
 
@@ -165,27 +370,256 @@ private:
         return (1.0 - a) * color(1.0, 1.0, 1.0) + a * color(0.5, 0.7, 1.0);
     }
 
-    ray get_ray(int i, int j)
+    // The sky seen straight from the camera counts as emission for the denoiser
+    static color escaped(const color &radiance, aov_sample *aov)
+    {
+        if (aov)
+        {
+            aov->emission += aov->albedo * radiance;
+        }
+        return radiance;
+    }
+
+    // Next place along r where something happens to it, either a surface or a point where
+    // the medium it is travelling through scatters it. Boundaries of media that have no
+    // surface of their own are passed through, entering or leaving the medium in media.
+    // u is the sampler's number for the first medium the ray travels through.
+    bool next_interaction(const ray &r, const hittable &world, medium_stack &media, double u, hit_record &rec) const
+    {
+        // Ignore very close intersections since that could be "shadow acne" (close intersections due to rounding error)
+        double t_min = 0.001;
+        for (int crossings = 0; crossings < max_crossings; crossings++)
+        {
+            bool hit_surface = world.hit(r, interval(t_min, infinity), rec);
+            const medium *inside = media.current();
+            double t;
+            if (inside && inside->sample_scatter(r, interval(t_min, hit_surface ? rec.t : infinity), u, t))
+            {
+                inside->set_scatter_record(r, t, rec);
+                return true;
+            }
+            if (inside)
+            {
+                // media further along the ray get numbers of their own
+                u = random_double();
+            }
+            if (!hit_surface || rec.mat)
+            {
+                return hit_surface;
+            }
+            media.cross(rec);
+            t_min = rec.t + 0.001;
+        }
+        return false;
+    }
+
+    // Fraction of light that gets along r from its origin to r.at(t_max), which is 0 if a
+    // surface is in the way and less than 1 through media
+    double transmittance(const ray &r, double t_max, medium_stack media, const hittable &world) const
+    {
+        double result = 1;
+        double t_min = 0.001;
+        for (int crossings = 0; crossings < max_crossings; crossings++)
+        {
+            hit_record blocker;
+            blocker.bvh_visits = bvh_visits;
+            bool hit_surface = world.hit(r, interval(t_min, t_max), blocker);
+            if (const medium *inside = media.current())
+            {
+                result *= inside->transmittance(r, interval(t_min, hit_surface ? blocker.t : t_max));
+            }
+            if (!hit_surface)
+            {
+                return result;
+            }
+            if (blocker.mat)
+            {
+                return 0;
+            }
+            media.cross(blocker);
+            t_min = blocker.t + 0.001;
+        }
+        return 0;
+    }
+
+    // Light arriving at rec straight from a point picked on one of the lights, weighted
+    // against the material sampling the same direction
+    color sample_one_light(const ray &r, const hit_record &rec, const hittable &world, const medium_stack &media, sampler &samples) const
+    {
+        light_sample light;
+        double u1 = samples.get_1d(), u2, u3;
+        samples.get_2d(u2, u3);
+        if (!lights->sample(rec.p, u1, u2, u3, light) || light.emission.near_zero())
+        {
+            return color();
+        }
+        double bsdf_pdf;
+        color f = rec.mat->eval(r, rec, light.direction, bsdf_pdf);
+        if (bsdf_pdf <= 0)
+        {
+            return color();
+        }
+
+        double visible = transmittance(ray(rec.p, light.direction, r.time()), light.distance * (1 - 1e-4), media, world);
+        if (visible <= 0)
+        {
+            return color();
+        }
+        return visible * f * light.emission * power_heuristic(light.pdf, bsdf_pdf) / light.pdf;
+    }
+
+    // Same as sample_one_light, for a direction towards the environment
+    color sample_environment(const ray &r, const hit_record &rec, const hittable &world, const medium_stack &media, sampler &samples) const
+    {
+        vec3 direction;
+        double light_pdf, u1 = samples.get_1d(), u2, u3;
+        samples.get_2d(u2, u3);
+        if (!environment->sample(u1, u2, u3, direction, light_pdf) || light_pdf <= 0)
+        {
+            return color();
+        }
+        double bsdf_pdf;
+        color f = rec.mat->eval(r, rec, direction, bsdf_pdf);
+        if (bsdf_pdf <= 0)
+        {
+            return color();
+        }
+
+        double visible = transmittance(ray(rec.p, direction, r.time()), infinity, media, world);
+        if (visible <= 0)
+        {
+            return color();
+        }
+        return visible * f * environment->value(direction) * power_heuristic(light_pdf, bsdf_pdf) / light_pdf;
+    }
+
+    static double power_heuristic(double pdf, double other_pdf)
+    {
+        return pdf * pdf / (pdf * pdf + other_pdf * other_pdf);
+    }
+
+    // Adds a sample taken at pixel_offset from the center of pixel (i, j) to the pixels
+    // around it
+    void splat(int i, int j, const vec3 &pixel_offset, const color &sample_color, const aov_sample &aov)
+    {
+        // A path that went wrong somewhere would spread to every pixel it reaches
+        if (std::isnan(sample_color.x()) || std::isnan(sample_color.y()) || std::isnan(sample_color.z()))
+        {
+            return;
+        }
+
+        int reach = film_filter.reach();
+        for (int y = std::max(film_start, j - reach); y <= std::min(film_end - 1, j + reach); y++)
+        {
+            double weight_y = film_filter.evaluate(j + pixel_offset.y() - y);
+            if (weight_y == 0)
+            {
+                continue;
+            }
+            for (int x = std::max(0, i - reach); x <= std::min(image_width - 1, i + reach); x++)
+            {
+                double weight = weight_y * film_filter.evaluate(i + pixel_offset.x() - x);
+                film_pixel &pixel = film[size_t(y - film_start) * image_width + x];
+                pixel.value += weight * sample_color;
+                pixel.weight += weight;
+                if (keep_aovs)
+                {
+                    pixel.weight_squared += weight * weight;
+                    // The noise is in the part that isn't seen emission
+                    double noisy = luminance(sample_color - aov.emission);
+                    pixel.luminance_squared += weight * noisy * noisy;
+                    pixel.albedo += weight * aov.albedo;
+                    pixel.normal += weight * aov.normal;
+                    if (aov.depth > 0)
+                    {
+                        pixel.depth += weight * aov.depth;
+                        pixel.depth_weight += weight;
+                    }
+                    pixel.emission += weight * aov.emission;
+                }
+            }
+        }
+
+        if (keep_aovs && j >= film_start && j < film_end)
+        {
+            film_pixel &pixel = film[size_t(j - film_start) * image_width + i];
+            pixel.samples++;
+            pixel.bvh_visits += aov.bvh_visits;
+            double center_distance = pixel_offset.length_squared();
+            if (center_distance < pixel.center_distance)
+            {
+                pixel.center_distance = center_distance;
+                pixel.material_id = aov.material_id;
+                pixel.primitive_id = aov.primitive_id;
+            }
+        }
+    }
+
+    void write_row(std::ostream &out, int j) const
+    {
+        for (int i = 0; i < image_width; i++)
+        {
+            write_color(out, resolve(film[size_t(j - film_start) * image_width + i]).value);
+        }
+    }
+
+    aov_pixel resolve(const film_pixel &pixel) const
+    {
+        aov_pixel result;
+        result.material_id = pixel.material_id;
+        result.primitive_id = pixel.primitive_id;
+        result.samples = pixel.samples;
+        result.bvh_visits = pixel.samples > 0 ? double(pixel.bvh_visits) / pixel.samples : 0;
+        // Negative lobes can leave a pixel with next to no weight at low sample counts
+        if (pixel.weight <= 0)
+        {
+            return result;
+        }
+        result.value = pixel.value / pixel.weight;
+        if (keep_aovs)
+        {
+            result.albedo = pixel.albedo / pixel.weight;
+            result.normal = pixel.normal / pixel.weight;
+            result.depth = pixel.depth_weight > 0 ? pixel.depth / pixel.depth_weight : 0;
+            result.emission = pixel.emission / pixel.weight;
+            // of the samples, over how many samples the weights add up to
+            double mean = luminance(result.value - result.emission);
+            double spread = std::fmax(0, pixel.luminance_squared / pixel.weight - mean * mean);
+            result.variance = spread * pixel.weight_squared / (pixel.weight * pixel.weight);
+        }
+        return result;
+    }
+
+    // Uses the sampler's camera_dimensions: the position in the pixel, which
+    // sample_square has taken, then on the lens, and the time
+    ray get_ray(int i, int j, const vec3 &pixel_offset, sampler &samples)
     {
-        vec3 pixel_offset = sample_square();
         vec3 sample_location = pixel00_loc + ((j + pixel_offset.y()) * pixel_delta_v) + ((i + pixel_offset.x()) * pixel_delta_u);
-        vec3 ray_origin = (defocus_angle <= 0) ? lookfrom : defocus_disk_sample();
+        vec3 lens = defocus_disk_sample(samples);
+        vec3 ray_origin = (defocus_angle <= 0) ? lookfrom : lens;
         vec3 ray_direction = sample_location - ray_origin;
-        double time = random_double();
+        double time = samples.get_1d();
         // double time = 0;
         ray r(ray_origin, ray_direction, time);
+        r.set_differentials(ray_origin, ray_direction + pixel_delta_u, ray_origin, ray_direction + pixel_delta_v);
+        // Each sample only has to cover its share of the pixel
+        r.scale_differentials(std::fmax(0.125, 1.0 / std::sqrt(samples_per_pixel)));
         return r;
     }
 
-    vec3 defocus_disk_sample() const
+    vec3 defocus_disk_sample(sampler &samples) const
     {
-        vec3 p = random_in_unit_disk();
+        double u1, u2;
+        samples.get_2d(u1, u2);
+        vec3 p = point_in_unit_disk(u1, u2);
         return camera_center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
     }
 
-    vec3 sample_square() const
+    vec3 sample_square(sampler &samples) const
     {
-        return vec3(random_double(-0.5, 0.5), random_double(-0.5, 0.5), 0);
+        double u1, u2;
+        samples.get_2d(u1, u2);
+        return vec3(u1 - 0.5, u2 - 0.5, 0);
     }
 };
 
@@ -0,0 +1,287 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "color.h"
+
+// What a camera sample sees first, besides its color. Mirrors and glass are looked
+// through: albedo is then the product of what they pass on and the albedo behind them.
+// Rays that escape and points in media leave normal and depth at zero.
+struct aov_sample
+{
+  color albedo = color(1, 1, 1);
+  vec3 normal;
+  double depth = 0; // distance from the camera to the first hit
+  color emission;   // part of the color emitted by what is seen, which has no noise
+  // What the camera ray hits, mirrors and glass included, or 0 if it escapes
+  uint32_t material_id = 0, primitive_id = 0;
+  uint64_t bvh_visits = 0; // BVH nodes tested for every ray of the path
+};
+
+// A pixel's color and auxiliary buffers (AOVs), averaged over its samples like the color,
+// and how much the color varies from one render to the next
+struct aov_pixel
+{
+  color value;
+  color albedo;
+  vec3 normal;
+  double depth = 0;
+  color emission;
+  double variance = 0; // of the luminance of value - emission
+  // Only over the samples taken in the pixel itself. IDs can't be averaged, so they are
+  // those of the sample nearest the pixel's center.
+  uint32_t material_id = 0, primitive_id = 0;
+  uint32_t samples = 0; // that made it into the image, i.e. weren't NaN
+  double bvh_visits = 0; // per sample
+};
+
+struct aov_image
+{
+  int width = 0, height = 0;
+  std::vector<aov_pixel> pixels;
+
+  aov_pixel &at(int x, int y) { return pixels[size_t(y) * width + x]; }
+  const aov_pixel &at(int x, int y) const { return pixels[size_t(y) * width + x]; }
+};
+
+inline double luminance(const color &c)
+{
+  return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
+// Rows first_row and on of an image that is rendered in chunks, to be put together by
+// read_aov_chunks once every chunk is done. Returns false if the file can't be written.
+inline bool write_aov_chunk(const std::string &path, int width, int height, int first_row, const std::vector<aov_pixel> &rows)
+{
+  std::ofstream out(path, std::ios::binary);
+  int32_t header[4] = {width, height, first_row, int32_t(rows.size() / width)};
+  out.write(reinterpret_cast<const char *>(header), sizeof(header));
+  out.write(reinterpret_cast<const char *>(rows.data()), rows.size() * sizeof(aov_pixel));
+  return bool(out);
+}
+
+// Reads directory/0.aov, 1.aov and so on until one is missing. Returns false unless
+// they fit together into the whole image.
+inline bool read_aov_chunks(const std::string &directory, aov_image &image)
+{
+  int rows = 0;
+  for (int chunk = 0;; chunk++)
+  {
+    std::ifstream in(directory + "/" + std::to_string(chunk) + ".aov", std::ios::binary);
+    if (!in)
+      return chunk > 0 && rows == image.height;
+    int32_t header[4];
+    if (!in.read(reinterpret_cast<char *>(header), sizeof(header)))
+      return false;
+    if (chunk == 0)
+    {
+      image.width = header[0];
+      image.height = header[1];
+      image.pixels.assign(size_t(image.width) * image.height, aov_pixel());
+    }
+    if (header[0] != image.width || header[1] != image.height || header[2] < 0 || header[3] < 0 || header[2] + header[3] > image.height)
+      return false;
+    size_t bytes = size_t(header[3]) * image.width * sizeof(aov_pixel);
+    if (!in.read(reinterpret_cast<char *>(&image.at(0, header[2])), bytes))
+      return false;
+    rows += header[3];
+  }
+}
+
+// Single frame version of spatiotemporal variance guided filtering (Schied et al. 2017):
+// an edge avoiding a-trous wavelet filter (Dammertz et al. 2010), run with a 5x5 kernel
+// whose taps spread twice as far each iteration.
+//
+// Emission seen straight from the camera is taken out of the color and the rest is
+// divided by the albedo, so that neither lights nor textures are blurred with the noise:
+// only the lighting is filtered, and they are put back at the end. Each tap is weighted
+// by how alike the two pixels are: their normals, their depths compared to how fast
+// depth changes across the image, and their luminance compared to how noisy it is, from
+// the variance of the samples. That variance is filtered along with the color, so later
+// iterations, which reach further, stop at smaller differences.
+class denoiser
+{
+public:
+  int iterations = 5;
+  double sigma_luminance = 4;
+  double sigma_normal = 32;
+  double sigma_depth = 1;
+
+  std::vector<color> denoise(const aov_image &image) const
+  {
+    int width = image.width, height = image.height;
+    size_t pixels = size_t(width) * height;
+
+    std::vector<color> lighting(pixels);
+    std::vector<vec3> normals(pixels);
+    std::vector<double> variance(pixels);
+    for (size_t i = 0; i < pixels; i++)
+    {
+      const aov_pixel &pixel = image.pixels[i];
+      lighting[i] = demodulate(pixel.value - pixel.emission, pixel.albedo);
+      double scale = luminance(pixel.albedo) > albedo_epsilon ? luminance(pixel.albedo) : 1;
+      variance[i] = pixel.variance / (scale * scale);
+      double length = pixel.normal.length();
+      normals[i] = length > 0 ? pixel.normal / length : vec3();
+    }
+    std::vector<double> depth_slope = depth_slopes(image);
+
+    std::vector<color> next_lighting(pixels);
+    std::vector<double> next_variance(pixels);
+    for (int iteration = 0; iteration < iterations; iteration++)
+    {
+      int step = 1 << iteration;
+      std::vector<double> blurred = blur_3x3(variance, width, height);
+      for (int y = 0; y < height; y++)
+      {
+        for (int x = 0; x < width; x++)
+        {
+          size_t p = size_t(y) * width + x;
+          double depth_p = image.pixels[p].depth;
+          double luminance_p = luminance(lighting[p]);
+          double luminance_scale = sigma_luminance * std::sqrt(std::fmax(blurred[p], 0)) + 1e-6;
+
+          color sum;
+          double weight_sum = 0, variance_sum = 0;
+          for (int dy = -2; dy <= 2; dy++)
+          {
+            int qy = y + dy * step;
+            if (qy < 0 || qy >= height)
+              continue;
+            for (int dx = -2; dx <= 2; dx++)
+            {
+              int qx = x + dx * step;
+              if (qx < 0 || qx >= width)
+                continue;
+              size_t q = size_t(qy) * width + qx;
+
+              double weight = kernel[dx + 2] * kernel[dy + 2];
+              if (q != p)
+              {
+                weight *= normal_weight(normals[p], normals[q]);
+                weight *= depth_weight(depth_p, image.pixels[q].depth, depth_slope[p] * step * std::sqrt(double(dx * dx + dy * dy)));
+                weight *= std::exp(-std::fabs(luminance_p - luminance(lighting[q])) / luminance_scale);
+              }
+              sum += weight * lighting[q];
+              weight_sum += weight;
+              variance_sum += weight * weight * variance[q];
+            }
+          }
+          // the pixel itself always has some weight
+          next_lighting[p] = sum / weight_sum;
+          next_variance[p] = variance_sum / (weight_sum * weight_sum);
+        }
+      }
+      lighting.swap(next_lighting);
+      variance.swap(next_variance);
+    }
+
+    std::vector<color> result(pixels);
+    for (size_t i = 0; i < pixels; i++)
+      result[i] = remodulate(lighting[i], image.pixels[i].albedo) + image.pixels[i].emission;
+    return result;
+  }
+
+private:
+  static constexpr double albedo_epsilon = 1e-3;
+  static constexpr double kernel[5] = {1.0 / 16, 1.0 / 4, 3.0 / 8, 1.0 / 4, 1.0 / 16}; // B3 spline
+
+  // Black surfaces have no lighting to speak of, so their color is filtered as it is
+  static color demodulate(const color &value, const color &albedo)
+  {
+    return color(albedo.x() > albedo_epsilon ? value.x() / albedo.x() : value.x(),
+                 albedo.y() > albedo_epsilon ? value.y() / albedo.y() : value.y(),
+                 albedo.z() > albedo_epsilon ? value.z() / albedo.z() : value.z());
+  }
+
+  static color remodulate(const color &lighting, const color &albedo)
+  {
+    return color(albedo.x() > albedo_epsilon ? lighting.x() * albedo.x() : lighting.x(),
+                 albedo.y() > albedo_epsilon ? lighting.y() * albedo.y() : lighting.y(),
+                 albedo.z() > albedo_epsilon ? lighting.z() * albedo.z() : lighting.z());
+  }
+
+  // Escaped rays have no normal and only blend with each other
+  double normal_weight(const vec3 &n_p, const vec3 &n_q) const
+  {
+    bool missed_p = n_p.length_squared() == 0, missed_q = n_q.length_squared() == 0;
+    if (missed_p || missed_q)
+      return missed_p == missed_q ? 1 : 0;
+    return std::pow(std::fmax(0, dot(n_p, n_q)), sigma_normal);
+  }
+
+  // expected is how much depth would change over the distance between the pixels if the
+  // surface at p carried on
+  double depth_weight(double depth_p, double depth_q, double expected) const
+  {
+    if (depth_p <= 0 || depth_q <= 0)
+      return depth_p <= 0 && depth_q <= 0 ? 1 : 0;
+    return std::exp(-std::fabs(depth_p - depth_q) / (sigma_depth * expected + 1e-3 * depth_p));
+  }
+
+  // How fast depth changes per pixel, from whichever neighbour along each axis changes
+  // it less, so that the edge of an object doesn't count as a steep slope
+  static std::vector<double> depth_slopes(const aov_image &image)
+  {
+    std::vector<double> slopes(image.pixels.size(), 0);
+    for (int y = 0; y < image.height; y++)
+    {
+      for (int x = 0; x < image.width; x++)
+      {
+        double depth = image.at(x, y).depth;
+        if (depth <= 0)
+          continue;
+        double slope[2] = {infinity, infinity};
+        for (int axis = 0; axis < 2; axis++)
+        {
+          for (int side = -1; side <= 1; side += 2)
+          {
+            int nx = x + (axis == 0 ? side : 0), ny = y + (axis == 1 ? side : 0);
+            if (nx < 0 || nx >= image.width || ny < 0 || ny >= image.height || image.at(nx, ny).depth <= 0)
+              continue;
+            slope[axis] = std::fmin(slope[axis], std::fabs(image.at(nx, ny).depth - depth));
+          }
+          if (slope[axis] == infinity)
+            slope[axis] = 0;
+        }
+        slopes[size_t(y) * image.width + x] = std::fmax(slope[0], slope[1]);
+      }
+    }
+    return slopes;
+  }
+
+  static std::vector<double> blur_3x3(const std::vector<double> &values, int width, int height)
+  {
+    static const double weights[3] = {0.25, 0.5, 0.25};
+    std::vector<double> result(values.size());
+    for (int y = 0; y < height; y++)
+    {
+      for (int x = 0; x < width; x++)
+      {
+        double sum = 0, weight_sum = 0;
+        for (int dy = -1; dy <= 1; dy++)
+        {
+          for (int dx = -1; dx <= 1; dx++)
+          {
+            int qx = x + dx, qy = y + dy;
+            if (qx < 0 || qx >= width || qy < 0 || qy >= height)
+              continue;
+            double weight = weights[dx + 1] * weights[dy + 1];
+            sum += weight * values[size_t(qy) * width + qx];
+            weight_sum += weight;
+          }
+        }
+        result[size_t(y) * width + x] = sum / weight_sum;
+      }
+    }
+    return result;
+  }
+};
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+
+#include <vector>
+
+#include "lights.h"
+#include "rtw_stb_image.h"
+
+// Light arriving from infinitely far away, from an equirectangular (latitude-longitude)
+// image, usually an HDR probe. The top row of the image is straight up (+z, the up axis
+// of glTF scenes here) and u goes around the horizon. Directions are importance sampled
+// by picking a pixel in proportion to its luminance times the solid angle it covers,
+// through an alias table, and then a point inside that pixel.
+class environment_map
+{
+public:
+  // intensity scales every pixel
+  environment_map(const char *filename, double intensity = 1)
+  {
+    rtw_image image(filename);
+    width = image.width();
+    height = image.height();
+    if (width == 0 || height == 0)
+      return;
+
+    pixels.resize(3 * size_t(width) * height);
+    std::vector<double> weights(size_t(width) * height);
+    for (int y = 0; y < height; y++)
+    {
+      // rows near the poles cover less solid angle
+      double sin_theta = std::sin(pi * (y + 0.5) / height);
+      for (int x = 0; x < width; x++)
+      {
+        const float *pixel = image.pixel_data(x, y);
+        float *stored = &pixels[3 * (size_t(y) * width + x)];
+        for (int c = 0; c < 3; c++)
+          stored[c] = pixel[c] * intensity;
+        weights[size_t(y) * width + x] = (0.2126 * stored[0] + 0.7152 * stored[1] + 0.0722 * stored[2]) * sin_theta;
+      }
+    }
+    table = alias_table(weights);
+  }
+
+  bool valid() const { return !table.empty(); }
+
+  color value(const vec3 &direction) const
+  {
+    int x, y;
+    pixel_for(unit_vector(direction), x, y);
+    const float *pixel = &pixels[3 * (size_t(y) * width + x)];
+    return color(pixel[0], pixel[1], pixel[2]);
+  }
+
+  // Random direction towards the environment and its density per unit solid angle
+  bool sample(double u1, double u2, double u3, vec3 &direction, double &pdf) const
+  {
+    int index = table.sample(u1);
+    int x = index % width, y = index / width;
+    double theta = pi * (y + u3) / height;
+    double phi = 2 * pi * (x + u2) / width - pi;
+    double sin_theta = std::sin(theta);
+    if (sin_theta <= 0)
+      return false;
+    direction = vec3(sin_theta * std::cos(phi), sin_theta * std::sin(phi), std::cos(theta));
+    pdf = pdf_of(index, sin_theta);
+    return true;
+  }
+
+  // Density sample() gives the unit vector direction with
+  double pdf(const vec3 &direction) const
+  {
+    int x, y;
+    pixel_for(direction, x, y);
+    double sin_theta = std::sqrt(std::fmax(0.0, 1 - direction.z() * direction.z()));
+    return pdf_of(size_t(y) * width + x, sin_theta);
+  }
+
+private:
+  int width = 0;
+  int height = 0;
+  std::vector<float> pixels; // linear RGB
+  alias_table table;
+
+  void pixel_for(const vec3 &direction, int &x, int &y) const
+  {
+    double theta = std::acos(std::clamp(direction.z(), -1.0, 1.0));
+    double phi = std::atan2(direction.y(), direction.x());
+    x = std::clamp(int((phi + pi) / (2 * pi) * width), 0, width - 1);
+    y = std::clamp(int(theta / pi * height), 0, height - 1);
+  }
+
+  // A pixel spans 2 pi / width by pi / height of (phi, theta), and a patch of that
+  // covers sin(theta) times its area in solid angle
+  double pdf_of(size_t pixel, double sin_theta) const
+  {
+    if (sin_theta <= 0)
+      return 0;
+    return table.probability(pixel) * width * height / (2 * pi * pi * sin_theta);
+  }
+};
+
+#endif
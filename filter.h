@@ -0,0 +1,103 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+// Reconstruction filter that weights the samples around a pixel by how far they land
+// from its center
+enum class filter_type
+{
+  box,             // only the pixel's own samples, all counting the same
+  gaussian,        // smooth, a little soft
+  mitchell,        // Mitchell-Netravali with B = C = 1/3, sharper thanks to negative lobes
+  blackman_harris, // close to a gaussian but falls to zero smoothly at its radius
+};
+
+// RT_FILTER=box|gaussian|mitchell|blackman_harris, gaussian by default
+inline filter_type default_filter_type()
+{
+  const char *name = getenv("RT_FILTER");
+  if (!name)
+    return filter_type::gaussian;
+  if (strcmp(name, "box") == 0)
+    return filter_type::box;
+  if (strcmp(name, "mitchell") == 0)
+    return filter_type::mitchell;
+  if (strcmp(name, "blackman_harris") == 0)
+    return filter_type::blackman_harris;
+  return filter_type::gaussian;
+}
+
+// A separable filter: a sample dx, dy pixels from a pixel's center counts towards it
+// with weight evaluate(dx) * evaluate(dy), which is zero from radius on
+class pixel_filter
+{
+public:
+  // radius in pixels, or 0 for the filter's usual one
+  pixel_filter(filter_type type = filter_type::box, double radius = 0) : type(type)
+  {
+    this->radius = radius > 0 ? radius : default_radius(type);
+  }
+
+  // How many pixels away from the one a sample was taken in it can still count, along
+  // x or y. Samples are spread over their own pixel, so half a pixel less than radius.
+  int reach() const
+  {
+    return std::max(0, int(std::ceil(radius - 0.5 - 1e-9)));
+  }
+
+  double evaluate(double x) const
+  {
+    x = std::fabs(x);
+    if (x >= radius)
+      return 0;
+    switch (type)
+    {
+    case filter_type::gaussian:
+    {
+      // sigma of half a pixel, lowered so that it reaches zero at the radius
+      const double sigma = 0.5;
+      return std::exp(-x * x / (2 * sigma * sigma)) - std::exp(-radius * radius / (2 * sigma * sigma));
+    }
+    case filter_type::mitchell:
+    {
+      // defined over [-2, 2], stretched to the radius
+      const double b = 1.0 / 3, c = 1.0 / 3;
+      x *= 2 / radius;
+      if (x < 1)
+        return ((12 - 9 * b - 6 * c) * x * x * x + (-18 + 12 * b + 6 * c) * x * x + (6 - 2 * b)) / 6;
+      return ((-b - 6 * c) * x * x * x + (6 * b + 30 * c) * x * x + (-12 * b - 48 * c) * x + (8 * b + 24 * c)) / 6;
+    }
+    case filter_type::blackman_harris:
+    {
+      double t = 0.5 + x / (2 * radius);
+      return 0.35875 - 0.48829 * std::cos(2 * pi * t) + 0.14128 * std::cos(4 * pi * t) - 0.01168 * std::cos(6 * pi * t);
+    }
+    default:
+      return 1;
+    }
+  }
+
+private:
+  filter_type type;
+  double radius;
+
+  static double default_radius(filter_type type)
+  {
+    switch (type)
+    {
+    case filter_type::gaussian:
+    case filter_type::blackman_harris:
+      return 1.5;
+    case filter_type::mitchell:
+      return 2;
+    default:
+      return 0.5;
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,222 @@
+#ifndef GLTF_SEQUENCE_H
+#define GLTF_SEQUENCE_H
+
+#include <vector>
+
+#include "bvh.h"
+#include "load_gltf.h"
+#include "hittables/animated_transform.h"
+#include "hittables/triangle.h"
+
+// A glTF scene posed for one frame of an animation after another, loaded and built once.
+// Nodes the animation never moves are built into a BVH of their own that is left alone
+// from then on. Every animated node is placed by an animated_transform, over a mesh of
+// its own if its morph weights change. Between frames the transforms get new keyframes,
+// morphing triangles are moved in place, and the BVHs above them are refit bottom up.
+//
+// A refit tree keeps the shape it was built with, which gets worse as things move away
+// from where they were, so a BVH whose traversal cost has grown rebuild_threshold times
+// over what it was right after building is built again instead.
+class gltf_sequence
+{
+public:
+  static constexpr double rebuild_threshold = 1.5;
+
+  int rebuilds = 0; // BVHs built again because refitting had made them too slow
+
+  gltf_sequence(const gltf_asset &asset, const gltf_material_table &materials, int animation) : asset(asset), materials(materials), animation(animation) {}
+
+  // Builds the scene posed at the start of the animation. Returns non zero on failure,
+  // like add_gltf_to_world.
+  int build()
+  {
+    const Model &model = asset.model;
+
+    // Nodes that move or morph at any time during the animation
+    std::vector<bool> moves(model.nodes.size(), false), morphs(model.nodes.size(), false);
+    gltf_shutter whole = {animation, 0, gltf_animation_duration(asset, animation)};
+    gltf_pose start = gltf_pose_at(asset, animation, 0);
+    std::vector<mat4> start_matrices = gltf_node_matrices(model, visited, start.local);
+    for (double time : gltf_shutter_times(asset, whole))
+    {
+      gltf_pose pose = gltf_pose_at(asset, animation, time * whole.close);
+      std::vector<mat4> matrices = gltf_node_matrices(model, visited, pose.local);
+      for (size_t i = 0; i < model.nodes.size(); i++)
+      {
+        moves[i] = moves[i] || memcmp(matrices[i].m, start_matrices[i].m, sizeof(mat4::m)) != 0;
+        morphs[i] = morphs[i] || pose.weights[i] != start.weights[i];
+      }
+    }
+
+    std::vector<bool> animated(model.nodes.size(), false);
+    std::vector<shared_ptr<hittable>> instanced_meshes(model.meshes.size());
+    for (size_t i = 0; i < model.nodes.size(); i++)
+    {
+      int mesh_index = model.nodes[i].mesh;
+      if (!visited[i] || mesh_index < 0 || (!moves[i] && !morphs[i]))
+        continue;
+      animated[i] = true;
+
+      animated_node node;
+      node.node = i;
+      node.morphs = morphs[i];
+      shared_ptr<hittable> object = instanced_meshes[mesh_index];
+      if (node.morphs)
+      {
+        // Moved into place for each frame by set_time
+        int success = for_each_gltf_triangle(asset, model.meshes[mesh_index], mat4(), materials, start.weights[i], start.weights[i],
+                                             [&](const vertex v[3], const point3 end[3], shared_ptr<material> material, bool)
+                                             {
+                                               node.triangles.push_back(make_shared<tri>(v[0], v[1], v[2], end[0], end[1], end[2], material));
+                                             });
+        if (success != 0)
+          return success;
+        if (node.triangles.empty())
+          continue;
+        build_mesh(node);
+        object = node.mesh;
+      }
+      else if (!object)
+      {
+        hittable_list mesh_triangles;
+        int success = add_gltf_mesh(mesh_triangles, asset, model.meshes[mesh_index], mat4(), materials, start.weights[i], start.weights[i]);
+        if (success != 0)
+          return success;
+        if (mesh_triangles.objects.empty())
+          continue;
+        object = instanced_meshes[mesh_index] = make_shared<bvh_node>(mesh_triangles);
+      }
+      node.placement = make_shared<animated_transform>(object, std::vector<double>{0}, std::vector<mat4>{gltf_to_world(start_matrices[i])});
+      nodes.push_back(node);
+    }
+
+    // Everything else, as add_gltf_to_world would build it
+    hittable_list static_objects;
+    int success = add_gltf_to_world(static_objects, asset, materials, gltf_shutter{animation, 0, 0}, animated);
+    if (success != 0)
+      return success;
+    if (!static_objects.objects.empty())
+      static_root = make_shared<bvh_node>(static_objects);
+
+    set_time(0, 0);
+    return 0;
+  }
+
+  // Poses the scene for a frame whose shutter is open from open to close seconds into
+  // the animation
+  void set_time(double open, double close)
+  {
+    gltf_shutter_poses poses = gltf_poses_over_shutter(asset, gltf_shutter{animation, open, close});
+    open_matrices = poses.node_matrices[0];
+
+    bool rebuild_animated = !animated_root;
+    for (animated_node &node : nodes)
+    {
+      std::vector<double> times = poses.times;
+      std::vector<mat4> keyframes = poses.keyframes(node.node);
+      if (!poses.moves(node.node))
+      {
+        times.resize(1);
+        keyframes.resize(1);
+      }
+
+      if (node.morphs && move_triangles(node, poses))
+      {
+        node.placement = make_shared<animated_transform>(node.mesh, times, keyframes);
+        rebuild_animated = true;
+      }
+      else
+      {
+        node.placement->set_keyframes(times, keyframes);
+      }
+    }
+
+    if (!rebuild_animated && animated_root)
+    {
+      animated_root->refit();
+      if (animated_root->traversal_cost() > rebuild_threshold * animated_cost)
+      {
+        rebuild_animated = true;
+        rebuilds++;
+      }
+    }
+    if (rebuild_animated && !nodes.empty())
+    {
+      hittable_list placements;
+      for (const animated_node &node : nodes)
+        placements.add(node.placement);
+      animated_root = make_shared<bvh_node>(placements);
+      animated_cost = animated_root->traversal_cost();
+    }
+
+    scene.clear();
+    if (static_root && animated_root)
+      scene.add(make_shared<bvh_node>(static_root, animated_root));
+    else if (static_root || animated_root)
+      scene.add(static_root ? static_root : animated_root);
+  }
+
+  const hittable_list &world() const { return scene; }
+
+  // Puts cam where the scene's camera is when the shutter opens
+  void place_camera(camera &cam) const
+  {
+    set_camera_from_gltf(cam, asset.model, open_matrices, visited);
+  }
+
+private:
+  struct animated_node
+  {
+    int node;
+    bool morphs;
+    shared_ptr<animated_transform> placement;
+    // Only for meshes that morph: their triangles in for_each_gltf_triangle order, and
+    // the BVH over them with its traversal cost when it was built
+    std::vector<shared_ptr<tri>> triangles;
+    shared_ptr<bvh_node> mesh;
+    double mesh_cost = 0;
+  };
+
+  const gltf_asset &asset;
+  gltf_material_table materials;
+  int animation;
+
+  std::vector<animated_node> nodes;
+  shared_ptr<bvh_node> static_root;
+  shared_ptr<bvh_node> animated_root; // over the placements of nodes
+  double animated_cost = 0;
+  hittable_list scene;
+
+  std::vector<bool> visited;
+  std::vector<mat4> open_matrices;
+
+  void build_mesh(animated_node &node)
+  {
+    hittable_list triangles;
+    for (const shared_ptr<tri> &triangle : node.triangles)
+      triangles.add(triangle);
+    node.mesh = make_shared<bvh_node>(triangles);
+    node.mesh_cost = node.mesh->traversal_cost();
+  }
+
+  // Moves the node's triangles to the weights over the shutter and refits their BVH, or
+  // builds it again and returns true
+  bool move_triangles(animated_node &node, const gltf_shutter_poses &poses)
+  {
+    size_t next = 0;
+    for_each_gltf_triangle(asset, asset.model.meshes[asset.model.nodes[node.node].mesh], mat4(), materials, poses.weights_open[node.node], poses.weights_close[node.node],
+                           [&](const vertex v[3], const point3 end[3], shared_ptr<material>, bool)
+                           {
+                             node.triangles[next++]->set_vertices(v[0], v[1], v[2], end[0], end[1], end[2]);
+                           });
+
+    node.mesh->refit();
+    if (node.mesh->traversal_cost() <= rebuild_threshold * node.mesh_cost)
+      return false;
+    build_mesh(node);
+    rebuilds++;
+    return true;
+  }
+};
+
+#endif
@@ -0,0 +1,81 @@
+import base64
+import json
+import os
+import struct
+import sys
+
+# Packs a .gltf and its external buffers and images into a single binary .glb
+#   python gltf_to_glb.py gltf/snowman.gltf [gltf/snowman.glb]
+
+
+def pad4(data: bytes, pad: bytes = b"\x00") -> bytes:
+    return data + pad * (-len(data) % 4)
+
+
+def read_uri(uri: str, base_dir: str) -> bytes:
+    if uri.startswith("data:"):
+        return base64.b64decode(uri.split(",", 1)[1])
+    with open(os.path.join(base_dir, uri), "rb") as f:
+        return f.read()
+
+
+IMAGE_MIME_TYPES = {".png": "image/png", ".jpg": "image/jpeg", ".jpeg": "image/jpeg"}
+
+
+def image_mime_type(uri: str) -> str:
+    if uri.startswith("data:"):
+        return uri[len("data:"):].split(";", 1)[0].split(",", 1)[0]
+    extension = os.path.splitext(uri)[1].lower()
+    if extension not in IMAGE_MIME_TYPES:
+        raise ValueError(f"Can't tell the image type of {uri}")
+    return IMAGE_MIME_TYPES[extension]
+
+
+def convert(gltf_path: str, glb_path: str):
+    base_dir = os.path.dirname(gltf_path)
+    with open(gltf_path, "r") as f:
+        gltf = json.load(f)
+
+    # Concatenate every buffer into the single BIN chunk, 4 byte aligned
+    bin_data = b""
+    buffer_offsets = []
+    for buffer in gltf.get("buffers", []):
+        buffer_offsets.append(len(bin_data))
+        bin_data = pad4(bin_data + read_uri(buffer["uri"], base_dir)[: buffer["byteLength"]])
+
+    for view in gltf.get("bufferViews", []):
+        view["byteOffset"] = view.get("byteOffset", 0) + buffer_offsets[view["buffer"]]
+        view["buffer"] = 0
+
+    # Images referenced by uri move into buffer views as well
+    for image in gltf.get("images", []):
+        if "uri" not in image:
+            continue
+        uri = image.pop("uri")
+        data = read_uri(uri, base_dir)
+        gltf.setdefault("bufferViews", []).append(
+            {"buffer": 0, "byteOffset": len(bin_data), "byteLength": len(data)}
+        )
+        image["bufferView"] = len(gltf["bufferViews"]) - 1
+        image.setdefault("mimeType", image_mime_type(uri))
+        bin_data = pad4(bin_data + data)
+
+    if bin_data:
+        gltf["buffers"] = [{"byteLength": len(bin_data)}]
+
+    json_chunk = pad4(json.dumps(gltf, separators=(",", ":")).encode(), b" ")
+    chunks = struct.pack("<II", len(json_chunk), 0x4E4F534A) + json_chunk
+    if bin_data:
+        chunks += struct.pack("<II", len(bin_data), 0x004E4942) + bin_data
+
+    with open(glb_path, "wb") as f:
+        f.write(struct.pack("<III", 0x46546C67, 2, 12 + len(chunks)))
+        f.write(chunks)
+
+    print(f"Wrote {glb_path} ({12 + len(chunks)} bytes)")
+
+
+if __name__ == "__main__":
+    gltf_path = sys.argv[1]
+    glb_path = sys.argv[2] if len(sys.argv) > 2 else os.path.splitext(gltf_path)[0] + ".glb"
+    convert(gltf_path, glb_path)
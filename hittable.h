@@ -4,6 +4,28 @@
 #include "aabb.h"
 
 class material;
+class medium;
+
+// Numbers handed out from 1 in the order they're asked for, e.g. to tell primitives and
+// materials apart in the ID output layers, with 0 left for nothing. Every process builds
+// a scene in the same order, so the chunks of a render agree on them.
+class id_counter
+{
+public:
+	uint32_t next() { return ++last; }
+
+	// For objects that got their number back from a file, so later ones don't reuse it
+	void skip_past(uint32_t id)
+	{
+		if (id > last)
+			last = id;
+	}
+
+private:
+	uint32_t last = 0;
+};
+
+inline id_counter primitive_ids;
 
 class hit_record
 {
@@ -12,10 +34,22 @@ public:
 	vec3 normal;							// normal of surface at hit
 	double t;									// "time" along ray that the hit occurred
 	bool front_face;					// whether the ray hit from the front side or back side of the face
-	shared_ptr<material> mat; // material at the intersection
+	const material *mat;			// material at the intersection, owned by the object that was hit
+	int light = -1;						// index in the scene's light_list, or -1 if the surface isn't in it
+	const medium *interior = nullptr; // medium on the back side of the surface, if the surface bounds one
+	uint32_t primitive = 0;		// id of the primitive that was hit, 0 for points in media
+	uint64_t *bvh_visits = nullptr; // if set, counts the BVH nodes tested, for the traversal heatmap
 
 	double u;
 	double v;
+	vec3 dpdu; // surface derivatives with respect to u and v, set by the primitive that was hit
+	vec3 dpdv;
+
+	// Filled in by set_differentials when the ray carries differentials
+	vec3 dpdx; // how far the hit point moves one pixel over in x and y
+	vec3 dpdy;
+	double dudx = 0, dvdx = 0, dudy = 0, dvdy = 0;
+	double uv_footprint = 0; // width of the pixel footprint in uv space, 0 when unknown
 
 	void set_face_normal(const ray &r, const vec3 &outward_normal)
 	{
@@ -25,6 +59,41 @@ public:
 		front_face = dot(r.direction(), outward_normal) < 0.0;
 		normal = front_face ? outward_normal : -outward_normal;
 	}
+
+	void set_differentials(const ray &r)
+	{
+		dpdx = dpdy = vec3();
+		dudx = dvdx = dudy = dvdy = 0;
+		uv_footprint = 0;
+		if (!r.has_differentials())
+			return;
+
+		// Intersect the offset rays with the tangent plane at p
+		double tx = dot(normal, p - r.rx_origin()) / dot(normal, r.rx_direction());
+		double ty = dot(normal, p - r.ry_origin()) / dot(normal, r.ry_direction());
+		if (!std::isfinite(tx) || !std::isfinite(ty))
+			return;
+		dpdx = r.rx_origin() + tx * r.rx_direction() - p;
+		dpdy = r.ry_origin() + ty * r.ry_direction() - p;
+
+		// Solve dpdx = dudx * dpdu + dvdx * dpdv (and the same for y) in the two axes where
+		// the plane projects best, i.e. dropping the dominant axis of the normal
+		int dim0 = 1, dim1 = 2;
+		if (std::fabs(normal.x()) < std::fabs(normal.y()) || std::fabs(normal.x()) < std::fabs(normal.z()))
+		{
+			dim0 = 0;
+			dim1 = std::fabs(normal.y()) > std::fabs(normal.z()) ? 2 : 1;
+		}
+		double det = dpdu[dim0] * dpdv[dim1] - dpdv[dim0] * dpdu[dim1];
+		if (std::fabs(det) < 1e-12)
+			return;
+		dudx = (dpdv[dim1] * dpdx[dim0] - dpdv[dim0] * dpdx[dim1]) / det;
+		dvdx = (dpdu[dim0] * dpdx[dim1] - dpdu[dim1] * dpdx[dim0]) / det;
+		dudy = (dpdv[dim1] * dpdy[dim0] - dpdv[dim0] * dpdy[dim1]) / det;
+		dvdy = (dpdu[dim0] * dpdy[dim1] - dpdu[dim1] * dpdy[dim0]) / det;
+
+		uv_footprint = std::fmax(std::sqrt(dudx * dudx + dvdx * dvdx), std::sqrt(dudy * dudy + dvdy * dvdy));
+	}
 };
 
 class hittable
@@ -35,6 +104,14 @@ public:
 	virtual bool hit(const ray &r, interval ray_t, hit_record &rec) const = 0;
 
 	virtual aabb bounding_box() const = 0;
+
+	// Bounds at time 0 and time 1. Something moving linearly over the shutter stays inside
+	// the box interpolated between the two at any time in between, which for a fast
+	// object is much tighter than bounding_box(), the union over the whole shutter.
+	virtual void motion_bounds(aabb &start, aabb &end) const
+	{
+		start = end = bounding_box();
+	}
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,192 @@
+#ifndef ANIMATED_TRANSFORM_H
+#define ANIMATED_TRANSFORM_H
+
+#include <algorithm>
+#include <vector>
+
+#include "transform.h"
+
+// Places an object in the world with a transform that changes while the shutter is
+// open, given as keyframes at ray times in [0, 1]. Each keyframe matrix is split into
+// translation, rotation and scale, which are interpolated separately (slerp for the
+// rotation) so that a spinning object keeps its shape instead of shrinking halfway
+// between two matrices. The transform at the ray's time is built for every hit. While a
+// scale is zero, e.g. a glTF animation hiding the object, the object isn't hit.
+class animated_transform : public hittable
+{
+public:
+  // times must be increasing, with one object_to_world matrix each
+  animated_transform(shared_ptr<hittable> object, const std::vector<double> &times, const std::vector<mat4> &object_to_world) : object(object)
+  {
+    set_keyframes(times, object_to_world);
+  }
+
+  // Replaces the keyframes, e.g. for the next frame of an animation. With a single
+  // keyframe the object stands still and its matrices are worked out once here.
+  void set_keyframes(const std::vector<double> &times, const std::vector<mat4> &object_to_world)
+  {
+    keyframes.clear();
+    for (size_t i = 0; i < times.size(); i++)
+    {
+      keyframe key = {times[i], vec3(), quat(0, 0, 0, 1), vec3(1)};
+      object_to_world[i].decompose(key.translation, key.rotation, key.scale);
+      // take the short way round from the previous keyframe
+      if (i > 0 && key.rotation.w * keyframes.back().rotation.w + dot(key.rotation.v, keyframes.back().rotation.v) < 0)
+        key.rotation *= -1;
+      keyframes.push_back(key);
+    }
+    if (keyframes.size() == 1)
+    {
+      const keyframe &key = keyframes[0];
+      still_to_world = mat4::trs(key.translation, key.rotation, key.scale);
+      still_collapsed = collapsed(key.scale);
+      if (!still_collapsed)
+        still_to_object = inverse_trs(key.translation, key.rotation, key.scale);
+    }
+    set_bounding_box();
+  }
+
+  aabb bounding_box() const override
+  {
+    return bbox;
+  }
+
+  void motion_bounds(aabb &start, aabb &end) const override
+  {
+    start = start_bbox;
+    end = end_bbox;
+  }
+
+  bool hit(const ray &r, interval ray_t, hit_record &hit_record) const override
+  {
+    if (keyframes.size() == 1 && still_collapsed)
+    {
+      return false;
+    }
+    mat4 object_to_world = still_to_world, world_to_object = still_to_object;
+    if (keyframes.size() > 1)
+    {
+      vec3 translation, scale;
+      quat rotation(0, 0, 0, 1);
+      at(r.time(), translation, rotation, scale);
+      if (collapsed(scale))
+      {
+        return false;
+      }
+      object_to_world = mat4::trs(translation, rotation, scale);
+      world_to_object = inverse_trs(translation, rotation, scale);
+    }
+
+    // Same as transform::hit
+    ray object_ray = ray(world_to_object.transform_point(r.origin()), world_to_object.transform_vector(r.direction()), r.time());
+    if (!object->hit(object_ray, ray_t, hit_record))
+    {
+      return false;
+    }
+    hit_record.p = r.at(hit_record.t);
+    hit_record.normal = unit_vector(world_to_object.transposed().transform_vector(hit_record.normal));
+    hit_record.dpdu = object_to_world.transform_vector(hit_record.dpdu);
+    hit_record.dpdv = object_to_world.transform_vector(hit_record.dpdv);
+    return true;
+  }
+
+private:
+  struct keyframe
+  {
+    double time;
+    vec3 translation;
+    quat rotation;
+    vec3 scale;
+  };
+
+  shared_ptr<hittable> object;
+  std::vector<keyframe> keyframes;
+  aabb bbox;
+  aabb start_bbox, end_bbox; // see hittable::motion_bounds
+  mat4 still_to_world, still_to_object; // with a single keyframe
+  bool still_collapsed = false;
+
+  // Whether scale flattens the object, so that there is no inverse
+  static bool collapsed(const vec3 &scale)
+  {
+    double largest = std::fmax(std::fabs(scale.x()), std::fmax(std::fabs(scale.y()), std::fabs(scale.z())));
+    double smallest = std::fmin(std::fabs(scale.x()), std::fmin(std::fabs(scale.y()), std::fabs(scale.z())));
+    // written so that NaN counts as collapsed
+    return !(smallest > 1e-12 * largest);
+  }
+
+  static mat4 inverse_trs(const vec3 &translation, const quat &rotation, const vec3 &scale)
+  {
+    return mat4::scaling(vec3(1 / scale.x(), 1 / scale.y(), 1 / scale.z())) * mat4::rotation(rotation.conjugate()) * mat4::translation(-translation);
+  }
+
+  void at(double time, vec3 &translation, quat &rotation, vec3 &scale) const
+  {
+    auto next = std::upper_bound(keyframes.begin(), keyframes.end(), time, [](double time, const keyframe &key)
+                                 { return time < key.time; });
+    if (next == keyframes.begin() || next == keyframes.end())
+    {
+      const keyframe &key = next == keyframes.begin() ? keyframes.front() : keyframes.back();
+      translation = key.translation;
+      rotation = key.rotation;
+      scale = key.scale;
+      return;
+    }
+    const keyframe &a = *(next - 1), &b = *next;
+    double t = (time - a.time) / (b.time - a.time);
+    translation = (1 - t) * a.translation + t * b.translation;
+    rotation = slerp(a.rotation, b.rotation, t);
+    scale = (1 - t) * a.scale + t * b.scale;
+  }
+
+  // The object's box is followed at many times over the shutter. Rotation makes it move
+  // along curves, so the start and end boxes are grown until the box interpolated
+  // between them holds every sample, plus how far the box moves between samples.
+  void set_bounding_box()
+  {
+    aabb object_start, object_end;
+    object->motion_bounds(object_start, object_end);
+
+    const int samples = 64;
+    std::vector<aabb> boxes;
+    for (int i = 0; i <= samples; i++)
+    {
+      double time = double(i) / samples;
+      vec3 translation, scale;
+      quat rotation(0, 0, 0, 1);
+      at(time, translation, rotation, scale);
+      boxes.push_back(transform_box(mat4::trs(translation, rotation, scale), interpolate(object_start, object_end, time)));
+    }
+
+    double grow_min[3] = {0, 0, 0}, grow_max[3] = {0, 0, 0};
+    for (int i = 0; i <= samples; i++)
+    {
+      aabb between = interpolate(boxes.front(), boxes.back(), double(i) / samples);
+      for (int axis = 0; axis < 3; axis++)
+      {
+        const interval &box = boxes[i].axis_interval(axis), &line = between.axis_interval(axis);
+        double step_min = 0, step_max = 0;
+        if (i < samples)
+        {
+          const interval &next = boxes[i + 1].axis_interval(axis);
+          step_min = std::fabs(next.min - box.min);
+          step_max = std::fabs(next.max - box.max);
+        }
+        grow_min[axis] = std::fmax(grow_min[axis], line.min - box.min + step_min);
+        grow_max[axis] = std::fmax(grow_max[axis], box.max - line.max + step_max);
+      }
+    }
+
+    start_bbox = boxes.front();
+    end_bbox = boxes.back();
+    for (aabb *box : {&start_bbox, &end_bbox})
+    {
+      box->x = interval(box->x.min - grow_min[0], box->x.max + grow_max[0]);
+      box->y = interval(box->y.min - grow_min[1], box->y.max + grow_max[1]);
+      box->z = interval(box->z.min - grow_min[2], box->z.max + grow_max[2]);
+    }
+    bbox = aabb(start_bbox, end_bbox);
+  }
+};
+
+#endif
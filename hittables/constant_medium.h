@@ -2,71 +2,39 @@
 #define CONSTANT_MEDIUM_H
 
 #include "../hittable.h"
+#include "../medium.h"
 
+// Fills the inside of boundary with a homogeneous medium. The boundary's hits are
+// reported as they are, with hit_record::interior set, and the camera keeps track of
+// entering and leaving the medium and samples where rays scatter inside it. The
+// boundary's own surface is invisible (rec.mat is null, and rays carry straight on)
+// unless visible_boundary, e.g. for a glass ball with smoke in it.
 class constant_medium : public hittable
 {
 public:
   constant_medium(
       shared_ptr<hittable> boundary,
       double density,
-      shared_ptr<texture> texture) : boundary(boundary), neg_inv_density(-1.0 / density), phase_function(make_shared<isotropic>(texture)) {}
+      shared_ptr<texture> texture,
+      bool visible_boundary = false) : boundary(boundary), interior(density, make_shared<isotropic>(texture)), visible_boundary(visible_boundary) {}
 
   constant_medium(shared_ptr<hittable> boundary,
                   double density,
-                  color albedo) : boundary(boundary), neg_inv_density(-1.0 / density), phase_function(make_shared<isotropic>(albedo)) {}
+                  color albedo,
+                  bool visible_boundary = false) : boundary(boundary), interior(density, make_shared<isotropic>(albedo)), visible_boundary(visible_boundary) {}
 
   bool hit(const ray &r, interval ray_t, hit_record &rec) const override
   {
-    hit_record rec_1;
-    hit_record rec_2;
-
-    // does the ray hit one side of the boundary (even if time is negative)
-    if (!boundary->hit(r, interval::universe, rec_1))
-    {
-      return false;
-    }
-    // does the ray then hit the other side of the boundary after hitting the first side, even if time is still negative
-    if (!boundary->hit(r, interval(rec_1.t + 0.0001, infinity), rec_2))
-    {
-      return false;
-    }
-
-    // If the rays intersect the boundary outside of ray_t, that means
-    // they travel outside of the boundary for some time - so for the rest
-    // of this calculation, only pay attention to the time they are within
-    // the boundary
-    if (rec_1.t < ray_t.min)
-      rec_1.t = ray_t.min;
-    if (rec_2.t > ray_t.max)
-      rec_2.t = ray_t.max;
-
-    if (rec_1.t == rec_2.t)
+    if (!boundary->hit(r, ray_t, rec))
     {
       return false;
     }
-
-    // Don't pay attention to time the ray was traveling inside the boundary, but
-    // earlier than t=0
-    if (rec_1.t < 0)
-    {
-      rec_1.t = 0;
-    }
-
-    double ray_length = r.direction().length();
-    double distance_within_boundary = (rec_2.t - rec_1.t) * ray_length;
-    double hit_distance = neg_inv_density * std::log(random_double());
-    if (hit_distance > distance_within_boundary)
+    if (!visible_boundary)
     {
-      return false;
+      rec.mat = nullptr;
+      rec.light = -1;
     }
-    // move t into the boundary by hit_distance amount
-    rec.t = rec_1.t + hit_distance / ray_length;
-    rec.p = r.at(rec.t);
-
-    rec.normal = vec3(1, 0, 0); // doesn't matter
-    rec.front_face = true;      // doesn't matter
-    rec.mat = phase_function;
-
+    rec.interior = &interior;
     return true;
   }
 
@@ -75,10 +43,18 @@ public:
     return boundary->bounding_box();
   }
 
+  void motion_bounds(aabb &start, aabb &end) const override
+  {
+    boundary->motion_bounds(start, end);
+  }
+
+  // For a camera that starts out inside the boundary
+  const medium *inside() const { return &interior; }
+
 private:
   shared_ptr<hittable> boundary;
-  double neg_inv_density;
-  shared_ptr<material> phase_function;
+  homogeneous_medium interior;
+  bool visible_boundary;
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,219 @@
+#ifndef GRID_MEDIUM_H
+#define GRID_MEDIUM_H
+
+#include "../hittable.h"
+#include "../medium.h"
+#include "../sparse_grid.h"
+
+// Medium whose density varies through space, like smoke, read from a sparse_grid and
+// scaled by density. Both estimates step through the grid's bricks and draw tentative
+// collisions as if each brick were as dense as its majorant, so bricks whose majorant is
+// zero, the empty space around the smoke, are stepped over without sampling anything.
+//
+// Where a ray scatters is found by delta tracking: a collision at p is real with
+// probability density(p) / majorant, and otherwise tracking carries on from it. How much
+// light gets through is found by ratio tracking, which instead multiplies in the chance
+// 1 - density(p) / majorant of passing every collision, so shadows through smoke come out
+// soft rather than all or nothing.
+class grid_density_medium : public medium
+{
+public:
+  grid_density_medium(shared_ptr<sparse_grid> grid, double density, shared_ptr<material> phase_function) : medium(phase_function), grid(grid), density(density) {}
+
+  bool sample_scatter(const ray &r, interval ray_t, double u, double &t) const override
+  {
+    double ray_length = r.direction().length();
+    bool scattered = false;
+    for_each_brick(r, ray_t, [&](double start, double end, double majorant)
+                   {
+                     t = start;
+                     while (true)
+                     {
+                       t -= std::log(1 - u) / (majorant * ray_length);
+                       u = random_double();
+                       if (t >= end)
+                       {
+                         // exponential distances are memoryless, so tracking restarts at the next brick
+                         return true;
+                       }
+                       if (random_double() * majorant < density * grid->value(r.at(t)))
+                       {
+                         scattered = true;
+                         return false;
+                       }
+                     } });
+    return scattered;
+  }
+
+  double transmittance(const ray &r, interval ray_t) const override
+  {
+    double ray_length = r.direction().length();
+    double result = 1;
+    for_each_brick(r, ray_t, [&](double start, double end, double majorant)
+                   {
+                     for (double t = start;;)
+                     {
+                       t -= std::log(1 - random_double()) / (majorant * ray_length);
+                       if (t >= end)
+                       {
+                         return true;
+                       }
+                       result *= 1 - density * grid->value(r.at(t)) / majorant;
+                       // Russian roulette once little light is left, instead of tracking it to the end
+                       if (result < 0.1)
+                       {
+                         if (random_double() < 0.5)
+                         {
+                           result = 0;
+                           return false;
+                         }
+                         result *= 2;
+                       }
+                     } });
+    return result;
+  }
+
+private:
+  shared_ptr<sparse_grid> grid;
+  double density;
+
+  // Calls f(start, end, majorant) for the part of ray_t in each brick the ray passes
+  // through whose majorant (times density) isn't zero, in order along the ray, until f
+  // returns false
+  template <typename F>
+  void for_each_brick(const ray &r, interval ray_t, F f) const
+  {
+    if (!grid->bounding_box().clip(r, ray_t))
+    {
+      return;
+    }
+
+    // 3D DDA over the bricks, from where the ray enters the box
+    int brick[3], step[3];
+    double t_next[3], t_delta[3];
+    grid->brick_at(r.at(ray_t.min), brick);
+    for (int axis = 0; axis < 3; axis++)
+    {
+      double origin = r.origin()[axis];
+      double direction = r.direction()[axis];
+      double brick_width = grid->brick_start(axis, 1) - grid->brick_start(axis, 0);
+      if (direction > 0)
+      {
+        step[axis] = 1;
+        t_next[axis] = (grid->brick_start(axis, brick[axis] + 1) - origin) / direction;
+        t_delta[axis] = brick_width / direction;
+      }
+      else if (direction < 0)
+      {
+        step[axis] = -1;
+        t_next[axis] = (grid->brick_start(axis, brick[axis]) - origin) / direction;
+        t_delta[axis] = -brick_width / direction;
+      }
+      else
+      {
+        step[axis] = 0;
+        t_next[axis] = infinity;
+        t_delta[axis] = infinity;
+      }
+    }
+
+    double t = ray_t.min;
+    while (t < ray_t.max)
+    {
+      int axis = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+      double brick_end = std::min(t_next[axis], ray_t.max);
+
+      double majorant = density * grid->majorant(brick[0], brick[1], brick[2]);
+      if (majorant > 0 && !f(t, brick_end, majorant))
+      {
+        return;
+      }
+
+      t = brick_end;
+      brick[axis] += step[axis];
+      if (brick[axis] < 0 || brick[axis] >= grid->bricks_along(axis))
+      {
+        return;
+      }
+      t_next[axis] += t_delta[axis];
+    }
+  }
+};
+
+// Fills the grid's box with a grid_density_medium. Like constant_medium, the box's faces
+// are invisible boundaries with hit_record::interior set, and the camera takes care of
+// entering and leaving the medium. Finding them only takes a slab test against the box.
+class grid_medium : public hittable
+{
+public:
+  grid_medium(shared_ptr<sparse_grid> grid, double density, shared_ptr<texture> texture) : grid(grid), interior(grid, density, make_shared<isotropic>(texture)) {}
+
+  grid_medium(shared_ptr<sparse_grid> grid, double density, color albedo) : grid(grid), interior(grid, density, make_shared<isotropic>(albedo)) {}
+
+  bool hit(const ray &r, interval ray_t, hit_record &rec) const override
+  {
+    // Slab test that keeps track of which faces the ray comes in and goes out through
+    const aabb &box = grid->bounding_box();
+    double t_enter = -infinity, t_exit = infinity;
+    int enter_axis = 0, exit_axis = 0;
+    for (int axis = 0; axis < 3; axis++)
+    {
+      const interval &slab = box.axis_interval(axis);
+      double d_inverse = 1.0 / r.direction()[axis];
+      double t0 = (slab.min - r.origin()[axis]) * d_inverse;
+      double t1 = (slab.max - r.origin()[axis]) * d_inverse;
+      if (t0 > t1)
+      {
+        std::swap(t0, t1);
+      }
+      if (t0 > t_enter)
+      {
+        t_enter = t0;
+        enter_axis = axis;
+      }
+      if (t1 < t_exit)
+      {
+        t_exit = t1;
+        exit_axis = axis;
+      }
+    }
+    if (!(t_enter < t_exit))
+    {
+      return false;
+    }
+    bool entering = ray_t.surrounds(t_enter);
+    double t = entering ? t_enter : t_exit;
+    if (!ray_t.surrounds(t))
+    {
+      return false;
+    }
+
+    int axis = entering ? enter_axis : exit_axis;
+    vec3 outward_normal;
+    outward_normal[axis] = (r.direction()[axis] > 0) == entering ? -1 : 1;
+    rec.t = t;
+    rec.p = r.at(t);
+    rec.set_face_normal(r, outward_normal);
+    rec.dpdu = rec.dpdv = vec3();
+    rec.u = rec.v = 0;
+    rec.mat = nullptr;
+    rec.light = -1;
+    rec.interior = &interior;
+    rec.primitive = 0;
+    return true;
+  }
+
+  aabb bounding_box() const override
+  {
+    return grid->bounding_box();
+  }
+
+  // For a camera that starts out inside the box
+  const medium *inside() const { return &interior; }
+
+private:
+  shared_ptr<sparse_grid> grid;
+  grid_density_medium interior;
+};
+
+#endif
@@ -29,6 +29,7 @@ public:
 	bool hit(const ray &r, interval ray_t, hit_record &rec) const override
 	{
 		hit_record temp_rec;
+		temp_rec.bvh_visits = rec.bvh_visits;
 		bool hit_anything = false;
 		double closest_so_far = ray_t.max;
 		for (const shared_ptr<hittable> &object : objects)
@@ -49,6 +50,18 @@ public:
 		return bbox;
 	}
 
+	void motion_bounds(aabb &start, aabb &end) const override
+	{
+		start = end = aabb::empty;
+		for (const shared_ptr<hittable> &object : objects)
+		{
+			aabb object_start, object_end;
+			object->motion_bounds(object_start, object_end);
+			start = aabb(start, object_start);
+			end = aabb(end, object_end);
+		}
+	}
+
 private:
 	aabb bbox;
 };
@@ -58,14 +58,21 @@ public:
     }
     hit_record.u = alpha;
     hit_record.v = beta;
+    hit_record.dpdu = u;
+    hit_record.dpdv = v;
     hit_record.p = intersection;
     hit_record.t = t;
     hit_record.set_face_normal(r, normal);
-    hit_record.mat = material;
+    hit_record.mat = material.get();
+    hit_record.light = light;
+    hit_record.interior = nullptr;
+    hit_record.primitive = id;
     return true;
   }
 
 private:
+  friend class light_list;
+
   point3 Q;
   vec3 u;
   vec3 v;
@@ -75,6 +82,8 @@ private:
   vec3 w; // for plane coordinate transformations
 
   shared_ptr<material> material;
+  int light = -1; // index in the light_list, set when it is built
+  uint32_t id = primitive_ids.next();
 
   aabb bbox;
 };
@@ -52,9 +52,13 @@ public:
         }
         rec.t = root;
         rec.p = r.at(rec.t);
-        rec.mat = mat;
+        rec.mat = mat.get();
+        rec.light = -1;
+        rec.interior = nullptr;
+        rec.primitive = id;
         vec3 outward_normal = (rec.p - current_center) / radius;
         get_sphere_uv(outward_normal, rec.u, rec.v);
+        get_sphere_derivatives(outward_normal, radius, rec.dpdu, rec.dpdv);
         rec.set_face_normal(r, outward_normal);
         return true;
     }
@@ -64,10 +68,26 @@ public:
         return bbox;
     }
 
+    void motion_bounds(aabb &start, aabb &end) const override
+    {
+        vec3 rvec = vec3(radius);
+        start = aabb(center.at(0) - rvec, center.at(0) + rvec);
+        end = aabb(center.at(1) - rvec, center.at(1) + rvec);
+    }
+
+    // Inverse of get_sphere_uv: the point on the unit sphere with texture coordinates (u, v)
+    static point3 unit_point_at_uv(double u, double v)
+    {
+        double phi = u * 2 * pi;
+        double theta = v * pi;
+        return point3(-std::cos(phi) * std::sin(theta), -std::cos(theta), std::sin(phi) * std::sin(theta));
+    }
+
 private:
     ray center;
     double radius;
     shared_ptr<material> mat;
+    uint32_t id = primitive_ids.next();
     aabb bbox;
 
     // p should be on a point on the surface of a unit sphere
@@ -79,6 +99,14 @@ private:
         u = phi / (2 * pi);
         v = theta / pi;
     }
+
+    // Derivatives of the surface position with respect to the (u, v) of get_sphere_uv
+    static void get_sphere_derivatives(const point3 &p, double radius, vec3 &dpdu, vec3 &dpdv)
+    {
+        double sin_theta = std::fmax(std::sqrt(p.x() * p.x() + p.z() * p.z()), 1e-6);
+        dpdu = 2 * pi * radius * vec3(p.z(), 0, -p.x());
+        dpdv = pi * radius * vec3(-p.x() * p.y() / sin_theta, sin_theta, -p.z() * p.y() / sin_theta);
+    }
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,127 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include <memory>
+
+#include "../hittable.h"
+#include "../mat4.h"
+
+// Box around object_bbox once object_to_world places it in the world
+inline aabb transform_box(const mat4 &object_to_world, const aabb &object_bbox)
+{
+  point3 min = point3(infinity);
+  point3 max = point3(-infinity);
+
+  for (int i = 0; i < 2; i++)
+  {
+    for (int j = 0; j < 2; j++)
+    {
+      for (int k = 0; k < 2; k++)
+      {
+        // get coordinates of bbox vertex currently getting transformed
+        double x = i ? object_bbox.x.max : object_bbox.x.min;
+        double y = j ? object_bbox.y.max : object_bbox.y.min;
+        double z = k ? object_bbox.z.max : object_bbox.z.min;
+
+        vec3 corner = object_to_world.transform_point(vec3(x, y, z));
+        // Update min and max to tightly constrain the transformed bounding box
+        for (int c = 0; c < 3; c++)
+        {
+          min[c] = std::fmin(min[c], corner[c]);
+          max[c] = std::fmax(max[c], corner[c]);
+        }
+      }
+    }
+  }
+  return aabb(min, max);
+}
+
+// Places an object in the world with an arbitrary affine matrix. The matrix, its inverse
+// and the inverse-transpose (for normals) are all computed once up front. Wrapping a
+// transform in another transform composes the two matrices instead of nesting, so the
+// BVH only ever sees one transform per object no matter how many were stacked. A
+// singular matrix flattens the object to nothing, so it is never hit.
+class transform : public hittable
+{
+public:
+  transform(shared_ptr<hittable> object, const mat4 &object_to_world) : object(object), object_to_world(object_to_world)
+  {
+    if (auto inner = std::dynamic_pointer_cast<transform>(object))
+    {
+      this->object = inner->object;
+      this->object_to_world = object_to_world * inner->object_to_world;
+    }
+    if (this->object_to_world.is_singular())
+    {
+      collapsed = true;
+      return;
+    }
+    world_to_object = this->object_to_world.inverse();
+    normal_to_world = world_to_object.transposed();
+    set_bounding_box();
+  }
+
+  // glTF style translation, rotation (unit quaternion) and scale
+  transform(shared_ptr<hittable> object, const vec3 &translation, const quat &rotation, const vec3 &scale)
+      : transform(object, mat4::trs(translation, rotation, scale)) {}
+
+  aabb bounding_box() const override
+  {
+    return bbox;
+  }
+
+  // The matrix doesn't change over time, and maps linear motion to linear motion
+  void motion_bounds(aabb &start, aabb &end) const override
+  {
+    if (collapsed)
+    {
+      start = end = aabb();
+      return;
+    }
+    aabb object_start, object_end;
+    object->motion_bounds(object_start, object_end);
+    start = transform_box(object_to_world, object_start);
+    end = transform_box(object_to_world, object_end);
+  }
+
+  bool hit(const ray &r, interval ray_t, hit_record &hit_record) const override
+  {
+    if (collapsed)
+    {
+      return false;
+    }
+    // The direction is deliberately not normalized so that t means the same thing in both spaces
+    ray object_ray = ray(world_to_object.transform_point(r.origin()), world_to_object.transform_vector(r.direction()), r.time());
+
+    if (!object->hit(object_ray, ray_t, hit_record))
+    {
+      return false;
+    }
+    hit_record.p = r.at(hit_record.t);
+    // set_face_normal already oriented the normal against the object space ray, and
+    // the inverse-transpose keeps that orientation relative to the world space ray
+    hit_record.normal = unit_vector(normal_to_world.transform_vector(hit_record.normal));
+    hit_record.dpdu = object_to_world.transform_vector(hit_record.dpdu);
+    hit_record.dpdv = object_to_world.transform_vector(hit_record.dpdv);
+    return true;
+  }
+
+  const mat4 &matrix() const { return object_to_world; }
+
+private:
+  friend class scene_cache;
+
+  shared_ptr<hittable> object;
+  mat4 object_to_world;
+  mat4 world_to_object;
+  mat4 normal_to_world;
+  aabb bbox;
+  bool collapsed = false; // object_to_world is singular
+
+  void set_bounding_box()
+  {
+    bbox = transform_box(object_to_world, object->bounding_box());
+  }
+};
+
+#endif
@@ -11,23 +11,45 @@ public:
       const vertex &v2,
       const vertex &v3,
       shared_ptr<material> material)
-      : v1(v1), v2(v2), v3(v3), material(material)
+      : v1(v1), v2(v2), v3(v3), material(material), opaque(!material->has_alpha())
   {
-    u = v2.position - v1.position;
-    v = v3.position - v1.position;
-    vec3 n = cross(u, v);
-    w = n / dot(n, n);
-    // normal = unit_vector(n);
-    set_bounding_box();
+    set_edges();
+  }
+
+  // Deforming triangle, with corners moving in straight lines from the vertex positions
+  // at time 0 to end1, end2 and end3 at time 1. Normals and uvs stay those of time 0.
+  tri(
+      const vertex &v1,
+      const vertex &v2,
+      const vertex &v3,
+      const point3 &end1,
+      const point3 &end2,
+      const point3 &end3,
+      shared_ptr<material> material)
+      : v1(v1), v2(v2), v3(v3), material(material), opaque(!material->has_alpha())
+  {
+    set_vertices(v1, v2, v3, end1, end2, end3);
+  }
+
+  // Moves the corners to new positions, e.g. for the next frame of an animation, keeping
+  // the material
+  void set_vertices(const vertex &v1, const vertex &v2, const vertex &v3, const point3 &end1, const point3 &end2, const point3 &end3)
+  {
+    this->v1 = v1;
+    this->v2 = v2;
+    this->v3 = v3;
+    motion[0] = end1 - v1.position;
+    motion[1] = end2 - v2.position;
+    motion[2] = end3 - v3.position;
+    moving = !motion[0].near_zero() || !motion[1].near_zero() || !motion[2].near_zero();
+    set_edges();
   }
 
   virtual void set_bounding_box()
   {
-    // Bottom left to top right (assuming positive octant)
-    aabb bbox_diagonal1 = aabb(v1.position, v1.position + u + v);
-    // Top left to bottom right (same assumption)
-    aabb bbox_diagonal2 = aabb(v1.position + u, v1.position + v);
-    bbox = aabb(bbox_diagonal1, bbox_diagonal2);
+    aabb start, end;
+    motion_bounds(start, end);
+    bbox = aabb(start, end);
   }
 
   aabb bounding_box() const override
@@ -35,8 +57,25 @@ public:
     return bbox;
   }
 
+  void motion_bounds(aabb &start, aabb &end) const override
+  {
+    start = corners_box(v1.position, v2.position, v3.position);
+    end = corners_box(v1.position + motion[0], v2.position + motion[1], v3.position + motion[2]);
+  }
+
   bool hit(const ray &r, interval ray_t, hit_record &hit_record) const override
   {
+    // Corner and edges at the ray's time
+    point3 p1 = v1.position;
+    vec3 u = this->u, v = this->v;
+    if (moving)
+    {
+      double time = r.time();
+      p1 += time * motion[0];
+      u += time * (motion[1] - motion[0]);
+      v += time * (motion[2] - motion[0]);
+    }
+
     // Möller-Trumbore algorithm
     vec3 h = cross(r.direction(), v);
     float a = dot(u, h);
@@ -44,7 +83,7 @@ public:
       return false;
 
     float f = 1 / a;
-    vec3 s = r.origin() - v1.position;
+    vec3 s = r.origin() - p1;
 
     float ud = f * dot(s, h);
     if (ud < 0 || ud > 1)
@@ -57,28 +96,50 @@ public:
     if (!ray_t.contains(t))
       return false;
 
-    double alpha = material->get_alpha();
-    if (random_double() > alpha)
+    float wd = 1 - ud - vd;
+    vec3 uv = wd * v1.uv + ud * v2.uv + vd * v3.uv;
+    if (!opaque && material->passes_through(uv.x(), uv.y(), alpha_sample(r)))
     {
       return false;
     }
 
     point3 intersection = r.at(t);
-    float wd = 1 - ud - vd;
-    vec3 uv = wd * v1.uv + ud * v2.uv + vd * v3.uv;
     vec3 normal = wd * v1.normal + ud * v2.normal + vd * v3.normal;
     // vec3 normal = unit_vector(cross(u, v));
 
     hit_record.u = uv.x();
     hit_record.v = uv.y();
+    set_surface_derivatives(hit_record, u, v);
     hit_record.p = intersection;
     hit_record.t = t;
-    hit_record.set_face_normal(r, normal);
-    hit_record.mat = material;
+    hit_record.set_face_normal(r, unit_vector(normal));
+    hit_record.mat = material.get();
+    hit_record.light = light;
+    hit_record.interior = nullptr;
+    hit_record.primitive = id;
     return true;
   }
 
 private:
+  friend class scene_cache;
+  friend class light_list;
+
+  // Edge vectors expressed in uv, inverted to get how position changes with u and v
+  void set_surface_derivatives(hit_record &hit_record, const vec3 &u, const vec3 &v) const
+  {
+    double du1 = v2.uv.x() - v1.uv.x(), dv1 = v2.uv.y() - v1.uv.y();
+    double du2 = v3.uv.x() - v1.uv.x(), dv2 = v3.uv.y() - v1.uv.y();
+    double det = du1 * dv2 - dv1 * du2;
+    if (std::fabs(det) < 1e-12)
+    {
+      // No usable uvs, so there is no footprint to filter with
+      hit_record.dpdu = hit_record.dpdv = vec3();
+      return;
+    }
+    hit_record.dpdu = (dv2 * u - dv1 * v) / det;
+    hit_record.dpdv = (du1 * v - du2 * u) / det;
+  }
+
   vertex v1;
   vertex v2;
   vertex v3;
@@ -90,8 +151,43 @@ private:
   // vec3 normal;
 
   shared_ptr<material> material;
+  bool opaque; // cached from the material so opaque triangles never look at it during traversal
+  int light = -1; // index in the light_list, set when it is built
+  bool moving = false;
+  uint32_t id = primitive_ids.next(); // stored in the scene cache
+  vec3 motion[3]; // how far each corner moves over the shutter
 
   aabb bbox;
+
+  void set_edges()
+  {
+    u = v2.position - v1.position;
+    v = v3.position - v1.position;
+    vec3 n = cross(u, v);
+    w = n / dot(n, n);
+    // normal = unit_vector(n);
+    set_bounding_box();
+  }
+
+  static aabb corners_box(const point3 &a, const point3 &b, const point3 &c)
+  {
+    return aabb(aabb(a, b), aabb(a, c));
+  }
+
+  // Hash of the ray and this triangle's id, see material::passes_through. The id and the
+  // ray both come out the same in every run and every chunk, so the result does too.
+  double alpha_sample(const ray &r) const
+  {
+    uint64_t hash = mix_bits(id);
+    const double values[6] = {r.origin().x(), r.origin().y(), r.origin().z(), r.direction().x(), r.direction().y(), r.direction().z()};
+    for (double value : values)
+    {
+      uint64_t bits;
+      memcpy(&bits, &value, sizeof(bits));
+      hash = mix_bits(hash ^ bits);
+    }
+    return hash_to_double(hash);
+  }
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,182 @@
+#ifndef LAYERS_H
+#define LAYERS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "denoiser.h"
+
+// One channel of an OpenEXR image, one value per pixel row by row. Channels are named
+// layer.channel the way compositing tools group them, and plain R, G and B are the image
+// itself. IDs and counts are unsigned integers so they come out exact, the rest floats.
+struct exr_channel
+{
+  std::string name;
+  bool is_uint = false;
+  std::vector<float> floats; // unless is_uint
+  std::vector<uint32_t> uints;
+};
+
+// Writes a single part scanline OpenEXR file without compression, which every reader
+// supports and which doesn't need a library. The format is little endian, like the
+// machines this runs on. Returns false if the file can't be written.
+inline bool write_exr(const std::string &path, int width, int height, std::vector<exr_channel> channels)
+{
+  // The channel list is sorted by name, and each scanline holds the channels' rows in
+  // that order
+  std::sort(channels.begin(), channels.end(), [](const exr_channel &a, const exr_channel &b)
+            { return a.name < b.name; });
+
+  std::string header;
+  auto put = [&](const void *data, size_t bytes)
+  { header.append(static_cast<const char *>(data), bytes); };
+  auto put_int = [&](int32_t value)
+  { put(&value, sizeof(value)); };
+  auto put_float = [&](float value)
+  { put(&value, sizeof(value)); };
+  auto put_byte = [&](uint8_t value)
+  { put(&value, sizeof(value)); };
+  auto attribute = [&](const char *name, const char *type, int32_t size)
+  {
+    put(name, strlen(name) + 1);
+    put(type, strlen(type) + 1);
+    put_int(size);
+  };
+
+  put_int(20000630); // magic number
+  put_int(2);        // version 2, scanlines in a single part
+
+  int32_t channel_list_size = 1;
+  for (const exr_channel &channel : channels)
+    channel_list_size += int32_t(channel.name.size()) + 1 + 16;
+  attribute("channels", "chlist", channel_list_size);
+  for (const exr_channel &channel : channels)
+  {
+    put(channel.name.c_str(), channel.name.size() + 1);
+    put_int(channel.is_uint ? 0 : 2); // UINT or FLOAT
+    put_int(0);                       // not perceptually linear, and three reserved bytes
+    put_int(1);                       // x and y sampling
+    put_int(1);
+  }
+  put_byte(0);
+
+  const int32_t window[4] = {0, 0, width - 1, height - 1};
+  attribute("compression", "compression", 1);
+  put_byte(0); // none
+  attribute("dataWindow", "box2i", sizeof(window));
+  put(window, sizeof(window));
+  attribute("displayWindow", "box2i", sizeof(window));
+  put(window, sizeof(window));
+  attribute("lineOrder", "lineOrder", 1);
+  put_byte(0); // increasing y
+  attribute("pixelAspectRatio", "float", 4);
+  put_float(1);
+  attribute("screenWindowCenter", "v2f", 8);
+  put_float(0);
+  put_float(0);
+  attribute("screenWindowWidth", "float", 4);
+  put_float(1);
+  put_byte(0);
+
+  // Every value takes 4 bytes whatever its type. Each scanline starts with its y and size,
+  // and the offset table before them says where each one starts in the file.
+  int32_t line_bytes = int32_t(channels.size()) * width * 4;
+  std::ofstream out(path, std::ios::binary);
+  out.write(header.data(), header.size());
+  uint64_t first_line = header.size() + sizeof(uint64_t) * height;
+  for (int y = 0; y < height; y++)
+  {
+    uint64_t offset = first_line + uint64_t(y) * (8 + line_bytes);
+    out.write(reinterpret_cast<const char *>(&offset), sizeof(offset));
+  }
+  for (int32_t y = 0; y < height; y++)
+  {
+    out.write(reinterpret_cast<const char *>(&y), sizeof(y));
+    out.write(reinterpret_cast<const char *>(&line_bytes), sizeof(line_bytes));
+    size_t row = size_t(y) * width;
+    for (const exr_channel &channel : channels)
+    {
+      const char *data = channel.is_uint ? reinterpret_cast<const char *>(channel.uints.data() + row)
+                                         : reinterpret_cast<const char *>(channel.floats.data() + row);
+      out.write(data, size_t(width) * 4);
+    }
+  }
+  return bool(out);
+}
+
+// Writes a render and every buffer the camera keeps for it to one OpenEXR file, a layer
+// each: the image (R, G, B), albedo, normal, depth (Z, 0 where nothing was hit), seen
+// emission, variance, the material and primitive IDs, the BVH nodes visited per sample
+// (a heatmap of where tracing is slow) and the number of samples. shown is the image as
+// it is displayed, e.g. denoised, which then leaves the render's own colors as "noisy";
+// empty to write those as the image.
+inline bool write_layers(const std::string &path, const aov_image &image, const std::vector<color> &shown)
+{
+  size_t pixels = image.pixels.size();
+  std::vector<exr_channel> channels;
+  auto add_float = [&](const std::string &name, auto value)
+  {
+    exr_channel channel;
+    channel.name = name;
+    channel.floats.resize(pixels);
+    for (size_t i = 0; i < pixels; i++)
+      channel.floats[i] = float(value(image.pixels[i], i));
+    channels.push_back(std::move(channel));
+  };
+  auto add_uint = [&](const std::string &name, auto value)
+  {
+    exr_channel channel;
+    channel.name = name;
+    channel.is_uint = true;
+    channel.uints.resize(pixels);
+    for (size_t i = 0; i < pixels; i++)
+      channel.uints[i] = value(image.pixels[i]);
+    channels.push_back(std::move(channel));
+  };
+  // prefix is "layer." or empty, and names has a letter for each component
+  auto add_vector = [&](const std::string &prefix, const char *names, auto value)
+  {
+    for (int c = 0; c < 3; c++)
+      add_float(prefix + names[c], [&](const aov_pixel &pixel, size_t i)
+                { return value(pixel, i)[c]; });
+  };
+
+  if (shown.empty())
+  {
+    add_vector("", "RGB", [](const aov_pixel &pixel, size_t)
+               { return pixel.value; });
+  }
+  else
+  {
+    add_vector("", "RGB", [&](const aov_pixel &, size_t i)
+               { return shown[i]; });
+    add_vector("noisy.", "RGB", [](const aov_pixel &pixel, size_t)
+               { return pixel.value; });
+  }
+  add_vector("albedo.", "RGB", [](const aov_pixel &pixel, size_t)
+             { return pixel.albedo; });
+  add_vector("normal.", "XYZ", [](const aov_pixel &pixel, size_t)
+             { return pixel.normal; });
+  add_vector("emission.", "RGB", [](const aov_pixel &pixel, size_t)
+             { return pixel.emission; });
+  add_float("depth.Z", [](const aov_pixel &pixel, size_t)
+            { return pixel.depth; });
+  add_float("variance.Y", [](const aov_pixel &pixel, size_t)
+            { return pixel.variance; });
+  add_float("bvh.visits", [](const aov_pixel &pixel, size_t)
+            { return pixel.bvh_visits; });
+  add_uint("material.id", [](const aov_pixel &pixel)
+           { return pixel.material_id; });
+  add_uint("primitive.id", [](const aov_pixel &pixel)
+           { return pixel.primitive_id; });
+  add_uint("samples.count", [](const aov_pixel &pixel)
+           { return pixel.samples; });
+
+  return write_exr(path, image.width, image.height, channels);
+}
+
+#endif
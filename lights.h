@@ -0,0 +1,460 @@
+#ifndef LIGHTS_H
+#define LIGHTS_H
+
+#include <vector>
+
+#include "bvh.h"
+#include "material.h"
+#include "hittables/hittable_list.h"
+#include "hittables/quad.h"
+#include "hittables/triangle.h"
+
+// Picks index i with probability weights[i] / (sum of weights) in constant time, with
+// Vose's alias method: every slot holds one index up to a threshold and an alias above it
+class alias_table
+{
+public:
+  alias_table() {}
+
+  alias_table(const std::vector<double> &weights)
+  {
+    size_t n = weights.size();
+    double total = 0;
+    for (double weight : weights)
+      total += weight;
+    if (n == 0 || total <= 0)
+      return;
+
+    probabilities.resize(n);
+    thresholds.resize(n);
+    aliases.resize(n);
+    std::vector<int> small, large;
+    for (size_t i = 0; i < n; i++)
+    {
+      probabilities[i] = weights[i] / total;
+      thresholds[i] = probabilities[i] * n;
+      (thresholds[i] < 1 ? small : large).push_back(i);
+    }
+    while (!small.empty() && !large.empty())
+    {
+      int s = small.back(), l = large.back();
+      small.pop_back();
+      aliases[s] = l;
+      // l gives away what s was missing
+      thresholds[l] -= 1 - thresholds[s];
+      if (thresholds[l] < 1)
+      {
+        large.pop_back();
+        small.push_back(l);
+      }
+    }
+    // Whatever is left is 1 up to rounding
+    for (int i : small)
+      thresholds[i] = 1;
+    for (int i : large)
+      thresholds[i] = 1;
+  }
+
+  bool empty() const { return probabilities.empty(); }
+
+  // u from 0 to 1
+  int sample(double u) const
+  {
+    size_t n = probabilities.size();
+    double scaled = u * n;
+    size_t slot = std::min(size_t(scaled), n - 1);
+    return scaled - slot < thresholds[slot] ? slot : aliases[slot];
+  }
+
+  double probability(int i) const { return probabilities[i]; }
+
+private:
+  std::vector<double> probabilities;
+  std::vector<double> thresholds;
+  std::vector<int> aliases;
+};
+
+// A direction towards a point on a light, from light_list::sample
+struct light_sample
+{
+  vec3 direction; // unit length
+  double distance;
+  double pdf; // per unit solid angle
+  color emission;
+};
+
+// Every emissive triangle and quad in a scene, for sampling lights directly instead of
+// waiting for paths to hit them. Lights are picked through a light tree: a BVH over the
+// emitters where every node knows the total power under it and a cone bounding the
+// directions they face. Walking down from the root, each child is chosen in proportion
+// to a conservative estimate of how much it could light the shading point, from its
+// power, distance and orientation, so far away and back-facing lights are rarely picked
+// and the cost grows with the depth of the tree rather than the number of lights. A
+// point is then picked uniformly on the chosen light.
+//
+// Triangles inside instanced meshes (under a transform) are left out, since they share
+// one hittable between instances; paths still find them by hitting them.
+class light_list
+{
+public:
+  light_list() {}
+
+  // Collects the emitters under world, tells each one its index and builds the tree
+  void build(const hittable &world)
+  {
+    lights.clear();
+    nodes.clear();
+    add(&world);
+    if (lights.empty())
+      return;
+
+    std::vector<int> order(lights.size());
+    for (size_t i = 0; i < order.size(); i++)
+      order[i] = i;
+    build_node(order, 0, order.size(), 0, 0);
+  }
+
+  bool empty() const { return lights.empty(); }
+  size_t size() const { return lights.size(); }
+
+  // Samples a point on a light as seen from p. Returns false if nothing was picked.
+  bool sample(const point3 &p, double u1, double u2, double u3, light_sample &sample) const
+  {
+    int index;
+    double probability;
+    if (!pick(p, u1, index, probability))
+      return false;
+    const emitter &light = lights[index];
+
+    double b1, b2;
+    if (light.parallelogram)
+    {
+      b1 = u2;
+      b2 = u3;
+    }
+    else
+    {
+      // uniform barycentrics
+      double su = std::sqrt(u2);
+      b1 = 1 - su;
+      b2 = u3 * su;
+    }
+    point3 on_light = light.position + b1 * light.edge1 + b2 * light.edge2;
+    vec3 to_light = on_light - p;
+    double distance_squared = to_light.length_squared();
+    if (distance_squared <= 0)
+      return false;
+
+    sample.distance = std::sqrt(distance_squared);
+    sample.direction = to_light / sample.distance;
+    double cosine = std::fabs(dot(light.normal, sample.direction));
+    if (cosine < 1e-8)
+      return false;
+    sample.pdf = probability * distance_squared / (cosine * light.area);
+
+    // Same front face and uvs as the hit function would give a ray in this direction
+    vec3 uv = light.uv[0] + b1 * (light.uv[1] - light.uv[0]) + b2 * (light.uv[2] - light.uv[0]);
+    vec3 normal = light.normals[0] + b1 * (light.normals[1] - light.normals[0]) + b2 * (light.normals[2] - light.normals[0]);
+    hit_record rec;
+    rec.front_face = dot(sample.direction, normal) < 0;
+    sample.emission = light.mat->emitted(ray(p, sample.direction), rec, uv.x(), uv.y(), on_light);
+    return true;
+  }
+
+  // Solid angle density sample() would have picked rec's hit point with from p, for a ray
+  // that hit light rec.light
+  double pdf(const point3 &p, const hit_record &rec) const
+  {
+    const emitter &light = lights[rec.light];
+    vec3 to_light = rec.p - p;
+    double distance_squared = to_light.length_squared();
+    double cosine = std::fabs(dot(light.normal, to_light)) / std::sqrt(distance_squared);
+    if (cosine < 1e-8)
+      return 0;
+    return probability_of(p, rec.light) * distance_squared / (cosine * light.area);
+  }
+
+private:
+  // A triangle (position, position + edge1, position + edge2) or a parallelogram
+  // (position + a edge1 + b edge2 for a and b from 0 to 1), with the uvs and normals at
+  // those three corners
+  struct emitter
+  {
+    const material *mat;
+    point3 position;
+    vec3 edge1, edge2;
+    bool parallelogram;
+    vec3 uv[3];
+    vec3 normals[3];
+    vec3 normal; // geometric normal, on the side that emits
+    double area;
+    double power;
+    aabb bounds;
+    uint64_t trail; // path from the root to its leaf, bit i set for the second child at depth i
+  };
+
+  // Leaves hold one light. The first child of an internal node directly follows it.
+  struct light_node
+  {
+    aabb bounds;
+    vec3 axis;          // every light under the node faces within acos(cos_theta_o) of this
+    double cos_theta_o;
+    double power;
+    int second_child; // -1 for a leaf
+    int light;
+  };
+
+  std::vector<emitter> lights;
+  std::vector<light_node> nodes;
+
+  void add(const hittable *object)
+  {
+    if (auto list = dynamic_cast<const hittable_list *>(object))
+    {
+      for (const shared_ptr<hittable> &child : list->objects)
+        add(child.get());
+    }
+    else if (auto bvh = dynamic_cast<const bvh_node *>(object))
+    {
+      add(bvh->left.get());
+      // leaves with one object store it on both sides
+      if (bvh->right != bvh->left)
+        add(bvh->right.get());
+    }
+    else if (auto triangle = dynamic_cast<const tri *>(object))
+    {
+      tri *t = const_cast<tri *>(triangle);
+      t->light = -1;
+      if (!t->material->is_emissive())
+        return;
+      emitter light;
+      light.mat = t->material.get();
+      light.position = t->v1.position;
+      light.edge1 = t->v2.position - t->v1.position;
+      light.edge2 = t->v3.position - t->v1.position;
+      light.parallelogram = false;
+      const vertex *vertices[3] = {&t->v1, &t->v2, &t->v3};
+      for (int i = 0; i < 3; i++)
+      {
+        light.uv[i] = vertices[i]->uv;
+        light.normals[i] = vertices[i]->normal;
+      }
+      t->light = add_emitter(light);
+    }
+    else if (auto parallelogram = dynamic_cast<const quad *>(object))
+    {
+      quad *q = const_cast<quad *>(parallelogram);
+      q->light = -1;
+      if (!q->material->is_emissive())
+        return;
+      emitter light;
+      light.mat = q->material.get();
+      light.position = q->Q;
+      light.edge1 = q->u;
+      light.edge2 = q->v;
+      light.parallelogram = true;
+      light.uv[0] = vec3(0, 0, 0);
+      light.uv[1] = vec3(1, 0, 0);
+      light.uv[2] = vec3(0, 1, 0);
+      light.normals[0] = light.normals[1] = light.normals[2] = q->normal;
+      q->light = add_emitter(light);
+    }
+  }
+
+  // Fills in the derived fields and keeps light if it gives off any light. Returns its
+  // index, or -1.
+  int add_emitter(emitter &light)
+  {
+    vec3 n = cross(light.edge1, light.edge2);
+    light.area = light.parallelogram ? n.length() : n.length() / 2;
+    if (light.area <= 0)
+      return -1;
+    light.normal = unit_vector(n);
+    // Hits count as front facing against the interpolated normal, so emit on its side
+    if (dot(light.normal, light.normals[0] + light.normals[1] + light.normals[2]) < 0)
+      light.normal = -light.normal;
+
+    // Power from the emission at the center, which is exact for the usual constant emission
+    double center = light.parallelogram ? 0.5 : 1.0 / 3;
+    vec3 uv = light.uv[0] + center * (light.uv[1] - light.uv[0]) + center * (light.uv[2] - light.uv[0]);
+    color emission = light.mat->tex->value(uv.x(), uv.y(), light.position + center * (light.edge1 + light.edge2));
+    light.power = (0.2126 * emission.x() + 0.7152 * emission.y() + 0.0722 * emission.z()) * light.area;
+    if (light.power <= 0)
+      return -1;
+
+    point3 last_corner = light.parallelogram ? light.position + light.edge1 + light.edge2 : light.position;
+    light.bounds = aabb(aabb(light.position, light.position + light.edge1), aabb(light.position + light.edge2, last_corner));
+    lights.push_back(light);
+    return lights.size() - 1;
+  }
+
+  static point3 center_of(const aabb &box)
+  {
+    return point3((box.x.min + box.x.max) / 2, (box.y.min + box.y.max) / 2, (box.z.min + box.z.max) / 2);
+  }
+
+  // Splits order[start, end) in half along the longest axis of the light centers
+  int build_node(std::vector<int> &order, size_t start, size_t end, int depth, uint64_t trail)
+  {
+    int index = nodes.size();
+    nodes.push_back(light_node());
+    if (end - start == 1)
+    {
+      const emitter &light = lights[order[start]];
+      nodes[index] = light_node{light.bounds, light.normal, 1, light.power, -1, order[start]};
+      lights[order[start]].trail = trail;
+      return index;
+    }
+
+    aabb centers;
+    for (size_t i = start; i < end; i++)
+    {
+      point3 c = center_of(lights[order[i]].bounds);
+      centers = aabb(centers, aabb(c, c));
+    }
+    int axis = centers.largest_axis();
+    size_t middle = (start + end) / 2;
+    std::nth_element(order.begin() + start, order.begin() + middle, order.begin() + end, [&](int a, int b)
+                     { return center_of(lights[a].bounds)[axis] < center_of(lights[b].bounds)[axis]; });
+
+    // Deeper than the trail can record only happens for absurd numbers of lights
+    int first = build_node(order, start, middle, depth + 1, trail);
+    int second = build_node(order, middle, end, depth + 1, depth < 64 ? trail | (uint64_t(1) << depth) : trail);
+
+    light_node node;
+    node.bounds = aabb(nodes[first].bounds, nodes[second].bounds);
+    node.power = nodes[first].power + nodes[second].power;
+    cone_union(nodes[first].axis, nodes[first].cos_theta_o, nodes[second].axis, nodes[second].cos_theta_o, node.axis, node.cos_theta_o);
+    node.second_child = second;
+    node.light = -1;
+    nodes[index] = node;
+    return index;
+  }
+
+  // Smallest cone containing two cones, each given by its axis and the cosine of its
+  // half angle
+  static void cone_union(const vec3 &axis_a, double cos_a, const vec3 &axis_b, double cos_b, vec3 &axis, double &cos_theta)
+  {
+    double theta_a = std::acos(std::clamp(cos_a, -1.0, 1.0));
+    double theta_b = std::acos(std::clamp(cos_b, -1.0, 1.0));
+    double theta_d = std::acos(std::clamp(dot(axis_a, axis_b), -1.0, 1.0));
+    if (std::fmin(theta_d + theta_b, pi) <= theta_a)
+    {
+      axis = axis_a;
+      cos_theta = cos_a;
+      return;
+    }
+    if (std::fmin(theta_d + theta_a, pi) <= theta_b)
+    {
+      axis = axis_b;
+      cos_theta = cos_b;
+      return;
+    }
+
+    double theta_o = (theta_a + theta_d + theta_b) / 2;
+    vec3 rotation_axis = cross(axis_a, axis_b);
+    if (theta_o >= pi || rotation_axis.near_zero())
+    {
+      axis = axis_a;
+      cos_theta = -1;
+      return;
+    }
+    // rotate axis_a towards axis_b so the new cone just touches both
+    double theta_r = theta_o - theta_a;
+    vec3 k = unit_vector(rotation_axis);
+    axis = unit_vector(axis_a * std::cos(theta_r) + cross(k, axis_a) * std::sin(theta_r));
+    cos_theta = std::cos(theta_o);
+  }
+
+  // Upper bound on how much node could light p, up to a constant: its power over the
+  // squared distance, times the cosine of the smallest angle between a direction towards
+  // p and the directions its lights face. Zero if none of them can face p.
+  static double importance(const light_node &node, const point3 &p)
+  {
+    point3 center = center_of(node.bounds);
+    vec3 diagonal(node.bounds.x.size(), node.bounds.y.size(), node.bounds.z.size());
+    vec3 to_p = p - center;
+    double distance_squared = to_p.length_squared();
+    double radius_squared = diagonal.length_squared() / 4;
+
+    double cos_theta_w = distance_squared > 0 ? dot(node.axis, to_p) / std::sqrt(distance_squared) : 1;
+    double sin_theta_w = std::sqrt(std::fmax(0.0, 1 - cos_theta_w * cos_theta_w));
+    // angle the node's bounding sphere subtends from p
+    double cos_theta_b = -1, sin_theta_b = 0;
+    if (distance_squared > radius_squared)
+    {
+      double sin2 = radius_squared / distance_squared;
+      cos_theta_b = std::sqrt(1 - sin2);
+      sin_theta_b = std::sqrt(sin2);
+    }
+
+    // cos(max(0, theta_w - theta_o - theta_b)), done one subtraction at a time
+    double sin_theta_o = std::sqrt(std::fmax(0.0, 1 - node.cos_theta_o * node.cos_theta_o));
+    double cos_x = cos_theta_w >= node.cos_theta_o ? 1 : cos_theta_w * node.cos_theta_o + sin_theta_w * sin_theta_o;
+    double sin_x = std::sqrt(std::fmax(0.0, 1 - cos_x * cos_x));
+    double cos_theta = cos_x >= cos_theta_b ? 1 : cos_x * cos_theta_b + sin_x * sin_theta_b;
+    // diffuse emitters give off nothing past 90 degrees
+    if (cos_theta <= 0)
+      return 0;
+
+    // Don't let the estimate blow up for points close to or inside the node
+    distance_squared = std::fmax(distance_squared, std::sqrt(radius_squared));
+    return node.power * cos_theta / distance_squared;
+  }
+
+  // Walks the tree from the root, reusing u at each level
+  bool pick(const point3 &p, double u, int &light, double &probability) const
+  {
+    if (nodes.empty() || importance(nodes[0], p) <= 0)
+      return false;
+    probability = 1;
+    int index = 0;
+    while (nodes[index].second_child >= 0)
+    {
+      const light_node &node = nodes[index];
+      double first = importance(nodes[index + 1], p);
+      double second = importance(nodes[node.second_child], p);
+      if (first + second <= 0)
+        return false;
+      double p_first = first / (first + second);
+      if (u < p_first)
+      {
+        index = index + 1;
+        u = std::fmin(u / p_first, 1 - 1e-12);
+        probability *= p_first;
+      }
+      else
+      {
+        index = node.second_child;
+        u = std::fmin((u - p_first) / (1 - p_first), 1 - 1e-12);
+        probability *= 1 - p_first;
+      }
+    }
+    light = nodes[index].light;
+    return true;
+  }
+
+  // Probability pick() chooses light from p, following the light's trail down the tree
+  double probability_of(const point3 &p, int light) const
+  {
+    if (importance(nodes[0], p) <= 0)
+      return 0;
+    uint64_t trail = lights[light].trail;
+    double probability = 1;
+    int index = 0;
+    for (int depth = 0; nodes[index].second_child >= 0; depth++)
+    {
+      const light_node &node = nodes[index];
+      double first = importance(nodes[index + 1], p);
+      double second = importance(nodes[node.second_child], p);
+      if (first + second <= 0)
+        return 0;
+      bool take_second = depth < 64 && (trail >> depth) & 1;
+      probability *= (take_second ? second : first) / (first + second);
+      index = take_second ? node.second_child : index + 1;
+    }
+    return probability;
+  }
+};
+
+#endif
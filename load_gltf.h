@@ -2,144 +2,890 @@
 #define LOAD_GLTF_H
 
 #include <memory>
+#include <string>
+#include <vector>
 #include "vec3.h"
+#include "mat4.h"
+#include "bvh.h"
 #include "hittables/triangle.h"
 #include "hittables/hittable_list.h"
+#include "hittables/transform.h"
+#include "hittables/animated_transform.h"
 
 using namespace tinygltf;
 
 // When converting from gltf, this raytracer uses gltf.(y, -x, z) for the coordinate system
 
-vec3 read_vec3(float *buffer, int start_index)
+vec3 gltf_to_world(const vec3 &v)
 {
-  float x = buffer[start_index];
-  float y = buffer[start_index + 1];
-  float z = buffer[start_index + 2];
-  return vec3(y, -x, z);
+  return vec3(v.y(), -v.x(), v.z());
 }
 
-vec3 read_vec2(float *buffer, int start_index)
+// Change of basis from gltf space into world space, see gltf_to_world
+mat4 gltf_to_world(const mat4 &gltf_matrix)
 {
-  float x = buffer[start_index];
-  float y = buffer[start_index + 1];
-  return vec3(x, 1 - y, 0);
+  mat4 basis;
+  basis.m[0][0] = 0;
+  basis.m[0][1] = 1;
+  basis.m[1][0] = -1;
+  basis.m[1][1] = 0;
+  return basis * gltf_matrix * basis.transposed();
 }
 
-float *get_accessor(const Model &model, const Primitive &primitive, std::string attribute_name)
+// A loaded gltf or glb file. A glb is a single file holding the same JSON and buffers,
+// which is easier to move around; tinygltf reads either into the same buffers, and
+// vertex and index data are read from those in place.
+class gltf_asset
 {
-  auto accessor = model.accessors.at(primitive.attributes.at(attribute_name));
-  auto buffer_view = model.bufferViews[accessor.bufferView];
-  auto buffer = model.buffers[buffer_view.buffer];
-  float *positions = reinterpret_cast<float *>(&buffer.data[buffer_view.byteOffset + accessor.byteOffset]);
-  return positions;
+public:
+  Model model;
+
+  bool load(const std::string &filename, std::string &err, std::string &warn)
+  {
+    TinyGLTF loader;
+    bool is_glb = filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".glb") == 0;
+    if (is_glb)
+      return loader.LoadBinaryFromFile(&model, &err, &warn, filename);
+    return loader.LoadASCIIFromFile(&model, &err, &warn, filename);
+  }
+
+  int num_buffers() const { return model.buffers.size(); }
+  const unsigned char *buffer_data(int buffer) const { return model.buffers[buffer].data.data(); }
+  size_t buffer_size(int buffer) const { return model.buffers[buffer].data.size(); }
+};
+
+// Typed, strided view of an accessor's data, read in place from the buffer. The file
+// isn't trusted: an accessor without a buffer view (e.g. a sparse one), or whose elements
+// don't all lie inside their buffer, gives an invalid view.
+class accessor_view
+{
+public:
+  accessor_view() {}
+
+  accessor_view(const gltf_asset &asset, int accessor_index)
+  {
+    const Model &model = asset.model;
+    if (accessor_index < 0 || accessor_index >= int(model.accessors.size()))
+      return;
+    const Accessor &accessor = model.accessors[accessor_index];
+    if (accessor.bufferView < 0 || accessor.bufferView >= int(model.bufferViews.size()))
+      return;
+    const BufferView &buffer_view = model.bufferViews[accessor.bufferView];
+    if (buffer_view.buffer < 0 || buffer_view.buffer >= asset.num_buffers())
+      return;
+
+    int element_components = GetNumComponentsInType(accessor.type);
+    int component_size = GetComponentSizeInBytes(accessor.componentType);
+    int byte_stride = accessor.ByteStride(buffer_view);
+    if (element_components <= 0 || component_size <= 0 || byte_stride <= 0)
+      return;
+    size_t buffer_size = asset.buffer_size(buffer_view.buffer);
+    size_t start = buffer_view.byteOffset + accessor.byteOffset;
+    size_t element_size = size_t(element_components) * component_size;
+    if (start < buffer_view.byteOffset || start > buffer_size)
+      return;
+    if (accessor.count > 0 && (element_size > buffer_size - start || (accessor.count - 1) > (buffer_size - start - element_size) / byte_stride))
+      return;
+
+    data = asset.buffer_data(buffer_view.buffer) + start;
+    stride = byte_stride;
+    count = accessor.count;
+    components = element_components;
+    component_type = accessor.componentType;
+    normalized = accessor.normalized;
+  }
+
+  bool valid() const { return data != nullptr; }
+
+  size_t size() const { return count; }
+  int num_components() const { return components; }
+
+  // Read component c of element i as a double, applying normalization for integer types
+  double component(size_t i, int c) const
+  {
+    const unsigned char *element = data + i * stride;
+    switch (component_type)
+    {
+    case TINYGLTF_COMPONENT_TYPE_FLOAT:
+      return reinterpret_cast<const float *>(element)[c];
+    case TINYGLTF_COMPONENT_TYPE_BYTE:
+    {
+      int8_t value = reinterpret_cast<const int8_t *>(element)[c];
+      return normalized ? std::fmax(value / 127.0, -1.0) : value;
+    }
+    case TINYGLTF_COMPONENT_TYPE_SHORT:
+    {
+      int16_t value = reinterpret_cast<const int16_t *>(element)[c];
+      return normalized ? std::fmax(value / 32767.0, -1.0) : value;
+    }
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+      return normalized ? element[c] / 255.0 : element[c];
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+    {
+      uint16_t value = reinterpret_cast<const uint16_t *>(element)[c];
+      return normalized ? value / 65535.0 : value;
+    }
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT:
+      return reinterpret_cast<const uint32_t *>(element)[c];
+    }
+    return 0;
+  }
+
+  uint32_t index(size_t i) const
+  {
+    const unsigned char *element = data + i * stride;
+    switch (component_type)
+    {
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+      return element[0];
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+      return *reinterpret_cast<const uint16_t *>(element);
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT:
+      return *reinterpret_cast<const uint32_t *>(element);
+    }
+    return 0;
+  }
+
+  // Component i of all the elements' components laid end to end, e.g. for animation
+  // outputs whose keyframes span several elements
+  double flat(size_t i) const
+  {
+    return component(i / components, i % components);
+  }
+
+  // positions and normals, converted to world axes
+  vec3 read_vec3(size_t i) const
+  {
+    return gltf_to_world(vec3(component(i, 0), component(i, 1), component(i, 2)));
+  }
+
+  // texture coordinates, flipped to have v going up
+  vec3 read_vec2(size_t i) const
+  {
+    return vec3(component(i, 0), 1 - component(i, 1), 0);
+  }
+
+private:
+  const unsigned char *data = nullptr;
+  size_t stride = 0;
+  size_t count = 0;
+  int components = 1;
+  int component_type = 0;
+  bool normalized = false;
+};
+
+accessor_view get_accessor(const gltf_asset &asset, const Primitive &primitive, const std::string &attribute_name)
+{
+  auto attribute = primitive.attributes.find(attribute_name);
+  if (attribute == primitive.attributes.end())
+  {
+    return accessor_view();
+  }
+  return accessor_view(asset, attribute->second);
 }
 
-vertex read_vertex(float *positions, float *normals, float *uvs, int index)
+mat4 node_local_matrix(const Node &node)
 {
-  vec3 pos = read_vec3(positions, 3 * index);
-  vec3 norm = read_vec3(normals, 3 * index);
-  vec3 uv = read_vec2(uvs, 2 * index);
-  return vertex(pos, norm, uv);
+  mat4 local;
+  if (node.matrix.size() == 16)
+  {
+    // gltf matrices are column major
+    for (int i = 0; i < 4; i++)
+      for (int j = 0; j < 4; j++)
+        local.m[i][j] = node.matrix[j * 4 + i];
+    return local;
+  }
+
+  vec3 translation = node.translation.size() == 3 ? vec3(node.translation[0], node.translation[1], node.translation[2]) : vec3(0);
+  quat rotation = node.rotation.size() == 4 ? quat(node.rotation[0], node.rotation[1], node.rotation[2], node.rotation[3]) : quat(0, 0, 0, 1);
+  vec3 scale = node.scale.size() == 3 ? vec3(node.scale[0], node.scale[1], node.scale[2]) : vec3(1);
+  return mat4::trs(translation, rotation, scale);
+}
+
+void collect_node_matrices(const Model &model, int node_index, const mat4 &parent, const std::vector<mat4> &local, std::vector<mat4> &node_matrices, std::vector<bool> &visited)
+{
+  const Node &node = model.nodes[node_index];
+  node_matrices[node_index] = parent * local[node_index];
+  visited[node_index] = true;
+  for (int child : node.children)
+  {
+    collect_node_matrices(model, child, node_matrices[node_index], local, node_matrices, visited);
+  }
+}
+
+// Node to gltf space matrices for every node in the active scene, given the local matrix
+// of every node. Nodes outside of the scene are left unvisited.
+std::vector<mat4> gltf_node_matrices(const Model &model, std::vector<bool> &visited, const std::vector<mat4> &local)
+{
+  std::vector<mat4> node_matrices(model.nodes.size());
+  visited.assign(model.nodes.size(), false);
+
+  if (model.scenes.empty())
+  {
+    // No scene graph, so treat every node as a root
+    for (size_t i = 0; i < model.nodes.size(); i++)
+    {
+      if (!visited[i])
+        collect_node_matrices(model, i, mat4(), local, node_matrices, visited);
+    }
+    return node_matrices;
+  }
+
+  const Scene &scene = model.scenes[model.defaultScene >= 0 ? model.defaultScene : 0];
+  for (int root : scene.nodes)
+  {
+    collect_node_matrices(model, root, mat4(), local, node_matrices, visited);
+  }
+  return node_matrices;
+}
+
+// Same, with every node in its rest pose
+std::vector<mat4> gltf_node_matrices(const Model &model, std::vector<bool> &visited)
+{
+  std::vector<mat4> local;
+  for (const Node &node : model.nodes)
+    local.push_back(node_local_matrix(node));
+  return gltf_node_matrices(model, visited, local);
 }
 
-int add_gltf_to_world(hittable_list &world, Model model)
+// Part of a gltf animation to render. Rays at time 0 see the scene as it is open seconds
+// into the animation and rays at time 1 as it is at close, so objects that move in
+// between are motion blurred. With no animation the scene is in its rest pose.
+struct gltf_shutter
 {
-  auto white = make_shared<lambertian>(0.7);
+  int animation = -1; // index into the model's animations
+  double open = 0;
+  double close = 0;
+};
 
-  for (auto mesh : model.meshes)
+// Local matrices and morph target weights of every node at one moment of an animation
+struct gltf_pose
+{
+  std::vector<mat4> local;
+  std::vector<std::vector<double>> weights; // empty for nodes without morph targets
+};
+
+// Value of an animation sampler at time, with count numbers per keyframe: 3 for a
+// translation or scale, 4 for a rotation, and one per morph target for weights
+std::vector<double> sample_animation(const gltf_asset &asset, const AnimationSampler &sampler, size_t count, bool rotation, double time)
+{
+  accessor_view input(asset, sampler.input);
+  accessor_view output(asset, sampler.output);
+  bool cubic = sampler.interpolation == "CUBICSPLINE";
+  // empty, and the channel ignored, when there aren't as many values as keyframes
+  if (!input.valid() || !output.valid() || input.size() == 0 ||
+      output.size() * output.num_components() < (cubic ? 3 : 1) * input.size() * count)
+    return {};
+  // cubic splines store an in-tangent, the value and an out-tangent for every keyframe
+  auto value = [&](size_t key, int part, size_t c)
+  {
+    return output.flat((cubic ? 3 * key + part : key) * count + c);
+  };
+
+  std::vector<double> result(count);
+  size_t next = 0;
+  while (next < input.size() && input.flat(next) <= time)
+    next++;
+  if (next == 0 || next == input.size() || sampler.interpolation == "STEP")
+  {
+    size_t key = next == 0 ? 0 : next - 1;
+    for (size_t c = 0; c < count; c++)
+      result[c] = value(key, 1, c);
+    return result;
+  }
+
+  size_t key = next - 1;
+  double duration = input.flat(next) - input.flat(key);
+  double t = (time - input.flat(key)) / duration;
+  if (cubic)
+  {
+    double t2 = t * t, t3 = t2 * t;
+    for (size_t c = 0; c < count; c++)
+      result[c] = (2 * t3 - 3 * t2 + 1) * value(key, 1, c) + (t3 - 2 * t2 + t) * duration * value(key, 2, c) +
+                  (-2 * t3 + 3 * t2) * value(next, 1, c) + (t3 - t2) * duration * value(next, 0, c);
+  }
+  else if (rotation)
+  {
+    quat q = slerp(quat(value(key, 1, 0), value(key, 1, 1), value(key, 1, 2), value(key, 1, 3)),
+                   quat(value(next, 1, 0), value(next, 1, 1), value(next, 1, 2), value(next, 1, 3)), t);
+    result = {q.v.x(), q.v.y(), q.v.z(), q.w};
+  }
+  else
+  {
+    for (size_t c = 0; c < count; c++)
+      result[c] = (1 - t) * value(key, 1, c) + t * value(next, 1, c);
+  }
+  return result;
+}
+
+// Every node time seconds into animation, or at rest for animation -1
+gltf_pose gltf_pose_at(const gltf_asset &asset, int animation, double time)
+{
+  const Model &model = asset.model;
+  size_t num_nodes = model.nodes.size();
+  std::vector<vec3> translation(num_nodes), scale(num_nodes, vec3(1));
+  std::vector<quat> rotation(num_nodes, quat(0, 0, 0, 1));
+  gltf_pose pose;
+  pose.weights.resize(num_nodes);
+  for (size_t i = 0; i < num_nodes; i++)
   {
-    for (auto primitive : mesh.primitives)
+    const Node &node = model.nodes[i];
+    if (node.translation.size() == 3)
+      translation[i] = vec3(node.translation[0], node.translation[1], node.translation[2]);
+    if (node.rotation.size() == 4)
+      rotation[i] = quat(node.rotation[0], node.rotation[1], node.rotation[2], node.rotation[3]);
+    if (node.scale.size() == 3)
+      scale[i] = vec3(node.scale[0], node.scale[1], node.scale[2]);
+    if (node.mesh >= 0 && !model.meshes[node.mesh].primitives.empty())
     {
-      if (primitive.mode != 4)
+      const Mesh &mesh = model.meshes[node.mesh];
+      size_t targets = mesh.primitives[0].targets.size();
+      pose.weights[i] = node.weights.size() == targets ? node.weights : mesh.weights.size() == targets ? mesh.weights
+                                                                                                          : std::vector<double>(targets, 0.0);
+    }
+  }
+
+  if (animation >= 0 && animation < int(model.animations.size()))
+  {
+    const Animation &clip = model.animations[animation];
+    for (const AnimationChannel &channel : clip.channels)
+    {
+      int node = channel.target_node;
+      if (node < 0 || node >= int(num_nodes) || channel.sampler < 0 || channel.sampler >= int(clip.samplers.size()))
+        continue;
+      const AnimationSampler &sampler = clip.samplers[channel.sampler];
+      if (channel.target_path == "translation")
       {
-        printf("Primitive mode is not TRIANGLES\n");
-        return -1;
+        std::vector<double> v = sample_animation(asset, sampler, 3, false, time);
+        if (!v.empty())
+          translation[node] = vec3(v[0], v[1], v[2]);
+      }
+      else if (channel.target_path == "rotation")
+      {
+        std::vector<double> v = sample_animation(asset, sampler, 4, true, time);
+        if (!v.empty())
+          rotation[node] = quat(v[0], v[1], v[2], v[3]).normalized();
       }
+      else if (channel.target_path == "scale")
+      {
+        std::vector<double> v = sample_animation(asset, sampler, 3, false, time);
+        if (!v.empty())
+          scale[node] = vec3(v[0], v[1], v[2]);
+      }
+      else if (channel.target_path == "weights" && !pose.weights[node].empty())
+      {
+        std::vector<double> v = sample_animation(asset, sampler, pose.weights[node].size(), false, time);
+        if (!v.empty())
+          pose.weights[node] = v;
+      }
+    }
+  }
+
+  // animated nodes can't have a matrix, so nodes with one are always at rest
+  for (size_t i = 0; i < num_nodes; i++)
+  {
+    const Node &node = model.nodes[i];
+    pose.local.push_back(node.matrix.size() == 16 ? node_local_matrix(node) : mat4::trs(translation[i], rotation[i], scale[i]));
+  }
+  return pose;
+}
+
+// Length of an animation in seconds, up to its last keyframe
+double gltf_animation_duration(const gltf_asset &asset, int animation)
+{
+  double duration = 0;
+  if (animation < 0 || animation >= int(asset.model.animations.size()))
+    return duration;
+  for (const AnimationSampler &sampler : asset.model.animations[animation].samplers)
+  {
+    accessor_view input(asset, sampler.input);
+    if (input.size() > 0)
+      duration = std::max(duration, input.flat(input.size() - 1));
+  }
+  return duration;
+}
+
+// Ray times over the shutter to follow the animation at: both ends, the keyframes in
+// between, and a few steps between those since rotations, splines and nested nodes
+// don't move in straight lines. Just time 0 when the shutter isn't open.
+std::vector<double> gltf_shutter_times(const gltf_asset &asset, const gltf_shutter &shutter)
+{
+  const Model &model = asset.model;
+  double duration = shutter.close - shutter.open;
+  if (duration <= 0 || shutter.animation < 0 || shutter.animation >= int(model.animations.size()))
+    return {0};
+
+  std::vector<double> keys = {0, 1};
+  for (const AnimationSampler &sampler : model.animations[shutter.animation].samplers)
+  {
+    accessor_view input(asset, sampler.input);
+    for (size_t k = 0; k < input.size(); k++)
+    {
+      double time = (input.flat(k) - shutter.open) / duration;
+      if (time > 0 && time < 1)
+        keys.push_back(time);
+    }
+  }
+  std::sort(keys.begin(), keys.end());
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+  const int steps = 4;
+  std::vector<double> times;
+  for (size_t i = 0; i + 1 < keys.size(); i++)
+  {
+    for (int step = 0; step < steps; step++)
+      times.push_back(keys[i] + (keys[i + 1] - keys[i]) * step / steps);
+  }
+  times.push_back(1);
+  return times;
+}
+
+// The scene graph at each of the times gltf_shutter_times picks
+struct gltf_shutter_poses
+{
+  std::vector<double> times;
+  std::vector<std::vector<mat4>> node_matrices; // for each time
+  std::vector<std::vector<double>> weights_open, weights_close; // for each node
+  std::vector<bool> visited;
+
+  bool moves(size_t node) const
+  {
+    for (const std::vector<mat4> &matrices : node_matrices)
+    {
+      if (memcmp(matrices[node].m, node_matrices[0][node].m, sizeof(mat4::m)) != 0)
+        return true;
+    }
+    return false;
+  }
+
+  // The node's object_to_world at each time, for an animated_transform
+  std::vector<mat4> keyframes(size_t node) const
+  {
+    std::vector<mat4> result;
+    for (const std::vector<mat4> &matrices : node_matrices)
+      result.push_back(gltf_to_world(matrices[node]));
+    return result;
+  }
+};
+
+gltf_shutter_poses gltf_poses_over_shutter(const gltf_asset &asset, const gltf_shutter &shutter)
+{
+  gltf_shutter_poses poses;
+  poses.times = gltf_shutter_times(asset, shutter);
+  for (size_t s = 0; s < poses.times.size(); s++)
+  {
+    gltf_pose pose = gltf_pose_at(asset, shutter.animation, shutter.open + poses.times[s] * (shutter.close - shutter.open));
+    poses.node_matrices.push_back(gltf_node_matrices(asset.model, poses.visited, pose.local));
+    if (s == 0)
+      poses.weights_open = pose.weights;
+    if (s == poses.times.size() - 1)
+      poses.weights_close = pose.weights;
+  }
+  return poses;
+}
 
-      shared_ptr<material> material;
-      if (primitive.material < 0)
+vertex read_vertex(const accessor_view &positions, const accessor_view &normals, const accessor_view &uvs, uint32_t index)
+{
+  vec3 pos = positions.read_vec3(index);
+  vec3 norm = normals.valid() ? normals.read_vec3(index) : vec3();
+  vec3 uv = uvs.valid() ? uvs.read_vec2(index) : vec3();
+  return vertex(pos, norm, uv);
+}
+
+// Vertex indices for triangle i of a primitive, for indexed and non-indexed primitives
+// and the three triangle modes
+void triangle_indices(const Primitive &primitive, const accessor_view &indices, size_t i, uint32_t out[3])
+{
+  size_t corners[3];
+  if (primitive.mode == TINYGLTF_MODE_TRIANGLE_STRIP)
+  {
+    // keep the winding consistent on odd triangles
+    corners[0] = i;
+    corners[1] = i % 2 ? i + 2 : i + 1;
+    corners[2] = i % 2 ? i + 1 : i + 2;
+  }
+  else if (primitive.mode == TINYGLTF_MODE_TRIANGLE_FAN)
+  {
+    corners[0] = 0;
+    corners[1] = i + 1;
+    corners[2] = i + 2;
+  }
+  else
+  {
+    corners[0] = 3 * i;
+    corners[1] = 3 * i + 1;
+    corners[2] = 3 * i + 2;
+  }
+
+  for (int c = 0; c < 3; c++)
+  {
+    out[c] = indices.valid() ? indices.index(corners[c]) : corners[c];
+  }
+}
+
+// Everything needed to rebuild a gltf material without the gltf model around, which is
+// what the scene cache stores
+struct gltf_material_desc
+{
+  color base_color;
+  double alpha;
+  int image; // index into gltf_material_table::images, or -1 for a solid color
+  alpha_mode mode;
+  double alpha_cutoff;
+  double metallic;
+  double roughness;
+  int metallic_roughness_image; // -1 for none, like the images below
+  int normal_image;
+  double normal_scale;
+  color emissive; // emissiveFactor times the emissive strength extension
+  int emissive_image;
+};
+
+// One material per gltf material and one texture per image, shared by every primitive
+// that uses them. Primitives without a material use fallback.
+class gltf_material_table
+{
+public:
+  std::vector<gltf_material_desc> descs;
+  std::vector<shared_ptr<const mip_chain>> images; // decoded and filtered gltf images
+  std::vector<shared_ptr<material>> materials;     // parallel to descs
+  shared_ptr<material> fallback = make_shared<lambertian>(0.7);
+
+  void build()
+  {
+    // All materials live in one array, and the shared_ptrs handed to primitives share
+    // ownership of that array instead of each owning a separate allocation
+    auto table = make_shared<std::vector<material>>();
+    table->reserve(descs.size());
+    std::vector<shared_ptr<texture>> textures(images.size());
+    auto texture_for = [&](int image) -> shared_ptr<texture>
+    {
+      if (image < 0)
+        return nullptr;
+      if (!textures[image])
+        textures[image] = make_shared<image_texture>(images[image]);
+      return textures[image];
+    };
+    for (const gltf_material_desc &desc : descs)
+    {
+      // Emissive materials become lights, and the light list finds them through that
+      if (!desc.emissive.near_zero())
+      {
+        shared_ptr<texture> emission = make_shared<solid_color>(desc.emissive);
+        if (desc.emissive_image >= 0)
+          emission = make_shared<scaled_texture>(texture_for(desc.emissive_image), desc.emissive);
+        table->push_back(diffuse_light(emission));
+        table->back().set_alpha(desc.mode, desc.alpha, desc.alpha_cutoff);
+        continue;
+      }
+      if (desc.image >= 0)
       {
-        material = white;
+        table->push_back(metallic_roughness(texture_for(desc.image), desc.metallic, desc.roughness));
       }
       else
       {
-        auto pbr = model.materials[primitive.material].pbrMetallicRoughness;
-        if (pbr.baseColorTexture.index >= 0)
-        {
-          // std::cout << "Using image texture for model named " << mesh.name << std::endl;
-          int tex_index = pbr.baseColorTexture.index;
-          auto image = model.images[model.textures[tex_index].source];
-          material = make_shared<lambertian>(make_shared<image_texture>(image));
-        }
-        else
-        {
-          // std::cout << "Using base color factor size " << pbr.baseColorFactor.size() << " for model named " << mesh.name << std::endl;
-          material = make_shared<lambertian>(color(pbr.baseColorFactor[0], pbr.baseColorFactor[1], pbr.baseColorFactor[2]), pbr.baseColorFactor[3]);
-        }
+        table->push_back(metallic_roughness(desc.base_color, desc.metallic, desc.roughness));
       }
+      material &mat = table->back();
+      mat.metallic_roughness_tex = texture_for(desc.metallic_roughness_image);
+      mat.normal_tex = texture_for(desc.normal_image);
+      mat.normal_scale = desc.normal_scale;
+      mat.set_alpha(desc.mode, desc.alpha, desc.alpha_cutoff);
+    }
+
+    materials.clear();
+    materials.reserve(descs.size());
+    for (material &mat : *table)
+    {
+      materials.push_back(shared_ptr<material>(table, &mat));
+    }
+  }
+
+  // index of mat in materials, or -1 for the fallback
+  int index_of(const material *mat) const
+  {
+    for (size_t i = 0; i < materials.size(); i++)
+    {
+      if (materials[i].get() == mat)
+        return i;
+    }
+    return -1;
+  }
+};
+
+gltf_material_table gltf_materials(const Model &model)
+{
+  gltf_material_table table;
+  auto image_of = [&](int texture_index)
+  {
+    return texture_index >= 0 ? model.textures[texture_index].source : -1;
+  };
+
+  // Color textures are sRGB, while metallic-roughness and normal maps hold linear data
+  std::vector<bool> srgb(model.images.size(), true);
+  for (const Material &gltf_material : model.materials)
+  {
+    for (int image : {image_of(gltf_material.pbrMetallicRoughness.metallicRoughnessTexture.index), image_of(gltf_material.normalTexture.index)})
+    {
+      if (image >= 0)
+        srgb[image] = false;
+    }
+  }
+  for (size_t i = 0; i < model.images.size(); i++)
+  {
+    const Image &image = model.images[i];
+    table.images.push_back(make_shared<mip_chain>(image_view{image.image.data(), image.width, image.height, image.component}, srgb[i]));
+  }
 
-      auto index_accessor = model.accessors[primitive.indices];
-      auto index_buffer_view = model.bufferViews[index_accessor.bufferView];
-      auto index_buffer = model.buffers[index_buffer_view.buffer];
-      if (index_accessor.componentType != TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT)
+  for (const Material &gltf_material : model.materials)
+  {
+    const PbrMetallicRoughness &pbr = gltf_material.pbrMetallicRoughness;
+    color emissive(gltf_material.emissiveFactor[0], gltf_material.emissiveFactor[1], gltf_material.emissiveFactor[2]);
+    auto strength = gltf_material.extensions.find("KHR_materials_emissive_strength");
+    if (strength != gltf_material.extensions.end() && strength->second.Has("emissiveStrength"))
+      emissive *= strength->second.Get("emissiveStrength").GetNumberAsDouble();
+    alpha_mode mode = gltf_material.alphaMode == "MASK"    ? alpha_mode::mask
+                      : gltf_material.alphaMode == "BLEND" ? alpha_mode::blend
+                                                           : alpha_mode::opaque;
+    table.descs.push_back(gltf_material_desc{
+        color(pbr.baseColorFactor[0], pbr.baseColorFactor[1], pbr.baseColorFactor[2]),
+        pbr.baseColorFactor[3],
+        image_of(pbr.baseColorTexture.index),
+        mode,
+        gltf_material.alphaCutoff,
+        pbr.metallicFactor,
+        pbr.roughnessFactor,
+        image_of(pbr.metallicRoughnessTexture.index),
+        image_of(gltf_material.normalTexture.index),
+        gltf_material.normalTexture.scale,
+        emissive,
+        image_of(gltf_material.emissiveTexture.index)});
+  }
+  table.build();
+  return table;
+}
+
+// Calls add(v, end, material, degenerate) for every triangle of mesh, in the same order
+// every time. Positions and normals are baked with object_to_world, which is the identity
+// for instanced meshes. Morph targets are blended in with the weights the node has when
+// the shutter opens, and end holds the corners with the weights at close. Triangles with
+// no area at open are still passed on, flagged degenerate.
+template <typename F>
+int for_each_gltf_triangle(const gltf_asset &asset, const Mesh &mesh, const mat4 &object_to_world, const gltf_material_table &materials,
+                           const std::vector<double> &weights_open, const std::vector<double> &weights_close, F add)
+{
+  mat4 normal_to_world = object_to_world.inverse().transposed();
+
+  for (const Primitive &primitive : mesh.primitives)
+  {
+    if (primitive.mode != TINYGLTF_MODE_TRIANGLES && primitive.mode != TINYGLTF_MODE_TRIANGLE_STRIP && primitive.mode != TINYGLTF_MODE_TRIANGLE_FAN)
+    {
+      printf("Primitive mode %d is not TRIANGLES, TRIANGLE_STRIP or TRIANGLE_FAN\n", primitive.mode);
+      return -1;
+    }
+
+    accessor_view positions = get_accessor(asset, primitive, "POSITION");
+    accessor_view normals = get_accessor(asset, primitive, "NORMAL");
+    accessor_view uvs = get_accessor(asset, primitive, "TEXCOORD_0");
+    accessor_view indices;
+    if (primitive.indices >= 0)
+    {
+      indices = accessor_view(asset, primitive.indices);
+    }
+    if (!positions.valid())
+    {
+      printf("Primitive in mesh %s has no valid POSITION attribute\n", mesh.name.c_str());
+      return -1;
+    }
+    if (primitive.indices >= 0 && !indices.valid())
+    {
+      printf("Primitive in mesh %s has invalid indices\n", mesh.name.c_str());
+      return -1;
+    }
+    if (primitive.material >= int(materials.materials.size()))
+    {
+      printf("Primitive in mesh %s has material %d, out of range\n", mesh.name.c_str(), primitive.material);
+      return -1;
+    }
+
+    size_t num_vertices = indices.valid() ? indices.size() : positions.size();
+    size_t num_triangles = primitive.mode == TINYGLTF_MODE_TRIANGLES ? num_vertices / 3 : (num_vertices >= 3 ? num_vertices - 2 : 0);
+
+    shared_ptr<material> material = primitive.material < 0 ? materials.fallback : materials.materials[primitive.material];
+
+    std::vector<accessor_view> position_targets, normal_targets;
+    for (size_t k = 0; k < primitive.targets.size() && k < weights_open.size(); k++)
+    {
+      auto target_position = primitive.targets[k].find("POSITION");
+      auto target_normal = primitive.targets[k].find("NORMAL");
+      position_targets.push_back(target_position != primitive.targets[k].end() ? accessor_view(asset, target_position->second) : accessor_view());
+      normal_targets.push_back(target_normal != primitive.targets[k].end() ? accessor_view(asset, target_normal->second) : accessor_view());
+    }
+
+    // Every attribute is read at the same vertex indices, which are checked against
+    // positions below, so none can have fewer vertices
+    bool attributes_fit = (!normals.valid() || normals.size() >= positions.size()) && (!uvs.valid() || uvs.size() >= positions.size());
+    for (size_t k = 0; k < position_targets.size(); k++)
+    {
+      attributes_fit = attributes_fit && (!position_targets[k].valid() || position_targets[k].size() >= positions.size()) &&
+                       (!normal_targets[k].valid() || normal_targets[k].size() >= positions.size());
+    }
+    if (!attributes_fit)
+    {
+      printf("Primitive in mesh %s has attributes with fewer vertices than POSITION\n", mesh.name.c_str());
+      return -1;
+    }
+
+    for (size_t i = 0; i < num_triangles; i++)
+    {
+      uint32_t tri_indices[3];
+      triangle_indices(primitive, indices, i, tri_indices);
+      if (tri_indices[0] >= positions.size() || tri_indices[1] >= positions.size() || tri_indices[2] >= positions.size())
       {
-        printf("Got index buffer type that is not unsigned short, got component %d\n", index_accessor.componentType);
+        printf("Primitive in mesh %s indexes past its %zu vertices\n", mesh.name.c_str(), positions.size());
         return -1;
       }
-      uint16_t *indices = reinterpret_cast<uint16_t *>(&index_buffer.data[index_buffer_view.byteOffset + index_accessor.byteOffset]);
 
-      float *positions = get_accessor(model, primitive, "POSITION");
-      float *normals = get_accessor(model, primitive, "NORMAL");
-      float *uvs = get_accessor(model, primitive, "TEXCOORD_0");
+      vertex v[3] = {
+          read_vertex(positions, normals, uvs, tri_indices[0]),
+          read_vertex(positions, normals, uvs, tri_indices[1]),
+          read_vertex(positions, normals, uvs, tri_indices[2])};
 
-      for (int i = 0; i < index_accessor.count / 3; i++)
+      point3 end[3];
+      for (int c = 0; c < 3; c++)
       {
-        int tri_index_0 = indices[i * 3];
-        int tri_index_1 = indices[i * 3 + 1];
-        int tri_index_2 = indices[i * 3 + 2];
-
-        vertex v0 = read_vertex(positions, normals, uvs, tri_index_0);
-        vertex v1 = read_vertex(positions, normals, uvs, tri_index_1);
-        vertex v2 = read_vertex(positions, normals, uvs, tri_index_2);
-
-        // std::cout << "Adding triangle with pos_0: " << pos_0 << " pos_1: " << pos_1 << " pos_2: " << pos_2 << " uv0: " << uv0 << " uv1: " << uv1 << " uv2: " << uv2 << std::endl;
-
-        world.add(make_shared<tri>(v0, v1, v2, material));
+        vec3 open_offset, close_offset;
+        for (size_t k = 0; k < position_targets.size(); k++)
+        {
+          if (position_targets[k].valid())
+          {
+            vec3 offset = position_targets[k].read_vec3(tri_indices[c]);
+            open_offset += weights_open[k] * offset;
+            close_offset += weights_close[k] * offset;
+          }
+          if (normal_targets[k].valid())
+            v[c].normal += weights_open[k] * normal_targets[k].read_vec3(tri_indices[c]);
+        }
+        end[c] = object_to_world.transform_point(v[c].position + close_offset);
+        v[c].position = object_to_world.transform_point(v[c].position + open_offset);
+      }
+      // Degenerate when the edges are parallel to within rounding, relative to their
+      // lengths so that a tiny but well shaped triangle, e.g. in a model in kilometers,
+      // isn't dropped. Also catches edges of length zero.
+      vec3 edge1 = v[1].position - v[0].position;
+      vec3 edge2 = v[2].position - v[0].position;
+      vec3 face_normal = cross(edge1, edge2);
+      bool degenerate = face_normal.length_squared() <= 1e-24 * edge1.length_squared() * edge2.length_squared();
+      for (int c = 0; c < 3; c++)
+      {
+        if (normals.valid())
+          v[c].normal = unit_vector(normal_to_world.transform_vector(v[c].normal));
+        else
+          v[c].normal = degenerate ? vec3(0, 0, 1) : unit_vector(face_normal); // degenerate ones are never hit
       }
+      add(v, end, material, degenerate);
     }
   }
   return 0;
 }
 
-void set_camera_from_gltf(camera &cam, Model model)
+// Add the triangles of a mesh to list, see for_each_gltf_triangle
+int add_gltf_mesh(hittable_list &list, const gltf_asset &asset, const Mesh &mesh, const mat4 &object_to_world, const gltf_material_table &materials,
+                  const std::vector<double> &weights_open = {}, const std::vector<double> &weights_close = {})
+{
+  return for_each_gltf_triangle(asset, mesh, object_to_world, materials, weights_open, weights_close,
+                                [&](const vertex v[3], const point3 end[3], shared_ptr<material> material, bool degenerate)
+                                {
+                                  if (degenerate)
+                                    return;
+                                  bool moving = false;
+                                  for (int c = 0; c < 3; c++)
+                                    moving = moving || !(end[c] - v[c].position).near_zero();
+                                  if (moving)
+                                    list.add(make_shared<tri>(v[0], v[1], v[2], end[0], end[1], end[2], material));
+                                  else
+                                    list.add(make_shared<tri>(v[0], v[1], v[2], material));
+                                });
+}
+
+// Walks the scene graph. Meshes used by a single node get the node transform baked into
+// their vertices; meshes used by several nodes are built once into a BVH and instanced
+// with a transform per node. Nodes that move while the shutter is open get an
+// animated_transform with the node's matrices over the shutter instead, and meshes
+// with morph targets are built for each node since the weights are per node. Nodes
+// marked in skip_nodes are left out.
+int add_gltf_to_world(hittable_list &world, const gltf_asset &asset, const gltf_material_table &materials, const gltf_shutter &shutter = gltf_shutter(),
+                      const std::vector<bool> &skip_nodes = {})
 {
-  Node camera_node;
-  for (auto node : model.nodes)
+  const Model &model = asset.model;
+
+  gltf_shutter_poses poses = gltf_poses_over_shutter(asset, shutter);
+  std::vector<bool> visited = poses.visited;
+  for (size_t i = 0; i < skip_nodes.size(); i++)
   {
-    if (node.camera >= 0)
-    {
-      camera_node = node;
-      break;
-    }
+    if (skip_nodes[i])
+      visited[i] = false;
   }
-  if (camera_node.camera < 0)
+  const std::vector<mat4> &node_matrices = poses.node_matrices[0];
+
+  std::vector<int> mesh_uses(model.meshes.size(), 0);
+  for (size_t i = 0; i < model.nodes.size(); i++)
   {
-    std::cout << "No camera found in gltf file" << std::endl;
-    exit(1);
+    if (visited[i] && model.nodes[i].mesh >= 0)
+      mesh_uses[model.nodes[i].mesh]++;
   }
 
-  quat rotation(vec3(camera_node.rotation[0], camera_node.rotation[1], camera_node.rotation[2]), camera_node.rotation[3]);
-  //  = rotation * vec3(0, 0, -1);
-  vec3 basis = rotation * vec3(0, 0, 1);
-  cam.lookfrom = point3(camera_node.translation[1], -camera_node.translation[0], camera_node.translation[2]);
-  cam.lookat = cam.lookfrom - vec3(basis.y(), -basis.x(), basis.z());
-  // cam.lookat = vec3();
-  // std::cout << "Lookfrom: " << cam.lookfrom << " l" << cam.lookfrom.length() << std::endl;
-  // std::cout << "Lookat: " << cam.lookat << " l" << cam.lookat.length() << std::endl;
-  // exit(1);
+  std::vector<shared_ptr<hittable>> instanced_meshes(model.meshes.size());
+  for (size_t i = 0; i < model.nodes.size(); i++)
+  {
+    int mesh_index = model.nodes[i].mesh;
+    if (!visited[i] || mesh_index < 0)
+      continue;
 
-  cam.aspect_ratio = model.cameras[0].perspective.aspectRatio;
-  cam.vfov = radians_to_degrees(model.cameras[0].perspective.yfov);
+    const Mesh &mesh = model.meshes[mesh_index];
+    mat4 object_to_world = gltf_to_world(node_matrices[i]);
+    bool moves = poses.moves(i);
+    bool morphs = !poses.weights_open[i].empty();
+    // a zero scale, often used to hide a node, leaves nothing to render or invert
+    if (!moves && object_to_world.is_singular())
+      continue;
+    if (!moves && (mesh_uses[mesh_index] == 1 || morphs))
+    {
+      int success = add_gltf_mesh(world, asset, mesh, object_to_world, materials, poses.weights_open[i], poses.weights_close[i]);
+      if (success != 0)
+        return success;
+      continue;
+    }
+
+    shared_ptr<hittable> object = morphs ? nullptr : instanced_meshes[mesh_index];
+    if (!object)
+    {
+      hittable_list mesh_triangles;
+      int success = add_gltf_mesh(mesh_triangles, asset, mesh, mat4(), materials, poses.weights_open[i], poses.weights_close[i]);
+      if (success != 0)
+        return success;
+      if (mesh_triangles.objects.empty())
+        continue;
+      object = make_shared<bvh_node>(mesh_triangles);
+      if (!morphs)
+        instanced_meshes[mesh_index] = object;
+    }
+
+    if (moves)
+    {
+      world.add(make_shared<animated_transform>(object, poses.times, poses.keyframes(i)));
+    }
+    else
+    {
+      world.add(make_shared<transform>(object, object_to_world));
+    }
+  }
+  return 0;
+}
+
+// Settings shared by every gltf scene, whether it came from the file or the scene cache
+void set_gltf_render_settings(camera &cam)
+{
   cam.vup = vec3(0, 0, 1);
   cam.defocus_angle = 0;
 
@@ -148,7 +894,43 @@ void set_camera_from_gltf(camera &cam, Model model)
   cam.max_depth = 30;
   // light blue
   cam.background = color(0.73, 0.79, 1.00);
-  // exit(1);
 }
 
-#endif
\ No newline at end of file
+// Places cam at the first camera in the scene, with the scene graph in the pose that
+// node_matrices and visited (see gltf_node_matrices) describe
+void set_camera_from_gltf(camera &cam, const Model &model, const std::vector<mat4> &node_matrices, const std::vector<bool> &visited)
+{
+  int camera_node = -1;
+  for (size_t i = 0; i < model.nodes.size(); i++)
+  {
+    if (visited[i] && model.nodes[i].camera >= 0)
+    {
+      camera_node = i;
+      break;
+    }
+  }
+  if (camera_node < 0)
+  {
+    std::cout << "No camera found in gltf file" << std::endl;
+    exit(1);
+  }
+
+  // gltf cameras look down their local -z axis
+  mat4 camera_to_world = gltf_to_world(node_matrices[camera_node]);
+  cam.lookfrom = camera_to_world.transform_point(point3(0));
+  cam.lookat = cam.lookfrom + unit_vector(camera_to_world.transform_vector(vec3(0, 0, -1)));
+
+  const Camera &gltf_camera = model.cameras[model.nodes[camera_node].camera];
+  cam.aspect_ratio = gltf_camera.perspective.aspectRatio;
+  cam.vfov = radians_to_degrees(gltf_camera.perspective.yfov);
+  set_gltf_render_settings(cam);
+}
+
+void set_camera_from_gltf(camera &cam, const Model &model)
+{
+  std::vector<bool> visited;
+  std::vector<mat4> node_matrices = gltf_node_matrices(model, visited);
+  set_camera_from_gltf(cam, model, node_matrices, visited);
+}
+
+#endif
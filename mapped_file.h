@@ -0,0 +1,90 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <fstream>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only view of a whole file. On POSIX systems the file is memory mapped, so pages
+// are only read from disk when they are touched and nothing is copied into the heap.
+// Elsewhere the file is read into memory.
+class mapped_file
+{
+public:
+  mapped_file() {}
+  mapped_file(const mapped_file &) = delete;
+  mapped_file &operator=(const mapped_file &) = delete;
+
+  ~mapped_file()
+  {
+    close();
+  }
+
+  bool open(const std::string &filename)
+  {
+    close();
+#ifdef _WIN32
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    if (!file)
+      return false;
+    contents.resize(file.tellg());
+    file.seekg(0);
+    file.read(reinterpret_cast<char *>(contents.data()), contents.size());
+    bytes = contents.data();
+    length = contents.size();
+    return bool(file);
+#else
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0)
+    {
+      ::close(fd);
+      return false;
+    }
+
+    void *mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd); // the mapping keeps the file alive
+    if (mapping == MAP_FAILED)
+      return false;
+
+    bytes = static_cast<const unsigned char *>(mapping);
+    length = info.st_size;
+    return true;
+#endif
+  }
+
+  void close()
+  {
+#ifdef _WIN32
+    contents.clear();
+#else
+    if (bytes)
+      munmap(const_cast<unsigned char *>(bytes), length);
+#endif
+    bytes = nullptr;
+    length = 0;
+  }
+
+  const unsigned char *data() const { return bytes; }
+  size_t size() const { return length; }
+
+private:
+  const unsigned char *bytes = nullptr;
+  size_t length = 0;
+#ifdef _WIN32
+  std::vector<unsigned char> contents;
+#endif
+};
+
+#endif
@@ -0,0 +1,191 @@
+#ifndef MAT4_H
+#define MAT4_H
+
+#include "vec3.h"
+#include "quat.h"
+
+// 4x4 affine matrix, row major. Points are column vectors, so (A * B) applies B first.
+class mat4
+{
+public:
+  double m[4][4];
+
+  mat4() : m{{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}, {0, 0, 0, 1}} {}
+
+  static mat4 identity() { return mat4(); }
+
+  static mat4 translation(const vec3 &offset)
+  {
+    mat4 result;
+    for (int i = 0; i < 3; i++)
+      result.m[i][3] = offset[i];
+    return result;
+  }
+
+  static mat4 scaling(const vec3 &scale)
+  {
+    mat4 result;
+    for (int i = 0; i < 3; i++)
+      result.m[i][i] = scale[i];
+    return result;
+  }
+
+  // q must be a unit quaternion
+  static mat4 rotation(const quat &q)
+  {
+    double x = q.v.x(), y = q.v.y(), z = q.v.z(), w = q.w;
+    mat4 result;
+    result.m[0][0] = 1 - 2 * (y * y + z * z);
+    result.m[0][1] = 2 * (x * y - z * w);
+    result.m[0][2] = 2 * (x * z + y * w);
+    result.m[1][0] = 2 * (x * y + z * w);
+    result.m[1][1] = 1 - 2 * (x * x + z * z);
+    result.m[1][2] = 2 * (y * z - x * w);
+    result.m[2][0] = 2 * (x * z - y * w);
+    result.m[2][1] = 2 * (y * z + x * w);
+    result.m[2][2] = 1 - 2 * (x * x + y * y);
+    return result;
+  }
+
+  // rotation about a coordinate axis (0 = x, 1 = y, 2 = z), right handed
+  static mat4 rotation(int axis, double rotation_degrees)
+  {
+    double c = std::cos(degrees_to_radians(rotation_degrees));
+    double s = std::sin(degrees_to_radians(rotation_degrees));
+    int a = (axis + 1) % 3;
+    int b = (axis + 2) % 3;
+    mat4 result;
+    result.m[a][a] = c;
+    result.m[a][b] = -s;
+    result.m[b][a] = s;
+    result.m[b][b] = c;
+    return result;
+  }
+
+  // glTF style translation * rotation * scale
+  static mat4 trs(const vec3 &t, const quat &r, const vec3 &s)
+  {
+    return translation(t) * rotation(r) * scaling(s);
+  }
+
+  friend mat4 operator*(const mat4 &a, const mat4 &b)
+  {
+    mat4 result;
+    for (int i = 0; i < 4; i++)
+    {
+      for (int j = 0; j < 4; j++)
+      {
+        result.m[i][j] = a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] + a.m[i][2] * b.m[2][j] + a.m[i][3] * b.m[3][j];
+      }
+    }
+    return result;
+  }
+
+  point3 transform_point(const point3 &p) const
+  {
+    return vec3(
+        m[0][0] * p.x() + m[0][1] * p.y() + m[0][2] * p.z() + m[0][3],
+        m[1][0] * p.x() + m[1][1] * p.y() + m[1][2] * p.z() + m[1][3],
+        m[2][0] * p.x() + m[2][1] * p.y() + m[2][2] * p.z() + m[2][3]);
+  }
+
+  vec3 transform_vector(const vec3 &v) const
+  {
+    return vec3(
+        m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z(),
+        m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z(),
+        m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z());
+  }
+
+  mat4 transposed() const
+  {
+    mat4 result;
+    for (int i = 0; i < 4; i++)
+      for (int j = 0; j < 4; j++)
+        result.m[i][j] = m[j][i];
+    return result;
+  }
+
+  double determinant3() const
+  {
+    return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+           m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+           m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+  }
+
+  // Whether the 3x3 part flattens space so that there is no inverse, e.g. a scale of zero,
+  // which glTF animations use to hide objects. The determinant is compared with the
+  // lengths of the columns so that small but well shaped matrices aren't caught.
+  bool is_singular() const
+  {
+    double column_lengths = 1;
+    for (int j = 0; j < 3; j++)
+      column_lengths *= std::sqrt(m[0][j] * m[0][j] + m[1][j] * m[1][j] + m[2][j] * m[2][j]);
+    // written so that NaN counts as singular
+    return !(std::fabs(determinant3()) > 1e-12 * column_lengths);
+  }
+
+  // Splits a matrix made by trs() back into its translation, rotation and scale. Shear
+  // can't be represented and is lost; a mirroring is put in the x scale.
+  void decompose(vec3 &translation, quat &rotation, vec3 &scale) const
+  {
+    translation = vec3(m[0][3], m[1][3], m[2][3]);
+    double r[3][3];
+    for (int j = 0; j < 3; j++)
+    {
+      scale[j] = std::sqrt(m[0][j] * m[0][j] + m[1][j] * m[1][j] + m[2][j] * m[2][j]);
+      if (j == 0 && determinant3() < 0)
+        scale[0] = -scale[0];
+      for (int i = 0; i < 3; i++)
+        r[i][j] = scale[j] != 0 ? m[i][j] / scale[j] : (i == j);
+    }
+
+    // rotation matrix to quaternion, from the largest of w, x, y, z for precision
+    double trace = r[0][0] + r[1][1] + r[2][2];
+    if (trace > 0)
+    {
+      double s = 2 * std::sqrt(1 + trace);
+      rotation = quat((r[2][1] - r[1][2]) / s, (r[0][2] - r[2][0]) / s, (r[1][0] - r[0][1]) / s, s / 4);
+    }
+    else if (r[0][0] > r[1][1] && r[0][0] > r[2][2])
+    {
+      double s = 2 * std::sqrt(1 + r[0][0] - r[1][1] - r[2][2]);
+      rotation = quat(s / 4, (r[0][1] + r[1][0]) / s, (r[0][2] + r[2][0]) / s, (r[2][1] - r[1][2]) / s);
+    }
+    else if (r[1][1] > r[2][2])
+    {
+      double s = 2 * std::sqrt(1 + r[1][1] - r[0][0] - r[2][2]);
+      rotation = quat((r[0][1] + r[1][0]) / s, s / 4, (r[1][2] + r[2][1]) / s, (r[0][2] - r[2][0]) / s);
+    }
+    else
+    {
+      double s = 2 * std::sqrt(1 + r[2][2] - r[0][0] - r[1][1]);
+      rotation = quat((r[0][2] + r[2][0]) / s, (r[1][2] + r[2][1]) / s, s / 4, (r[1][0] - r[0][1]) / s);
+    }
+    rotation.normalize();
+  }
+
+  // Inverse of an affine matrix: invert the 3x3 part with cofactors, then undo the
+  // translation. Check is_singular first, singular matrices give infinities.
+  mat4 inverse() const
+  {
+    double inv_det = 1.0 / determinant3();
+    mat4 result;
+    result.m[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * inv_det;
+    result.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+    result.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+    result.m[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * inv_det;
+    result.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+    result.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+    result.m[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * inv_det;
+    result.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+    result.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+
+    vec3 t = result.transform_vector(vec3(m[0][3], m[1][3], m[2][3]));
+    for (int i = 0; i < 3; i++)
+      result.m[i][3] = -t[i];
+    return result;
+  }
+};
+
+#endif
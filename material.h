@@ -2,40 +2,185 @@
 #define MATERIAL_H
 
 #include "hittable.h"
+#include "microfacet.h"
 #include "texture.h"
 
+// How a material's alpha is used, as in glTF
+enum class alpha_mode
+{
+  opaque, // alpha is ignored
+  mask,   // fully transparent where alpha is below alpha_cutoff, opaque elsewhere
+  blend,  // rays pass through with probability 1 - alpha
+};
+
+// Every material is one flat struct: a type tag, the parameters of all types, and flags
+// the renderer checks before doing work that only applies to some materials. Dispatch is
+// a switch on the tag instead of a virtual call, and a surface that can't emit or isn't
+// transparent costs one flag test instead of a call. The subclasses below only fill the
+// struct in, so make_shared<lambertian>(...) and friends still work, and materials can be
+// stored by value in a contiguous table (see gltf_material_table).
+enum class material_type
+{
+  lambertian,
+  metal,
+  dielectric,
+  diffuse_light,
+  isotropic,
+  metallic_roughness,
+};
+
+inline id_counter material_ids;
+
 class material
 {
 public:
-  virtual ~material() = default;
+  static const uint32_t emissive = 1 << 0;      // emitted() can be non-zero
+  static const uint32_t alpha_blended = 1 << 1; // alpha_mode::blend, and alpha can be below 1
+  static const uint32_t alpha_masked = 1 << 2;  // alpha_mode::mask
+
+  material_type type = material_type::lambertian;
+  uint32_t flags = 0;
+  uint32_t id = material_ids.next(); // kept by copies, e.g. into gltf_material_table
+
+  shared_ptr<texture> tex; // albedo, or emission for diffuse_light
+  double alpha = 1; // multiplied with the texture's alpha
+  double alpha_cutoff = 0.5;
+  double fuzz_factor = 0;      // metal
+  double refraction_index = 1; // dielectric
 
-  virtual double get_alpha() const { return 1; }
+  // metallic_roughness, as in glTF. The textures are optional and multiply the factors.
+  double metallic = 1;
+  double roughness = 1;
+  shared_ptr<texture> metallic_roughness_tex; // roughness in green, metallic in blue
+  shared_ptr<texture> normal_tex;             // tangent space normal map
+  double normal_scale = 1;
+
+  material() {}
+
+  bool is_emissive() const { return flags & emissive; }
+  bool has_alpha() const { return flags & (alpha_blended | alpha_masked); }
+  double get_alpha() const { return alpha; }
+
+  void set_alpha(alpha_mode mode, double alpha, double alpha_cutoff = 0.5)
+  {
+    this->alpha = alpha;
+    this->alpha_cutoff = alpha_cutoff;
+    flags &= ~(alpha_blended | alpha_masked);
+    if (mode == alpha_mode::mask)
+      flags |= alpha_masked;
+    // A blended material with no texture that is fully opaque anyway doesn't need testing
+    else if (mode == alpha_mode::blend && (alpha < 1 || !std::dynamic_pointer_cast<solid_color>(tex)))
+      flags |= alpha_blended;
+  }
+
+  // Whether a hit at (u, v) lets the ray through. xi is a number from 0 to 1 that only
+  // depends on the ray and the primitive, so blending is stochastic across samples but
+  // the same ray always makes the same choice, whatever order the BVH visits things in.
+  bool passes_through(double u, double v, double xi) const
+  {
+    double a = alpha * tex->alpha(u, v);
+    if (flags & alpha_masked)
+      return a < alpha_cutoff;
+    return xi >= a;
+  }
+
+  // Whether eval() works, so the integrator can sample lights directly at this surface.
+  // Materials without it either have a delta lobe or aren't worth the shadow ray.
+  bool samples_lights() const
+  {
+    return type == material_type::lambertian || type == material_type::metallic_roughness;
+  }
 
   // Return whether or not the ray scatters
-  virtual bool scatter(
-      const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered_ray) const
+  bool scatter(const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered_ray) const
+  {
+    double pdf;
+    return scatter(r_in, rec, attenuation, scattered_ray, pdf);
+  }
+
+  // Also gives the solid angle density the scattered direction was sampled with, for
+  // materials that samples_lights(), and 0 for the others
+  bool scatter(const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered_ray, double &pdf) const
+  {
+    return scatter(r_in, rec, random_double(), random_double(), random_double(), attenuation, scattered_ray, pdf);
+  }
+
+  // Same, with the uniform numbers to sample with given: u1 picks between lobes and u2
+  // and u3 pick the direction
+  bool scatter(const ray &r_in, const hit_record &rec, double u1, double u2, double u3, color &attenuation, ray &scattered_ray, double &pdf) const
   {
+    pdf = 0;
+    switch (type)
+    {
+    case material_type::lambertian:
+      return scatter_lambertian(r_in, rec, u2, u3, attenuation, scattered_ray, pdf);
+    case material_type::metal:
+      return scatter_metal(r_in, rec, u2, u3, attenuation, scattered_ray);
+    case material_type::dielectric:
+      return scatter_dielectric(r_in, rec, u1, attenuation, scattered_ray);
+    case material_type::isotropic:
+      return scatter_isotropic(r_in, rec, u2, u3, attenuation, scattered_ray);
+    case material_type::metallic_roughness:
+      return scatter_metallic_roughness(r_in, rec, u1, u2, u3, attenuation, scattered_ray, pdf);
+    case material_type::diffuse_light:
+      return false;
+    }
     return false;
   }
 
-  virtual color emitted(const ray &r_in, const hit_record &rec, double u, double v, const point3 &p) const
+  // BSDF times cosine for light arriving from the unit direction wi, and the density
+  // scatter() samples wi with. Zero for materials that don't samples_lights().
+  color eval(const ray &r_in, const hit_record &rec, const vec3 &wi, double &pdf) const
   {
-    return color(0);
+    pdf = 0;
+    switch (type)
+    {
+    case material_type::lambertian:
+    {
+      double cosine = dot(rec.normal, wi);
+      if (cosine <= 0)
+        return color(0);
+      pdf = cosine / pi;
+      return tex->value(rec.u, rec.v, rec.p, rec.uv_footprint) * pdf;
+    }
+    case material_type::metallic_roughness:
+      return eval_metallic_roughness(r_in, rec, wi, pdf);
+    default:
+      return color(0);
+    }
   }
-};
 
-class lambertian : public material
-{
-public:
-  lambertian(const color &albedo, double alpha = 1) : tex(make_shared<solid_color>(albedo)), alpha(alpha) {}
-  lambertian(shared_ptr<texture> tex) : tex(tex), alpha(1) {}
+  // The surface's color without any lighting, e.g. to guide a denoiser. Unlike the
+  // attenuation from scatter() it doesn't change from one sample to the next.
+  color albedo(const hit_record &rec) const
+  {
+    switch (type)
+    {
+    case material_type::dielectric:
+    case material_type::diffuse_light:
+      return color(1);
+    default:
+      return tex->value(rec.u, rec.v, rec.p, rec.uv_footprint);
+    }
+  }
 
-  double get_alpha() const override { return alpha; }
+  color emitted(const ray &r_in, const hit_record &rec, double u, double v, const point3 &p) const
+  {
+    if (!is_emissive() || !rec.front_face)
+    {
+      return color(0);
+    }
+    return tex->value(u, v, p);
+  }
+
+protected:
+  material(material_type type, shared_ptr<texture> tex) : type(type), tex(tex) {}
 
-  bool scatter(
-      const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered_ray) const override
+private:
+  // Cosine weighted, so the density is cos / pi
+  bool scatter_lambertian(const ray &r_in, const hit_record &rec, double u1, double u2, color &attenuation, ray &scattered_ray, double &pdf) const
   {
-    vec3 scatter_direction = rec.normal + random_unit_vector();
+    vec3 scatter_direction = rec.normal + sphere_direction(u1, u2);
     if (scatter_direction.near_zero())
     {
       // This prevents degenerate cases of the direction being ~0
@@ -44,137 +189,236 @@ public:
       scatter_direction = rec.normal;
     }
     scattered_ray = ray(rec.p, scatter_direction, r_in.time());
+    attenuation = tex->value(rec.u, rec.v, rec.p, rec.uv_footprint);
+    pdf = std::fmax(0.0, dot(rec.normal, unit_vector(scatter_direction))) / pi;
+    return true;
+  }
+
+  bool scatter_metal(const ray &r_in, const hit_record &rec, double u1, double u2, color &attenuation, ray &scattered_ray) const;
+  bool scatter_dielectric(const ray &r_in, const hit_record &rec, double u, color &attenuation, ray &scattered_ray) const;
+  bool scatter_metallic_roughness(const ray &r_in, const hit_record &rec, double u1, double u2, double u3, color &attenuation, ray &scattered_ray, double &pdf) const;
+  color eval_metallic_roughness(const ray &r_in, const hit_record &rec, const vec3 &wi, double &pdf) const;
+  metallic_roughness_bsdf bsdf_at(const hit_record &rec) const;
+  shading_frame shading_frame_at(const hit_record &rec, const vec3 &wo) const;
+
+  bool scatter_isotropic(const ray &r_in, const hit_record &rec, double u1, double u2, color &attenuation, ray &scattered_ray) const
+  {
+    scattered_ray = ray(rec.p, sphere_direction(u1, u2), r_in.time());
     attenuation = tex->value(rec.u, rec.v, rec.p);
     return true;
   }
 
-private:
-  shared_ptr<texture> tex;
-  double alpha;
+  static double reflectance(double cos_angle, double ri)
+  {
+    // Use Schlick's approximation for reflectance.
+    auto r0 = (1 - ri) / (1 + ri);
+    r0 = r0 * r0;
+    return r0 + (1 - r0) * std::pow((1 - cos_angle), 5);
+  }
 };
 
-/*
-class open_pbr_bsdf : public material
+class lambertian : public material
 {
 public:
-  open_pbr_bsdf(texture *albedo, texture *normal, texture *metallic, texture *roughness, texture *ao) : albedo(albedo), normal(normal), metallic(metallic), roughness(roughness), ao(ao) {}
-  bool scatter(const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered) const override
+  lambertian(const color &albedo, double alpha = 1) : lambertian(make_shared<solid_color>(albedo))
   {
-    vec3 scatter_direction = rec.normal + random_unit_vector();
-    if (scatter_direction.near_zero())
-    {
-      scatter_direction = rec.normal;
-    }
-    scattered = ray(rec.p, scatter_direction, r_in.time());
-    attenuation = albedo->value(rec.u, rec.v, rec.p);
-    return true;
+    set_alpha(alpha_mode::blend, alpha);
   }
-  color emitted(const ray &r_in, const hit_record &rec, double u, double v, const point3 &p) const override
+  lambertian(shared_ptr<texture> tex) : material(material_type::lambertian, tex) {}
+};
+
+// Differentials of a perfectly specular bounce, treating the surface around the hit as
+// flat. wi is the unit scattered direction; eta is the refractive index ratio used to
+// refract, or 0 for a reflection.
+inline void set_specular_differentials(const ray &r_in, const hit_record &rec, const vec3 &wi, double eta, ray &scattered)
+{
+  if (!r_in.has_differentials())
+    return;
+
+  vec3 wo = -unit_vector(r_in.direction());
+  vec3 dwodx = -unit_vector(r_in.rx_direction()) - wo;
+  vec3 dwody = -unit_vector(r_in.ry_direction()) - wo;
+  double dwo_dot_n_dx = dot(dwodx, rec.normal);
+  double dwo_dot_n_dy = dot(dwody, rec.normal);
+
+  vec3 rx_direction, ry_direction;
+  if (eta == 0)
   {
-    return color(0);
+    rx_direction = wi - dwodx + 2 * dwo_dot_n_dx * rec.normal;
+    ry_direction = wi - dwody + 2 * dwo_dot_n_dy * rec.normal;
   }
-
-private:
-  texture *albedo;
-  texture *normal;
-  texture *metallic;
-  texture *roughness;
-  texture *ao;
-};*/
+  else
+  {
+    // wi = -eta * wo + mu * n, with mu = eta * (wo . n) - |wi . n|
+    double cos_t = std::fmax(std::fabs(dot(wi, rec.normal)), 1e-6);
+    double dmu = eta - eta * eta * dot(wo, rec.normal) / cos_t;
+    rx_direction = wi - eta * dwodx + dmu * dwo_dot_n_dx * rec.normal;
+    ry_direction = wi - eta * dwody + dmu * dwo_dot_n_dy * rec.normal;
+  }
+  scattered.set_differentials(rec.p + rec.dpdx, rx_direction, rec.p + rec.dpdy, ry_direction);
+}
 
 class metal : public material
 {
 public:
-  metal(const color &albedo, double fuzz_factor) : albedo(albedo), fuzz_factor(fuzz_factor) {}
-  bool scatter(
-      const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered_ray) const override
+  metal(const color &albedo, double fuzz_factor) : material(material_type::metal, make_shared<solid_color>(albedo))
   {
-    vec3 scatter_direction = reflect(r_in.direction(), rec.normal);
-    scatter_direction.normalize();
-    scatter_direction += (fuzz_factor * random_unit_vector());
-    scattered_ray = ray(rec.p, scatter_direction, r_in.time());
-    attenuation = albedo;
-    // Make sure the scattered direction is not now on the opposite side of the surface
-    return (dot(scattered_ray.direction(), rec.normal) > 0);
+    this->fuzz_factor = fuzz_factor;
   }
-
-private:
-  color albedo;
-  double fuzz_factor;
 };
 
 class dielectric : public material
 {
 public:
-  dielectric(double refraction_index) : refraction_index(refraction_index) {}
-
-  bool scatter(const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered)
-      const override
+  dielectric(double refraction_index) : material(material_type::dielectric, nullptr)
   {
-
-    // dielectric material does not absorb any light
-    attenuation = color(1.0);
-    double refractive_index_ratio = rec.front_face ? (1.0 / refraction_index) : refraction_index;
-    vec3 unit_r_in_direction = unit_vector(r_in.direction());
-
-    double cos_theta = std::fmin(dot(-unit_r_in_direction, rec.normal), 1.0);
-    double sin_theta = std::sqrt(1.0 - cos_theta * cos_theta);
-    // Some cases disobey snell's law, and so those should always reflect not refract
-    bool cannot_refract = refractive_index_ratio * sin_theta > 1.0;
-
-    // At shallow angles, light reflects more often than is transmitted - hence the reflectance test
-    vec3 refracted_direction = cannot_refract || reflectance(cos_theta, refractive_index_ratio) > random_double() ? reflect(unit_r_in_direction, rec.normal) : refract(unit_r_in_direction, rec.normal, refractive_index_ratio);
-
-    scattered = ray(rec.p, refracted_direction, r_in.time());
-    return true;
+    this->refraction_index = refraction_index;
   }
+};
 
-private:
-  double refraction_index;
-
-  static double reflectance(double cos_angle, double ri)
+class diffuse_light : public material
+{
+public:
+  diffuse_light(shared_ptr<texture> tex) : material(material_type::diffuse_light, tex)
   {
-    // Use Schlick's approximation for reflectance.
-    auto r0 = (1 - ri) / (1 + ri);
-    r0 = r0 * r0;
-    return r0 + (1 - r0) * std::pow((1 - cos_angle), 5);
+    flags |= emissive;
   }
+  diffuse_light(const color &emission_color) : diffuse_light(make_shared<solid_color>(emission_color)) {}
 };
 
-class diffuse_light : public material
+class isotropic : public material
 {
 public:
-  diffuse_light(shared_ptr<texture> tex) : texture(tex) {}
-  diffuse_light(const color &emission_color) : texture(make_shared<solid_color>(emission_color)) {}
+  isotropic(const color &albedo) : isotropic(make_shared<solid_color>(albedo)) {}
+  isotropic(shared_ptr<texture> tex) : material(material_type::isotropic, tex) {}
+};
 
-  color emitted(const ray &r_in, const hit_record &rec, double u, double v, const point3 &p) const override
+// glTF's metallic-roughness material, see metallic_roughness_bsdf
+class metallic_roughness : public material
+{
+public:
+  metallic_roughness(shared_ptr<texture> base_color, double metallic, double roughness) : material(material_type::metallic_roughness, base_color)
   {
-    if (!rec.front_face)
-    {
-      return color();
-    }
-    return texture->value(u, v, p);
+    this->metallic = metallic;
+    this->roughness = roughness;
   }
-
-private:
-  shared_ptr<texture> texture;
+  metallic_roughness(const color &base_color, double metallic, double roughness)
+      : metallic_roughness(make_shared<solid_color>(base_color), metallic, roughness) {}
 };
 
-class isotropic : public material
+// The subclasses are only constructors, so slicing one into a material loses nothing
+static_assert(sizeof(lambertian) == sizeof(material) && sizeof(metal) == sizeof(material) && sizeof(dielectric) == sizeof(material) &&
+              sizeof(diffuse_light) == sizeof(material) && sizeof(isotropic) == sizeof(material) && sizeof(metallic_roughness) == sizeof(material));
+
+inline bool material::scatter_metal(const ray &r_in, const hit_record &rec, double u1, double u2, color &attenuation, ray &scattered_ray) const
 {
-public:
-  isotropic(const color &albedo) : tex(make_shared<solid_color>(albedo)) {}
-  isotropic(shared_ptr<texture> tex) : tex(tex) {}
+  vec3 scatter_direction = reflect(r_in.direction(), rec.normal);
+  scatter_direction.normalize();
+  scatter_direction += (fuzz_factor * sphere_direction(u1, u2));
+  scattered_ray = ray(rec.p, scatter_direction, r_in.time());
+  // Fuzz is ignored here, so rough metal filters as if it was a mirror
+  set_specular_differentials(r_in, rec, unit_vector(scatter_direction), 0, scattered_ray);
+  attenuation = tex->value(rec.u, rec.v, rec.p);
+  // Make sure the scattered direction is not now on the opposite side of the surface
+  return (dot(scattered_ray.direction(), rec.normal) > 0);
+}
+
+inline bool material::scatter_dielectric(const ray &r_in, const hit_record &rec, double u, color &attenuation, ray &scattered) const
+{
+  // dielectric material does not absorb any light
+  attenuation = color(1.0);
+  double refractive_index_ratio = rec.front_face ? (1.0 / refraction_index) : refraction_index;
+  vec3 unit_r_in_direction = unit_vector(r_in.direction());
+
+  double cos_theta = std::fmin(dot(-unit_r_in_direction, rec.normal), 1.0);
+  double sin_theta = std::sqrt(1.0 - cos_theta * cos_theta);
+  // Some cases disobey snell's law, and so those should always reflect not refract
+  bool cannot_refract = refractive_index_ratio * sin_theta > 1.0;
+
+  // At shallow angles, light reflects more often than is transmitted - hence the reflectance test
+  bool reflects = cannot_refract || reflectance(cos_theta, refractive_index_ratio) > u;
+  vec3 refracted_direction = reflects ? reflect(unit_r_in_direction, rec.normal) : refract(unit_r_in_direction, rec.normal, refractive_index_ratio);
+
+  scattered = ray(rec.p, refracted_direction, r_in.time());
+  set_specular_differentials(r_in, rec, unit_vector(refracted_direction), reflects ? 0 : refractive_index_ratio, scattered);
+  return true;
+}
+
+// Frame around the shading normal: the interpolated normal, bent by the normal map if
+// there is one. The tangent follows dpdu, and the bitangent is flipped to follow dpdv, so
+// the map's green channel points along increasing v whichever way the uvs are mirrored.
+inline shading_frame material::shading_frame_at(const hit_record &rec, const vec3 &wo) const
+{
+  shading_frame frame(rec.normal, rec.dpdu);
+  if (!normal_tex || rec.dpdu.near_zero())
+    return frame;
+  if (dot(frame.b, rec.dpdv) < 0)
+    frame.b = -frame.b;
+
+  color c = normal_tex->value(rec.u, rec.v, rec.p, rec.uv_footprint);
+  vec3 local((2 * c.x() - 1) * normal_scale, (2 * c.y() - 1) * normal_scale, 2 * c.z() - 1);
+  vec3 bent = frame.to_world(local);
+  // A bent normal facing away from the viewer would leave no directions to reflect into
+  if (bent.near_zero() || dot(bent, wo) <= 0)
+    return frame;
+  return shading_frame(bent, rec.dpdu);
+}
 
-  bool scatter(const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered) const override
+// The factors times the textures at the hit
+inline metallic_roughness_bsdf material::bsdf_at(const hit_record &rec) const
+{
+  color base_color = tex->value(rec.u, rec.v, rec.p, rec.uv_footprint);
+  double m = metallic, r = roughness;
+  if (metallic_roughness_tex)
   {
-    scattered = ray(rec.p, random_unit_vector(), r_in.time());
-    attenuation = tex->value(rec.u, rec.v, rec.p);
-    return true;
+    color c = metallic_roughness_tex->value(rec.u, rec.v, rec.p, rec.uv_footprint);
+    r *= c.y();
+    m *= c.z();
   }
+  return metallic_roughness_bsdf(base_color, m, r);
+}
 
-private:
-  shared_ptr<texture> tex;
-};
+inline color material::eval_metallic_roughness(const ray &r_in, const hit_record &rec, const vec3 &wi_world, double &pdf) const
+{
+  pdf = 0;
+  vec3 wo_world = -unit_vector(r_in.direction());
+  shading_frame frame = shading_frame_at(rec, wo_world);
+  vec3 wo = frame.to_local(wo_world);
+  vec3 wi = frame.to_local(wi_world);
+  if (wo.z() <= 0 || dot(wi_world, rec.normal) <= 0)
+    return color(0);
+
+  metallic_roughness_bsdf bsdf = bsdf_at(rec);
+  pdf = bsdf.pdf(wo, wi);
+  return bsdf.f(wo, wi) * std::fmax(0.0, wi.z());
+}
+
+inline bool material::scatter_metallic_roughness(const ray &r_in, const hit_record &rec, double u1, double u2, double u3, color &attenuation, ray &scattered_ray, double &pdf) const
+{
+  vec3 wo_world = -unit_vector(r_in.direction());
+  shading_frame frame = shading_frame_at(rec, wo_world);
+  vec3 wo = frame.to_local(wo_world);
+  if (wo.z() <= 0)
+    return false;
+
+  metallic_roughness_bsdf bsdf = bsdf_at(rec);
+  vec3 wi;
+  bool specular = bsdf.sample(wo, u1, u2, u3, wi);
+  pdf = bsdf.pdf(wo, wi);
+  if (pdf <= 0)
+    return false;
+  vec3 wi_world = frame.to_world(wi);
+  if (dot(wi_world, rec.normal) <= 0)
+    return false; // the normal map bent it below the actual surface
+
+  attenuation = bsdf.f(wo, wi) * wi.z() / pdf;
+  scattered_ray = ray(rec.p, wi_world, r_in.time());
+  if (specular)
+  {
+    // Like metal, filter as if the reflection was a mirror
+    set_specular_differentials(r_in, rec, wi_world, 0, scattered_ray);
+  }
+  return true;
+}
 
 #endif
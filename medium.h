@@ -0,0 +1,127 @@
+#ifndef MEDIUM_H
+#define MEDIUM_H
+
+#include "hittable.h"
+
+// Participating medium that fills the space behind some surfaces (see
+// hit_record::interior). The camera keeps track of which medium a path is in, and asks
+// it where the path scatters between one surface and the next, and how much light gets
+// through to a light.
+class medium
+{
+public:
+  virtual ~medium() = default;
+
+  // Samples the first point between ray_t.min and ray_t.max where r scatters, and
+  // returns false if the ray gets through without scattering. u is a uniform number
+  // from the camera's sampler, for the first distance drawn.
+  virtual bool sample_scatter(const ray &r, interval ray_t, double u, double &t) const = 0;
+
+  // Fraction of light that gets from r.at(ray_t.min) to r.at(ray_t.max)
+  virtual double transmittance(const ray &r, interval ray_t) const = 0;
+
+  // Describes the scattering at r.at(t), for the camera to treat like a surface hit
+  void set_scatter_record(const ray &r, double t, hit_record &rec) const
+  {
+    rec.t = t;
+    rec.p = r.at(t);
+    rec.normal = vec3(1, 0, 0);   // doesn't matter
+    rec.front_face = true;        // doesn't matter
+    rec.dpdu = rec.dpdv = vec3(); // no surface to texture
+    rec.u = rec.v = 0;
+    rec.mat = phase_function.get();
+    rec.light = -1;
+    rec.interior = nullptr;
+    rec.primitive = 0;
+  }
+
+protected:
+  medium(shared_ptr<material> phase_function) : phase_function(phase_function) {}
+
+private:
+  shared_ptr<material> phase_function;
+};
+
+// Medium with the same density everywhere, so free-flight distances and transmittance
+// are exact exponentials
+class homogeneous_medium : public medium
+{
+public:
+  homogeneous_medium(double density, shared_ptr<material> phase_function) : medium(phase_function), density(density) {}
+
+  bool sample_scatter(const ray &r, interval ray_t, double u, double &t) const override
+  {
+    if (density <= 0)
+    {
+      return false;
+    }
+    t = ray_t.min - std::log(1 - u) / (density * r.direction().length());
+    return t < ray_t.max;
+  }
+
+  double transmittance(const ray &r, interval ray_t) const override
+  {
+    if (density <= 0)
+    {
+      return 1;
+    }
+    return std::exp(-density * r.direction().length() * ray_t.size());
+  }
+
+private:
+  double density;
+};
+
+// Media a path is currently inside of, innermost last. A ray that crosses a surface
+// bounding a medium enters it through the surface's front face and leaves it through
+// the back.
+struct medium_stack
+{
+  static constexpr int max_depth = 8;
+
+  const medium *media[max_depth];
+  int count = 0;
+
+  const medium *current() const { return count > 0 ? media[count - 1] : nullptr; }
+
+  void push(const medium *m)
+  {
+    if (count < max_depth)
+    {
+      media[count++] = m;
+    }
+  }
+
+  // Media don't have to be nested, so leaving one takes it out wherever it is
+  void remove(const medium *m)
+  {
+    for (int i = count - 1; i >= 0; i--)
+    {
+      if (media[i] == m)
+      {
+        std::copy(media + i + 1, media + count, media + i);
+        count--;
+        return;
+      }
+    }
+  }
+
+  // The ray through rec carries on to the other side of the surface
+  void cross(const hit_record &rec)
+  {
+    if (!rec.interior)
+    {
+      return;
+    }
+    if (rec.front_face)
+    {
+      push(rec.interior);
+    }
+    else
+    {
+      remove(rec.interior);
+    }
+  }
+};
+
+#endif
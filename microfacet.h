@@ -0,0 +1,175 @@
+#ifndef MICROFACET_H
+#define MICROFACET_H
+
+#include <algorithm>
+
+#include "color.h"
+
+// Orthonormal basis around a shading normal. Directions in the local frame have the
+// normal as +z, which is what the BSDFs below work in.
+struct shading_frame
+{
+  vec3 t, b, n;
+
+  shading_frame() {}
+
+  // tangent is only a hint, and is made perpendicular to n. If it is parallel to n, or
+  // zero, any perpendicular direction is used instead.
+  shading_frame(const vec3 &normal, const vec3 &tangent)
+  {
+    n = unit_vector(normal);
+    t = tangent - dot(tangent, n) * n;
+    if (t.length_squared() < 1e-12)
+    {
+      t = std::fabs(n.x()) > 0.9 ? vec3(0, 1, 0) : vec3(1, 0, 0);
+      t = t - dot(t, n) * n;
+    }
+    t = unit_vector(t);
+    b = cross(n, t);
+  }
+
+  vec3 to_local(const vec3 &w) const { return vec3(dot(w, t), dot(w, b), dot(w, n)); }
+  vec3 to_world(const vec3 &w) const { return w.x() * t + w.y() * b + w.z() * n; }
+};
+
+// Isotropic GGX (Trowbridge-Reitz) microfacet distribution, in the local frame of a
+// shading_frame. alpha is the glTF roughness squared.
+class ggx_distribution
+{
+public:
+  explicit ggx_distribution(double alpha) : alpha(std::fmax(alpha, 1e-3)) {}
+
+  // Density of microfacet normals h
+  double D(const vec3 &h) const
+  {
+    double a2 = alpha * alpha;
+    double d = h.z() * h.z() * (a2 - 1) + 1;
+    return a2 / (pi * d * d);
+  }
+
+  // Smith's masking function, and the height-correlated masking-shadowing of both directions
+  double G1(const vec3 &w) const { return 1 / (1 + lambda(w)); }
+  double G2(const vec3 &wo, const vec3 &wi) const { return 1 / (1 + lambda(wo) + lambda(wi)); }
+
+  // Microfacet normal visible from wo, distributed by D(h) G1(wo) (wo . h) / wo.z
+  // (Heitz 2018, "Sampling the GGX Distribution of Visible Normals")
+  vec3 sample_visible_normal(const vec3 &wo, double u1, double u2) const
+  {
+    // stretch wo to the hemisphere configuration
+    vec3 vh = unit_vector(vec3(alpha * wo.x(), alpha * wo.y(), wo.z()));
+
+    double length_squared = vh.x() * vh.x() + vh.y() * vh.y();
+    vec3 t1 = length_squared > 0 ? vec3(-vh.y(), vh.x(), 0) / std::sqrt(length_squared) : vec3(1, 0, 0);
+    vec3 t2 = cross(vh, t1);
+
+    // uniform point on the disk, warped onto the visible part of the hemisphere
+    double r = std::sqrt(u1);
+    double phi = 2 * pi * u2;
+    double p1 = r * std::cos(phi);
+    double p2 = r * std::sin(phi);
+    double s = 0.5 * (1 + vh.z());
+    p2 = (1 - s) * std::sqrt(1 - p1 * p1) + s * p2;
+    vec3 nh = p1 * t1 + p2 * t2 + std::sqrt(std::fmax(0.0, 1 - p1 * p1 - p2 * p2)) * vh;
+
+    // and unstretch
+    return unit_vector(vec3(alpha * nh.x(), alpha * nh.y(), std::fmax(1e-6, nh.z())));
+  }
+
+  // Density of wi = reflect(-wo, h) for h from sample_visible_normal
+  double reflection_pdf(const vec3 &wo, const vec3 &h) const
+  {
+    return G1(wo) * D(h) / (4 * wo.z());
+  }
+
+private:
+  double alpha;
+
+  double lambda(const vec3 &w) const
+  {
+    double cos2 = w.z() * w.z();
+    if (cos2 <= 0)
+      return 0;
+    double tan2 = std::fmax(0.0, 1 - cos2) / cos2;
+    return (std::sqrt(1 + alpha * alpha * tan2) - 1) / 2;
+  }
+};
+
+// glTF's metallic-roughness model: a GGX specular layer with Schlick Fresnel over a
+// Lambertian base. Metals have no base and tint their reflection with base_color;
+// dielectrics reflect 4% at normal incidence. Directions are in the local frame, and
+// both wo and wi point away from the surface.
+class metallic_roughness_bsdf
+{
+public:
+  metallic_roughness_bsdf(const color &base_color, double metallic, double roughness)
+      : base_color(base_color), metallic(metallic), distribution(roughness * roughness)
+  {
+    f0 = (1 - metallic) * color(0.04) + metallic * base_color;
+  }
+
+  color f(const vec3 &wo, const vec3 &wi) const
+  {
+    if (wo.z() <= 0 || wi.z() <= 0)
+      return color(0);
+    vec3 h = unit_vector(wo + wi);
+    color F = fresnel(dot(wo, h));
+    color specular = F * distribution.D(h) * distribution.G2(wo, wi) / (4 * wo.z() * wi.z());
+    color diffuse = (1 - metallic) * (color(1) - F) * base_color / pi;
+    return specular + diffuse;
+  }
+
+  double pdf(const vec3 &wo, const vec3 &wi) const
+  {
+    if (wo.z() <= 0 || wi.z() <= 0)
+      return 0;
+    double p = specular_probability(wo);
+    vec3 h = unit_vector(wo + wi);
+    return p * distribution.reflection_pdf(wo, h) + (1 - p) * wi.z() / pi;
+  }
+
+  // Picks the specular lobe (visible normals) or the diffuse one (cosine weighted) and
+  // samples a direction from it. Returns whether the sample is specular.
+  bool sample(const vec3 &wo, double u1, double u2, double u3, vec3 &wi) const
+  {
+    if (u1 < specular_probability(wo))
+    {
+      vec3 h = distribution.sample_visible_normal(wo, u2, u3);
+      wi = 2 * dot(wo, h) * h - wo;
+      return true;
+    }
+    double r = std::sqrt(u2);
+    double phi = 2 * pi * u3;
+    wi = vec3(r * std::cos(phi), r * std::sin(phi), std::sqrt(std::fmax(0.0, 1 - u2)));
+    return false;
+  }
+
+private:
+  color base_color;
+  double metallic;
+  color f0;
+  ggx_distribution distribution;
+
+  color fresnel(double cos_theta) const
+  {
+    double m = std::pow(1 - std::clamp(cos_theta, 0.0, 1.0), 5);
+    return f0 + (color(1) - f0) * m;
+  }
+
+  // Chance of sampling the specular lobe, from how much each lobe reflects towards wo
+  double specular_probability(const vec3 &wo) const
+  {
+    color F = fresnel(wo.z());
+    double specular = luminance(F);
+    double diffuse = (1 - metallic) * luminance((color(1) - F) * base_color);
+    if (specular + diffuse <= 0)
+      return 1;
+    return specular / (specular + diffuse);
+  }
+
+  static double luminance(const color &c)
+  {
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+  }
+};
+
+#endif
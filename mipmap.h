@@ -0,0 +1,358 @@
+#ifndef MIPMAP_H
+#define MIPMAP_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "color.h"
+#include "texture_cache.h"
+
+// Decoded 8-bit pixels owned by someone else, e.g. a gltf Image
+struct image_view
+{
+  const unsigned char *pixels;
+  int width;
+  int height;
+  int components;
+};
+
+// How a mip_chain stores its texels. 8-bit images keep their 8-bit values, 4 bytes a
+// texel, and lookups decode them through a table: srgb8 has sRGB encoded color channels
+// (color textures) and unorm8 linear ones (data textures like normal or roughness maps).
+// Alpha is always linear. float32 is for images computed as floats, like baked textures,
+// that would lose precision as 8 bits.
+enum class texel_format
+{
+  srgb8,
+  unorm8,
+  float32,
+};
+
+// Image pyramid of RGBA texels. Level 0 is the full image and every level after it halves
+// the resolution with a box filter in linear space, down to 1x1. Lookups are clamped to
+// the edge of the image and return linear values.
+//
+// Texels are stored in tile_size x tile_size tiles, level after level, rather than in
+// scanlines. A bilinear footprint then usually falls in one 1 KB tile (4 KB for float32)
+// instead of straddling two rows that are a whole image width apart, and the tiles can
+// be paged in one at a time from a file through a texture_cache.
+class mip_chain
+{
+public:
+  static constexpr int tile_size = 16;
+  static constexpr size_t tile_texels = tile_size * tile_size;
+
+  static constexpr size_t bytes_per_tile(texel_format format)
+  {
+    return tile_texels * (format == texel_format::float32 ? 4 * sizeof(float) : 4);
+  }
+
+  mip_chain() {}
+
+  // Filter image into 8-bit tiles owned by the chain. srgb: whether the 8-bit color
+  // channels are sRGB encoded or already linear.
+  mip_chain(const image_view &image, bool srgb) : storage(srgb ? texel_format::srgb8 : texel_format::unorm8)
+  {
+    const float *lut = decoding().to_linear;
+    const float *alpha_lut = unorm_decoding().to_linear;
+
+    scanline_image level = {image.width, image.height, std::vector<float>(4 * size_t(image.width) * image.height)};
+    size_t num_pixels = size_t(image.width) * image.height;
+    for (size_t i = 0; i < num_pixels; i++)
+    {
+      const unsigned char *pixel = image.pixels + i * image.components;
+      float *texel = &level.texels[4 * i];
+      if (image.components < 3)
+      {
+        // grayscale, optionally with alpha
+        texel[0] = texel[1] = texel[2] = lut[pixel[0]];
+        texel[3] = image.components == 2 ? alpha_lut[pixel[1]] : 1.0f;
+      }
+      else
+      {
+        texel[0] = lut[pixel[0]];
+        texel[1] = lut[pixel[1]];
+        texel[2] = lut[pixel[2]];
+        texel[3] = image.components == 4 ? alpha_lut[pixel[3]] : 1.0f;
+      }
+    }
+
+    build(std::move(level));
+  }
+
+  // Filter linear RGBA floats, in scanline order, into float32 tiles owned by the chain
+  mip_chain(int width, int height, std::vector<float> rgba) : storage(texel_format::float32)
+  {
+    build(scanline_image{width, height, std::move(rgba)});
+  }
+
+  // Tiles written by another chain's tile_data, owned by someone else (e.g. a mapped
+  // scene cache) that has to outlive this chain
+  mip_chain(int width, int height, texel_format format, const unsigned char *tiles) : storage(format), tiles(tiles)
+  {
+    set_layout(width, height);
+  }
+
+  // Tiles written by another chain's tile_data, starting offset bytes into a file that
+  // cache reads them from as they are needed
+  mip_chain(int width, int height, texel_format format, texture_cache *cache, int file, uint64_t offset) : storage(format), cache(cache), file(file), file_offset(offset)
+  {
+    set_layout(width, height);
+  }
+
+  int num_levels() const { return levels.size(); }
+  int width() const { return levels.empty() ? 0 : levels[0].width; }
+  int height() const { return levels.empty() ? 0 : levels[0].height; }
+  texel_format format() const { return storage; }
+
+  // Every tile of every level, or nullptr if the tiles live in a texture_cache
+  const unsigned char *tile_data() const { return tiles; }
+  size_t num_tiles() const { return total_tiles; }
+  size_t tile_bytes() const { return bytes_per_tile(storage); }
+
+  // Bilinear RGBA lookup in one level. (u, v) are image coordinates in [0, 1] with v
+  // going down.
+  void bilinear(int level, double u, double v, float rgba[4]) const
+  {
+    const mip_level &l = levels[level];
+    double x = u * l.width - 0.5;
+    double y = v * l.height - 0.5;
+    int x0 = int(std::floor(x));
+    int y0 = int(std::floor(y));
+    float fx = x - x0;
+    float fy = y - y0;
+
+    float t00[4], t10[4], t01[4], t11[4];
+    texel(l, x0, y0, t00);
+    texel(l, x0 + 1, y0, t10);
+    texel(l, x0, y0 + 1, t01);
+    texel(l, x0 + 1, y0 + 1, t11);
+    for (int c = 0; c < 4; c++)
+    {
+      float top = t00[c] + fx * (t10[c] - t00[c]);
+      float bottom = t01[c] + fx * (t11[c] - t01[c]);
+      rgba[c] = top + fy * (bottom - top);
+    }
+  }
+  // Trilinear RGBA lookup for a footprint that is width wide in [0, 1] image
+  // coordinates. A zero width reads the full resolution level.
+  void trilinear(double u, double v, double width, float rgba[4]) const
+  {
+    double lod = width > 0 ? std::log2(width * std::max(levels[0].width, levels[0].height)) : 0;
+    if (lod <= 0)
+    {
+      bilinear(0, u, v, rgba);
+      return;
+    }
+    int last = num_levels() - 1;
+    if (lod >= last)
+    {
+      bilinear(last, u, v, rgba);
+      return;
+    }
+
+    int level = int(lod);
+    float t = lod - level;
+    float fine[4];
+    float coarse[4];
+    bilinear(level, u, v, fine);
+    bilinear(level + 1, u, v, coarse);
+    for (int c = 0; c < 4; c++)
+    {
+      rgba[c] = fine[c] + t * (coarse[c] - fine[c]);
+    }
+  }
+
+private:
+  struct mip_level
+  {
+    int width;
+    int height;
+    int tiles_x;
+    size_t first_tile; // index of the level's top left tile among all tiles
+  };
+
+  // A level while it is being built, in scanline order
+  struct scanline_image
+  {
+    int width;
+    int height;
+    std::vector<float> texels; // RGBA
+
+    const float *texel(int x, int y) const
+    {
+      x = std::clamp(x, 0, width - 1);
+      y = std::clamp(y, 0, height - 1);
+      return &texels[4 * (size_t(y) * width + x)];
+    }
+  };
+
+  // Decoding of one 8-bit channel, and its inverse for storing filtered levels
+  struct channel_decoding
+  {
+    float to_linear[256];
+    float midpoints[255]; // between successive to_linear values
+
+    unsigned char encode(float linear) const
+    {
+      return std::upper_bound(midpoints, midpoints + 255, linear) - midpoints;
+    }
+  };
+
+  std::vector<mip_level> levels;
+  size_t total_tiles = 0;
+  texel_format storage = texel_format::float32;
+
+  const unsigned char *tiles = nullptr;
+  std::vector<unsigned char> owned_tiles;
+
+  texture_cache *cache = nullptr;
+  int file = -1;
+  uint64_t file_offset = 0;
+
+  void build(scanline_image level)
+  {
+    set_layout(level.width, level.height);
+    owned_tiles.resize(total_tiles * tile_bytes());
+    tiles = owned_tiles.data();
+    for (mip_level &l : levels)
+    {
+      if (&l != &levels[0])
+        level = downsample(level);
+      store_tiles(l, level);
+    }
+  }
+
+  void set_layout(int width, int height)
+  {
+    while (true)
+    {
+      int tiles_x = (width + tile_size - 1) / tile_size;
+      int tiles_y = (height + tile_size - 1) / tile_size;
+      levels.push_back(mip_level{width, height, tiles_x, total_tiles});
+      total_tiles += size_t(tiles_x) * tiles_y;
+      if (width == 1 && height == 1)
+        break;
+      width = std::max(1, width / 2);
+      height = std::max(1, height / 2);
+    }
+  }
+
+  // The linear RGBA value of texel (x, y) of a level
+  void texel(const mip_level &l, int x, int y, float rgba[4]) const
+  {
+    x = std::clamp(x, 0, l.width - 1);
+    y = std::clamp(y, 0, l.height - 1);
+    size_t tile_index = l.first_tile + size_t(y / tile_size) * l.tiles_x + x / tile_size;
+    const unsigned char *tile = tiles ? tiles + tile_index * tile_bytes() : cache->tile(file, file_offset + tile_index * tile_bytes());
+    size_t index = (y % tile_size) * tile_size + x % tile_size;
+    if (storage == texel_format::float32)
+    {
+      memcpy(rgba, tile + index * 4 * sizeof(float), 4 * sizeof(float));
+      return;
+    }
+    const unsigned char *bytes = tile + 4 * index;
+    const float *lut = decoding().to_linear;
+    rgba[0] = lut[bytes[0]];
+    rgba[1] = lut[bytes[1]];
+    rgba[2] = lut[bytes[2]];
+    rgba[3] = unorm_decoding().to_linear[bytes[3]];
+  }
+
+  void store_tiles(const mip_level &l, const scanline_image &image)
+  {
+    const channel_decoding &color_decoding = decoding();
+    for (int y = 0; y < l.height; y++)
+    {
+      for (int x = 0; x < l.width; x++)
+      {
+        size_t tile_index = l.first_tile + size_t(y / tile_size) * l.tiles_x + x / tile_size;
+        size_t index = (y % tile_size) * tile_size + x % tile_size;
+        unsigned char *tile = owned_tiles.data() + tile_index * tile_bytes();
+        const float *from = image.texel(x, y);
+        if (storage == texel_format::float32)
+        {
+          memcpy(tile + index * 4 * sizeof(float), from, 4 * sizeof(float));
+        }
+        else
+        {
+          unsigned char *to = tile + 4 * index;
+          for (int c = 0; c < 3; c++)
+            to[c] = color_decoding.encode(from[c]);
+          to[3] = unorm_decoding().encode(from[3]);
+        }
+      }
+    }
+  }
+
+  // 2x2 box filter. An odd dimension folds its last row or column into the one before.
+  static scanline_image downsample(const scanline_image &source)
+  {
+    scanline_image result = {std::max(1, source.width / 2), std::max(1, source.height / 2), {}};
+    result.texels.assign(4 * size_t(result.width) * result.height, 0.0f);
+
+    for (int y = 0; y < source.height; y++)
+    {
+      int ry = std::min(y / 2, result.height - 1);
+      for (int x = 0; x < source.width; x++)
+      {
+        int rx = std::min(x / 2, result.width - 1);
+        const float *from = source.texel(x, y);
+        float *to = &result.texels[4 * (size_t(ry) * result.width + rx)];
+        for (int c = 0; c < 4; c++)
+          to[c] += from[c];
+      }
+    }
+
+    // Each result texel got the sum of however many source texels folded into it
+    for (int ry = 0; ry < result.height; ry++)
+    {
+      int count_y = ry == result.height - 1 ? source.height - 2 * ry : 2;
+      for (int rx = 0; rx < result.width; rx++)
+      {
+        int count_x = rx == result.width - 1 ? source.width - 2 * rx : 2;
+        float scale = 1.0f / (std::max(1, count_x) * std::max(1, count_y));
+        float *to = &result.texels[4 * (size_t(ry) * result.width + rx)];
+        for (int c = 0; c < 4; c++)
+          to[c] *= scale;
+      }
+    }
+    return result;
+  }
+
+  // How the color channels are decoded; only for 8-bit formats
+  const channel_decoding &decoding() const
+  {
+    return storage == texel_format::srgb8 ? srgb_decoding() : unorm_decoding();
+  }
+
+  static channel_decoding make_decoding(bool srgb)
+  {
+    channel_decoding result;
+    for (int i = 0; i < 256; i++)
+    {
+      double c = i / 255.0;
+      result.to_linear[i] = !srgb ? c : c <= 0.04045 ? c / 12.92 : std::pow((c + 0.055) / 1.055, 2.4);
+    }
+    for (int i = 0; i < 255; i++)
+      result.midpoints[i] = 0.5f * (result.to_linear[i] + result.to_linear[i + 1]);
+    return result;
+  }
+
+  static const channel_decoding &srgb_decoding()
+  {
+    static const channel_decoding table = make_decoding(true);
+    return table;
+  }
+
+  static const channel_decoding &unorm_decoding()
+  {
+    static const channel_decoding table = make_decoding(false);
+    return table;
+  }
+};
+
+#endif
@@ -6,6 +6,11 @@ import subprocess
 # Number of chunks for parallel processing
 NUM_CHUNKS = 20
 NUM_RESERVED_CORES = 1
+# RT_DENOISE=1 denoises the combined image, and RT_LAYERS=out/render.exr writes it with
+# its output layers. Each chunk then also writes its auxiliary buffers next to its rows,
+# and the raytracer puts them together at the end.
+DENOISE = bool(os.environ.get("RT_DENOISE"))
+KEEP_AOVS = DENOISE or bool(os.environ.get("RT_LAYERS"))
 
 
 def call_chunk_command(filename: str, chunk: int):
@@ -14,8 +19,9 @@ def call_chunk_command(filename: str, chunk: int):
 
     # Save chunk output to a file
     output_path = f"out/{filename}/{chunk}.txt"
+    env = dict(os.environ, RT_AOV_DIR=f"out/{filename}") if KEEP_AOVS else None
     with open(output_path, "w") as f:
-        subprocess.call(["./raytracer", f"--chunk={chunk}"], stdout=f)
+        subprocess.call(["./raytracer", f"--chunk={chunk}"], stdout=f, env=env)
 
     print(f"Chunk {chunk} done")
 
@@ -49,11 +55,15 @@ def call_raytracer_command():
     print("All chunks processed, combining files...")
 
     # Combine all chunk outputs into the final PPM file
-    with open(f"out/{filename}.ppm", "a") as f:
-        for chunk in range(NUM_CHUNKS):
-            chunk_path = f"out/{filename}/{chunk}.txt"
-            with open(chunk_path, "r") as chunk_file:
-                f.write(chunk_file.read())
+    if KEEP_AOVS:
+        with open(f"out/{filename}.ppm", "w") as f:
+            subprocess.call(["./raytracer", f"--combine=out/{filename}"], stdout=f)
+    else:
+        with open(f"out/{filename}.ppm", "a") as f:
+            for chunk in range(NUM_CHUNKS):
+                chunk_path = f"out/{filename}/{chunk}.txt"
+                with open(chunk_path, "r") as chunk_file:
+                    f.write(chunk_file.read())
 
     t_end = time.time()
 
@@ -69,6 +79,8 @@ def call_raytracer_command():
     if exit_code == 0:
         for i in range(NUM_CHUNKS):
             os.remove(f"out/{filename}/{i}.txt")
+            if KEEP_AOVS:
+                os.remove(f"out/{filename}/{i}.aov")
         os.rmdir(f"out/{filename}")
         os.remove(f"out/{filename}.ppm")
 
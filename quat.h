@@ -94,6 +94,23 @@ void quat::convertToUnitNormQuaternion(double angle)
   w = cos(half_angle);
   v = unit_vector(v) * sin(half_angle);
 }
+// Spherical interpolation between unit quaternions a (t = 0) and b (t = 1), the short
+// way round
+inline quat slerp(const quat &a, const quat &b, double t)
+{
+  double cos_angle = a.w * b.w + dot(a.v, b.v);
+  quat end = cos_angle < 0 ? b * -1.0 : b;
+  cos_angle = std::fabs(cos_angle);
+  if (cos_angle > 0.9995)
+  {
+    // nearly the same rotation, where lerping is as good and doesn't divide by ~0
+    return (a * (1 - t) + end * t).normalized();
+  }
+  double angle = std::acos(cos_angle);
+  double sin_angle = std::sin(angle);
+  return a * (std::sin((1 - t) * angle) / sin_angle) + end * (std::sin(t * angle) / sin_angle);
+}
+
 // void quat::setRotation(double angle, const vec3& axis) {
 
 // }
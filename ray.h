@@ -19,10 +19,40 @@ public:
 		return orig + t * dir;
 	}
 
+	// Differentials are the rays one pixel over in x and in y. They travel with camera
+	// rays and specular bounces so hits can estimate how much surface a pixel covers.
+	bool has_differentials() const { return _has_differentials; }
+	const point3 &rx_origin() const { return rx_orig; }
+	const vec3 &rx_direction() const { return rx_dir; }
+	const point3 &ry_origin() const { return ry_orig; }
+	const vec3 &ry_direction() const { return ry_dir; }
+
+	void set_differentials(const point3 &rx_origin, const vec3 &rx_direction, const point3 &ry_origin, const vec3 &ry_direction)
+	{
+		rx_orig = rx_origin;
+		rx_dir = rx_direction;
+		ry_orig = ry_origin;
+		ry_dir = ry_direction;
+		_has_differentials = true;
+	}
+
+	// Shrinks the differentials towards the main ray, e.g. when many samples share a pixel
+	void scale_differentials(double scale)
+	{
+		rx_orig = orig + (rx_orig - orig) * scale;
+		ry_orig = orig + (ry_orig - orig) * scale;
+		rx_dir = dir + (rx_dir - dir) * scale;
+		ry_dir = dir + (ry_dir - dir) * scale;
+	}
+
 private:
 	point3 orig;
 	vec3 dir;
 	double _time = 0;
+
+	bool _has_differentials = false;
+	point3 rx_orig, ry_orig;
+	vec3 rx_dir, ry_dir;
 };
 
 #endif
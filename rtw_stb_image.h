@@ -7,9 +7,13 @@
 #pragma warning(push, 0)
 #endif
 
+// tiny_gltf (through texture.h) may already have compiled stb_image into this translation
+// unit, in which case including it again would define everything twice
+#ifndef STBI_INCLUDE_STB_IMAGE_H
 #define STB_IMAGE_IMPLEMENTATION
 #define STBI_FAILURE_USERMSG
 #include "stb_image.h"
+#endif
 
 #include <cstdlib>
 #include <iostream>
@@ -56,7 +60,6 @@ public:
 
   ~rtw_image()
   {
-    delete[] bdata;
     STBI_FREE(fdata);
   }
 
@@ -68,40 +71,39 @@ public:
     // contiguous, going left to right for the width of the image, followed by the next row
     // below, for the full height of the image.
 
-    auto n = bytes_per_pixel; // Dummy out parameter: original components per pixel
-    fdata = stbi_loadf(filename.c_str(), &image_width, &image_height, &n, bytes_per_pixel);
+    auto n = floats_per_pixel; // Dummy out parameter: original components per pixel
+    fdata = stbi_loadf(filename.c_str(), &image_width, &image_height, &n, floats_per_pixel);
     if (fdata == nullptr)
       return false;
 
-    bytes_per_scanline = image_width * bytes_per_pixel;
-    convert_to_bytes();
+    floats_per_scanline = image_width * floats_per_pixel;
     return true;
   }
 
   int width() const { return (fdata == nullptr) ? 0 : image_width; }
   int height() const { return (fdata == nullptr) ? 0 : image_height; }
 
-  const unsigned char *pixel_data(int x, int y) const
+  const float *pixel_data(int x, int y) const
   {
-    // Return the address of the three RGB bytes of the pixel at x,y. If there is no image
-    // data, returns magenta.
-    static unsigned char magenta[] = {255, 0, 255};
-    if (bdata == nullptr)
+    // Return the address of the three linear RGB floats of the pixel at x,y. If there is
+    // no image data, returns magenta. Only the float data is kept, there is no second
+    // 8-bit copy of the image.
+    static float magenta[] = {1, 0, 1};
+    if (fdata == nullptr)
       return magenta;
 
     x = clamp(x, 0, image_width);
     y = clamp(y, 0, image_height);
 
-    return bdata + y * bytes_per_scanline + x * bytes_per_pixel;
+    return fdata + y * floats_per_scanline + x * floats_per_pixel;
   }
 
 private:
-  const int bytes_per_pixel = 3;
-  float *fdata = nullptr;         // Linear floating point pixel data
-  unsigned char *bdata = nullptr; // Linear 8-bit pixel data
-  int image_width = 0;            // Loaded image width
-  int image_height = 0;           // Loaded image height
-  int bytes_per_scanline = 0;
+  const int floats_per_pixel = 3;
+  float *fdata = nullptr;  // Linear floating point pixel data
+  int image_width = 0;     // Loaded image width
+  int image_height = 0;    // Loaded image height
+  int floats_per_scanline = 0;
 
   static int clamp(int x, int low, int high)
   {
@@ -112,32 +114,6 @@ private:
       return x;
     return high - 1;
   }
-
-  static unsigned char float_to_byte(float value)
-  {
-    if (value <= 0.0)
-      return 0;
-    if (1.0 <= value)
-      return 255;
-    return static_cast<unsigned char>(256.0 * value);
-  }
-
-  void convert_to_bytes()
-  {
-    // Convert the linear floating point pixel data to bytes, storing the resulting byte
-    // data in the `bdata` member.
-
-    int total_bytes = image_width * image_height * bytes_per_pixel;
-    bdata = new unsigned char[total_bytes];
-
-    // Iterate through all pixel components, converting from [0.0, 1.0] float values to
-    // unsigned [0, 255] byte values.
-
-    auto *bptr = bdata;
-    auto *fptr = fdata;
-    for (auto i = 0; i < total_bytes; i++, fptr++, bptr++)
-      *bptr = float_to_byte(*fptr);
-  }
 };
 
 // Restore MSVC compiler warnings
@@ -0,0 +1,290 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+// How the uniform numbers a path is built from are picked
+enum class sampler_type
+{
+  independent, // random_double() every time, plain Monte Carlo
+  stratified,  // each dimension jittered in its own shuffled strata
+  sobol,       // Owen scrambled Sobol points, shuffled and scrambled per pixel and dimension
+  blue_noise,  // the same Sobol points in every pixel, shifted by a blue noise mask
+};
+
+// RT_SAMPLER=independent|stratified|sobol|blue_noise, sobol by default
+inline sampler_type default_sampler_type()
+{
+  const char *name = getenv("RT_SAMPLER");
+  if (!name)
+    return sampler_type::sobol;
+  if (strcmp(name, "independent") == 0)
+    return sampler_type::independent;
+  if (strcmp(name, "stratified") == 0)
+    return sampler_type::stratified;
+  if (strcmp(name, "blue_noise") == 0)
+    return sampler_type::blue_noise;
+  return sampler_type::sobol;
+}
+
+// Numbers for the samples of a pixel. Every decision along a path reads its own
+// dimension: the camera's come first (pixel position, lens, time), then each bounce gets
+// a block of bounce_dimensions starting at a fixed place, so the same decision reads the
+// same dimension in every sample even when earlier bounces used fewer numbers. Within
+// a dimension the samples of a pixel are well spread out, and dimensions are scrambled
+// independently so they don't correlate with each other.
+//
+// Sobol points use the first two dimensions of the Sobol sequence for every pair of
+// dimensions, with the sample order shuffled and the values Owen scrambled by hashes of
+// the pixel and dimension (Burley, "Practical Hash-based Owen Scrambling"). That keeps
+// the stratification of every power of two prefix, without needing direction numbers
+// for hundreds of dimensions.
+class sampler
+{
+public:
+  static constexpr int camera_dimensions = 5;
+  // one number for where a medium scatters the ray, then one number and one pair each
+  // for the light, the environment and the material
+  static constexpr int bounce_dimensions = 10;
+
+  sampler(sampler_type type, int samples_per_pixel, uint32_t seed = 0) : type(type), samples_per_pixel(samples_per_pixel), seed(seed) {}
+
+  void start_pixel_sample(int x, int y, int index)
+  {
+    pixel_x = x;
+    pixel_y = y;
+    sample_index = index;
+    dimension = 0;
+    pixel_hash = type == sampler_type::blue_noise ? mix(seed) : mix(seed ^ mix(uint32_t(x) ^ mix(uint32_t(y))));
+  }
+
+  void start_bounce(int bounce)
+  {
+    dimension = camera_dimensions + bounce * bounce_dimensions;
+  }
+
+  // Passes over count dimensions a decision didn't need this time, so that the ones after
+  // it still read the same dimensions in every sample
+  void skip(int count)
+  {
+    dimension += count;
+  }
+
+  double get_1d()
+  {
+    uint32_t hash = mix(pixel_hash ^ uint32_t(dimension++));
+    switch (type)
+    {
+    case sampler_type::stratified:
+    {
+      uint32_t stratum = permute(sample_index, samples_per_pixel, hash);
+      return (stratum + random_double()) / samples_per_pixel;
+    }
+    case sampler_type::sobol:
+    case sampler_type::blue_noise:
+    {
+      uint32_t index = owen_scramble(sample_index, hash);
+      double u = to_unit(owen_scramble(reverse_bits(index), mix(hash)));
+      return type == sampler_type::sobol ? u : shift(u, hash, 0);
+    }
+    default:
+      return random_double();
+    }
+  }
+
+  void get_2d(double &u1, double &u2)
+  {
+    uint32_t hash = mix(pixel_hash ^ uint32_t(dimension));
+    dimension += 2;
+    switch (type)
+    {
+    case sampler_type::stratified:
+    {
+      int nx = std::max(1, int(std::sqrt(double(samples_per_pixel))));
+      int ny = (samples_per_pixel + nx - 1) / nx;
+      uint32_t stratum = permute(sample_index, nx * ny, hash);
+      u1 = (stratum % nx + random_double()) / nx;
+      u2 = (stratum / nx + random_double()) / ny;
+      return;
+    }
+    case sampler_type::sobol:
+    case sampler_type::blue_noise:
+    {
+      uint32_t index = owen_scramble(sample_index, hash);
+      u1 = to_unit(owen_scramble(reverse_bits(index), mix(hash)));
+      u2 = to_unit(owen_scramble(sobol_second_dimension(index), mix(mix(hash))));
+      if (type == sampler_type::blue_noise)
+      {
+        u1 = shift(u1, hash, 0);
+        u2 = shift(u2, hash, 1);
+      }
+      return;
+    }
+    default:
+      u1 = random_double();
+      u2 = random_double();
+      return;
+    }
+  }
+
+private:
+  sampler_type type;
+  uint32_t samples_per_pixel;
+  uint32_t seed;
+  int pixel_x = 0, pixel_y = 0;
+  uint32_t sample_index = 0;
+  int dimension = 0;
+  uint32_t pixel_hash = 0;
+
+  static uint32_t mix(uint32_t x)
+  {
+    // lowbias32 by Chris Wellons
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+  }
+
+  static uint32_t reverse_bits(uint32_t x)
+  {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+    x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+    x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+    x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+    return x;
+  }
+
+  // Random permutation of the binary tree of intervals that x's bits pick, from the
+  // most significant bit down: a nested uniform scramble
+  static uint32_t owen_scramble(uint32_t x, uint32_t seed)
+  {
+    // Laine-Karras style hash, constants from Nathan Vegdahl
+    x = reverse_bits(x);
+    x ^= x * 0x3d20adea;
+    x += seed;
+    x *= (seed >> 16) | 1;
+    x ^= x * 0x05526c56;
+    x ^= x * 0x53a22864;
+    return reverse_bits(x);
+  }
+
+  // Its generator matrix is Pascal's triangle mod 2. The first dimension is just the
+  // index with its bits reversed.
+  static uint32_t sobol_second_dimension(uint32_t index)
+  {
+    uint32_t result = 0;
+    for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1)
+    {
+      if (index & 1)
+        result ^= v;
+    }
+    return result;
+  }
+
+  static double to_unit(uint32_t x)
+  {
+    return x * 0x1p-32;
+  }
+
+  // Element i of a random permutation of 0..n-1 picked by seed (Kensler, "Correlated
+  // Multi-Jittered Sampling")
+  static uint32_t permute(uint32_t i, uint32_t n, uint32_t seed)
+  {
+    uint32_t w = n - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do
+    {
+      i ^= seed;
+      i *= 0xe170893d;
+      i ^= seed >> 16;
+      i ^= (i & w) >> 4;
+      i ^= seed >> 8;
+      i *= 0x0929eb3f;
+      i ^= seed >> 23;
+      i ^= (i & w) >> 1;
+      i *= 1 | seed >> 27;
+      i *= 0x6935fa69;
+      i ^= (i & w) >> 11;
+      i *= 0x74dcb303;
+      i ^= (i & w) >> 2;
+      i *= 0x9e501cc3;
+      i ^= (i & w) >> 2;
+      i *= 0xc860a3df;
+      i &= w;
+      i ^= i >> 5;
+    } while (i >= n);
+    return (i + seed) % n;
+  }
+
+  // Toroidal shift of u by the blue noise mask at this pixel, with the mask moved around
+  // for each dimension so that dimensions don't share a pattern. Neighbouring pixels get
+  // offsets far apart, which turns the error between them into high frequency noise.
+  double shift(double u, uint32_t hash, int axis) const
+  {
+    uint32_t offset = mix(hash + axis);
+    int x = (pixel_x + int(offset & 63)) & 63;
+    int y = (pixel_y + int((offset >> 6) & 63)) & 63;
+    u += blue_noise_mask()[y * 64 + x];
+    return u >= 1 ? u - 1 : u;
+  }
+
+  // 64x64 tileable mask with values (rank + 0.5) / 4096 in an order where each pixel
+  // is as far as possible from the ones before it, built once by filling the largest
+  // void (lowest Gaussian energy) one pixel at a time (Ulichney's void and cluster)
+  static const std::vector<double> &blue_noise_mask()
+  {
+    static const std::vector<double> mask = []
+    {
+      const int size = 64, pixels = size * size;
+      const double sigma = 1.5;
+      std::vector<double> kernel(pixels);
+      for (int dy = 0; dy < size; dy++)
+      {
+        for (int dx = 0; dx < size; dx++)
+        {
+          int x = std::min(dx, size - dx), y = std::min(dy, size - dy);
+          kernel[dy * size + dx] = std::exp(-(x * x + y * y) / (2 * sigma * sigma));
+        }
+      }
+
+      // a little noise so that ties don't line the first pixels up
+      std::vector<double> energy(pixels);
+      for (int i = 0; i < pixels; i++)
+        energy[i] = 1e-6 * to_unit(mix(i));
+
+      std::vector<double> result(pixels, -1);
+      for (int rank = 0; rank < pixels; rank++)
+      {
+        int best = -1;
+        for (int i = 0; i < pixels; i++)
+        {
+          if (result[i] < 0 && (best < 0 || energy[i] < energy[best]))
+            best = i;
+        }
+        result[best] = (rank + 0.5) / pixels;
+        int bx = best % size, by = best / size;
+        for (int y = 0; y < size; y++)
+        {
+          for (int x = 0; x < size; x++)
+            energy[y * size + x] += kernel[((y - by) & (size - 1)) * size + ((x - bx) & (size - 1))];
+        }
+      }
+      return result;
+    }();
+    return mask;
+  }
+};
+
+#endif
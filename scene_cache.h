@@ -0,0 +1,488 @@
+#ifndef SCENE_CACHE_H
+#define SCENE_CACHE_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "mapped_file.h"
+#include "load_gltf.h"
+
+// Binary cache of a built glTF scene: flattened triangles, material descriptions, tiled
+// texture mip chains, the camera and the already built BVH. Files live in cache/ and are
+// named after a hash of the source files and the build settings, so editing the scene or
+// changing how it is built simply misses the cache.
+//
+// Loading memory maps the file. Textures are read in place from the mapping, or paged in
+// tile by tile through a texture_cache when a texture memory budget is given, and the
+// BVH is rebuilt node by node from its stored shape without any sorting. Triangles and
+// materials get back the ids they were built with, so a render that loads the cache
+// agrees with one that built the scene on the ID output layers.
+//
+// Bump scene_cache_version whenever the layout or anything that affects the built scene
+// changes.
+const uint32_t scene_cache_version = 8;
+const char scene_cache_build_settings[] = "bvh=median-split-largest-axis;gltf=bake-single-instance-multi";
+
+class scene_cache
+{
+public:
+  // Hash of filename's contents, every external buffer and image it references, the
+  // cache version and the build settings
+  static uint64_t key(const std::string &filename)
+  {
+    uint64_t hash = fnv1a(&scene_cache_version, sizeof(scene_cache_version));
+    hash = fnv1a(scene_cache_build_settings, sizeof(scene_cache_build_settings), hash);
+
+    mapped_file file;
+    if (!file.open(filename))
+      return 0;
+    hash = fnv1a(file.data(), file.size(), hash);
+
+    bool is_glb = filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".glb") == 0;
+    if (!is_glb)
+    {
+      // External files referenced by the json
+      nlohmann::json gltf = nlohmann::json::parse(file.data(), file.data() + file.size(), nullptr, false);
+      for (const char *list : {"buffers", "images"})
+      {
+        if (!gltf.is_object() || !gltf.contains(list))
+          continue;
+        for (const auto &entry : gltf[list])
+        {
+          if (!entry.contains("uri") || IsDataURI(entry["uri"].get<std::string>()))
+            continue;
+          std::string uri;
+          URIDecode(entry["uri"].get<std::string>(), &uri, nullptr);
+          mapped_file referenced;
+          if (referenced.open(JoinPath(GetBaseDir(filename), uri)))
+            hash = fnv1a(referenced.data(), referenced.size(), hash);
+        }
+      }
+    }
+    return hash;
+  }
+
+  static std::string path_for(uint64_t key)
+  {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long)key);
+    return std::string("cache/") + name + ".rtscene";
+  }
+
+  // Write root (and everything under it) to the cache. Returns false, and writes nothing,
+  // if the scene holds something the cache can't represent.
+  static bool save(uint64_t key, const shared_ptr<hittable> &root, const gltf_material_table &materials, const camera &cam)
+  {
+    writer w(materials);
+    if (!w.add(root.get()))
+      return false;
+
+    header h = {};
+    memcpy(h.magic, "RTSCENE", 8);
+    h.version = scene_cache_version;
+    h.key = key;
+    h.num_images = materials.images.size();
+    h.num_materials = materials.descs.size();
+    h.num_triangles = w.triangles.size();
+    h.num_nodes = w.nodes.size();
+    h.num_matrices = w.matrices.size();
+    h.fallback_material_id = materials.fallback->id;
+    double camera_values[8] = {
+        cam.lookfrom.x(), cam.lookfrom.y(), cam.lookfrom.z(),
+        cam.lookat.x(), cam.lookat.y(), cam.lookat.z(),
+        cam.aspect_ratio, cam.vfov};
+    memcpy(h.camera, camera_values, sizeof(camera_values));
+
+    // Images are all decoded from 8-bit files, so their tiles all have the same size
+    std::vector<cached_image> images;
+    std::vector<unsigned char> tiles;
+    for (const shared_ptr<const mip_chain> &image : materials.images)
+    {
+      if (image->format() == texel_format::float32)
+        return false;
+      images.push_back(cached_image{uint32_t(image->width()), uint32_t(image->height()), tiles.size(), uint32_t(image->format()), 0});
+      tiles.insert(tiles.end(), image->tile_data(), image->tile_data() + image->num_tiles() * image->tile_bytes());
+    }
+    std::vector<cached_material> cached_materials;
+    for (size_t i = 0; i < materials.descs.size(); i++)
+    {
+      const gltf_material_desc &desc = materials.descs[i];
+      cached_materials.push_back(cached_material{
+          {desc.base_color.x(), desc.base_color.y(), desc.base_color.z()}, desc.alpha, desc.alpha_cutoff,
+          desc.metallic, desc.roughness, desc.normal_scale,
+          {desc.emissive.x(), desc.emissive.y(), desc.emissive.z()},
+          desc.image, int32_t(desc.mode), desc.metallic_roughness_image, desc.normal_image, desc.emissive_image, materials.materials[i]->id});
+    }
+
+    // Sections follow the header, each starting on an 8 byte boundary
+    uint64_t offset = sizeof(header);
+    h.images_offset = section(offset, images);
+    h.materials_offset = section(offset, cached_materials);
+    h.triangles_offset = section(offset, w.triangles);
+    h.nodes_offset = section(offset, w.nodes);
+    h.matrices_offset = section(offset, w.matrices);
+    h.tiles_offset = section(offset, tiles);
+    h.file_size = offset;
+
+    // Write to a temporary file and rename it, so a process reading the cache never sees
+    // a half written file
+    std::filesystem::create_directories("cache");
+    std::string path = path_for(key);
+    std::string temp_path = path + "." + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + ".tmp";
+    {
+      std::ofstream out(temp_path, std::ios::binary);
+      out.write(reinterpret_cast<const char *>(&h), sizeof(h));
+      write_section(out, h.images_offset, images);
+      write_section(out, h.materials_offset, cached_materials);
+      write_section(out, h.triangles_offset, w.triangles);
+      write_section(out, h.nodes_offset, w.nodes);
+      write_section(out, h.matrices_offset, w.matrices);
+      write_section(out, h.tiles_offset, tiles);
+      if (!out)
+      {
+        std::filesystem::remove(temp_path);
+        return false;
+      }
+    }
+    std::filesystem::rename(temp_path, path);
+    return true;
+  }
+
+  // Map the cache file for key and rebuild the scene from it. The textures read from the
+  // mapping, so this object has to outlive rendering. With a texture_budget (in bytes)
+  // textures are instead read from the file as they are needed, keeping at most that
+  // much texture data in memory.
+  bool load(uint64_t key, hittable_list &world, camera &cam, size_t texture_budget = 0)
+  {
+    std::string path = path_for(key);
+    if (!file.open(path) || file.size() < sizeof(header))
+      return false;
+
+    header h;
+    memcpy(&h, file.data(), sizeof(h));
+    if (memcmp(h.magic, "RTSCENE", 8) != 0 || h.version != scene_cache_version || h.key != key || h.file_size != file.size() || !valid(h))
+    {
+      file.close();
+      return false;
+    }
+
+    const cached_image *images = read_section<cached_image>(h.images_offset);
+    const cached_material *cached_materials = read_section<cached_material>(h.materials_offset);
+    const cached_triangle *triangles = read_section<cached_triangle>(h.triangles_offset);
+    const cached_node *nodes = read_section<cached_node>(h.nodes_offset);
+    const mat4 *matrices = read_section<mat4>(h.matrices_offset);
+    const unsigned char *tiles = read_section<unsigned char>(h.tiles_offset);
+
+    int tiles_file = -1;
+    if (texture_budget > 0)
+    {
+      tile_cache = std::make_unique<texture_cache>(texture_budget, mip_chain::bytes_per_tile(texel_format::srgb8));
+      tiles_file = tile_cache->add_file(path);
+    }
+    for (uint64_t i = 0; i < h.num_images; i++)
+    {
+      const cached_image &image = images[i];
+      texel_format format = texel_format(image.format);
+      if (tiles_file >= 0)
+        materials.images.push_back(make_shared<mip_chain>(image.width, image.height, format, tile_cache.get(), tiles_file, h.tiles_offset + image.offset));
+      else
+        materials.images.push_back(make_shared<mip_chain>(image.width, image.height, format, tiles + image.offset));
+    }
+    for (uint64_t i = 0; i < h.num_materials; i++)
+    {
+      const cached_material &m = cached_materials[i];
+      materials.descs.push_back(gltf_material_desc{
+          color(m.base_color[0], m.base_color[1], m.base_color[2]), m.alpha, m.image, alpha_mode(m.mode), m.alpha_cutoff,
+          m.metallic, m.roughness, m.metallic_roughness_image, m.normal_image, m.normal_scale,
+          color(m.emissive[0], m.emissive[1], m.emissive[2]), m.emissive_image});
+    }
+    materials.build();
+    for (uint64_t i = 0; i < h.num_materials; i++)
+      restore_id(material_ids, materials.materials[i]->id, cached_materials[i].id);
+    restore_id(material_ids, materials.fallback->id, h.fallback_material_id);
+
+    // Nodes were written children first, so every child already exists when its parent is built
+    std::vector<shared_ptr<hittable>> built(h.num_nodes);
+    for (uint64_t i = 0; i < h.num_nodes; i++)
+    {
+      const cached_node &node = nodes[i];
+      if (node.kind == node_bvh)
+      {
+        built[i] = make_shared<bvh_node>(built[node.a], built[node.b]);
+      }
+      else if (node.kind == node_triangle)
+      {
+        const cached_triangle &t = triangles[node.a];
+        shared_ptr<material> mat = t.material < 0 ? materials.fallback : materials.materials[t.material];
+        auto triangle = make_shared<tri>(t.read_vertex(0), t.read_vertex(1), t.read_vertex(2), mat);
+        restore_id(primitive_ids, triangle->id, t.primitive_id);
+        built[i] = triangle;
+      }
+      else
+      {
+        built[i] = make_shared<transform>(built[node.a], matrices[node.b]);
+      }
+    }
+    world = hittable_list(built.back());
+
+    cam.lookfrom = point3(h.camera[0], h.camera[1], h.camera[2]);
+    cam.lookat = point3(h.camera[3], h.camera[4], h.camera[5]);
+    cam.aspect_ratio = h.camera[6];
+    cam.vfov = h.camera[7];
+    set_gltf_render_settings(cam);
+    return true;
+  }
+
+  // The cache textures page through, if load was given a texture budget
+  const texture_cache *texture_tiles() const { return tile_cache.get(); }
+
+private:
+  mapped_file file;
+  gltf_material_table materials;
+  std::unique_ptr<texture_cache> tile_cache;
+
+  static void restore_id(id_counter &counter, uint32_t &id, uint32_t cached)
+  {
+    id = cached;
+    counter.skip_past(cached);
+  }
+
+  static const uint32_t node_bvh = 0;
+  static const uint32_t node_triangle = 1;
+  static const uint32_t node_transform = 2;
+
+  // Larger images than this are taken to be a damaged file
+  static const uint32_t max_image_size = 1 << 24;
+
+  struct header
+  {
+    char magic[8];
+    uint32_t version;
+    uint32_t fallback_material_id;
+    uint64_t key;
+    uint64_t num_images, num_materials, num_triangles, num_nodes, num_matrices;
+    uint64_t images_offset, materials_offset, triangles_offset, nodes_offset, matrices_offset, tiles_offset;
+    uint64_t file_size;
+    double camera[8]; // lookfrom, lookat, aspect ratio, vfov
+  };
+
+  struct cached_image
+  {
+    uint32_t width, height;
+    uint64_t offset; // in bytes into the tile section, see mip_chain for the layout
+    uint32_t format; // texel_format, srgb8 or unorm8
+    uint32_t reserved;
+  };
+
+  struct cached_material
+  {
+    double base_color[3];
+    double alpha;
+    double alpha_cutoff;
+    double metallic, roughness, normal_scale;
+    double emissive[3];
+    int32_t image;
+    int32_t mode; // alpha_mode
+    int32_t metallic_roughness_image, normal_image;
+    int32_t emissive_image;
+    uint32_t id;
+  };
+
+  struct cached_triangle
+  {
+    double position[3][3];
+    double normal[3][3];
+    double uv[3][2];
+    int32_t material; // -1 for the fallback material
+    uint32_t primitive_id;
+
+    vertex read_vertex(int i) const
+    {
+      return vertex(
+          vec3(position[i][0], position[i][1], position[i][2]),
+          vec3(normal[i][0], normal[i][1], normal[i][2]),
+          vec3(uv[i][0], uv[i][1], 0));
+    }
+  };
+
+  // bvh: a and b are the child nodes, triangle: a is the triangle, transform: a is the
+  // child node and b the matrix
+  struct cached_node
+  {
+    uint32_t kind, a, b, reserved;
+  };
+
+  // Flattens a hittable tree into arrays, children before parents. Shared subtrees, like
+  // instanced meshes, are only written once.
+  struct writer
+  {
+    const gltf_material_table &materials;
+    std::vector<cached_triangle> triangles;
+    std::vector<cached_node> nodes;
+    std::vector<mat4> matrices;
+    std::unordered_map<const hittable *, uint32_t> written;
+
+    writer(const gltf_material_table &materials) : materials(materials) {}
+
+    bool add(const hittable *object)
+    {
+      return add_node(object) != UINT32_MAX;
+    }
+
+    uint32_t add_node(const hittable *object)
+    {
+      auto existing = written.find(object);
+      if (existing != written.end())
+        return existing->second;
+
+      cached_node node = {};
+      if (auto bvh = dynamic_cast<const bvh_node *>(object))
+      {
+        node.kind = node_bvh;
+        node.a = add_node(bvh->left.get());
+        node.b = add_node(bvh->right.get());
+        if (node.a == UINT32_MAX || node.b == UINT32_MAX)
+          return UINT32_MAX;
+      }
+      else if (auto triangle = dynamic_cast<const tri *>(object))
+      {
+        if (triangle->moving)
+          return UINT32_MAX;
+        node.kind = node_triangle;
+        node.a = triangles.size();
+        cached_triangle t = {};
+        const vertex *vertices[3] = {&triangle->v1, &triangle->v2, &triangle->v3};
+        for (int i = 0; i < 3; i++)
+        {
+          for (int c = 0; c < 3; c++)
+          {
+            t.position[i][c] = vertices[i]->position[c];
+            t.normal[i][c] = vertices[i]->normal[c];
+          }
+          t.uv[i][0] = vertices[i]->uv.x();
+          t.uv[i][1] = vertices[i]->uv.y();
+        }
+        t.material = materials.index_of(triangle->material.get());
+        t.primitive_id = triangle->id;
+        triangles.push_back(t);
+      }
+      else if (auto instance = dynamic_cast<const transform *>(object))
+      {
+        node.kind = node_transform;
+        node.a = add_node(instance->object.get());
+        node.b = matrices.size();
+        matrices.push_back(instance->object_to_world);
+        if (node.a == UINT32_MAX)
+          return UINT32_MAX;
+      }
+      else
+      {
+        return UINT32_MAX;
+      }
+
+      nodes.push_back(node);
+      written[object] = nodes.size() - 1;
+      return nodes.size() - 1;
+    }
+  };
+
+  template <typename T>
+  static uint64_t section(uint64_t &offset, const std::vector<T> &items)
+  {
+    uint64_t start = offset;
+    offset = (offset + items.size() * sizeof(T) + 7) & ~uint64_t(7);
+    return start;
+  }
+
+  // Write items and zero padding up to the next 8 byte boundary
+  template <typename T>
+  static void write_section(std::ofstream &out, uint64_t offset, const std::vector<T> &items)
+  {
+    static const char padding[8] = {};
+    size_t size = items.size() * sizeof(T);
+    out.seekp(offset);
+    out.write(reinterpret_cast<const char *>(items.data()), size);
+    out.write(padding, -size & 7);
+  }
+
+  // Whether count items of T starting offset bytes into the file lie within it
+  template <typename T>
+  bool section_fits(uint64_t offset, uint64_t count) const
+  {
+    return offset % alignof(T) == 0 && offset <= file.size() && count <= (file.size() - offset) / sizeof(T);
+  }
+
+  // Checks every count, offset and index in the file before load builds anything from
+  // it, so that a truncated or damaged cache gets rebuilt instead of read out of bounds
+  bool valid(const header &h) const
+  {
+    if (h.num_nodes == 0 || h.num_nodes > UINT32_MAX ||
+        !section_fits<cached_image>(h.images_offset, h.num_images) ||
+        !section_fits<cached_material>(h.materials_offset, h.num_materials) ||
+        !section_fits<cached_triangle>(h.triangles_offset, h.num_triangles) ||
+        !section_fits<cached_node>(h.nodes_offset, h.num_nodes) ||
+        !section_fits<mat4>(h.matrices_offset, h.num_matrices) ||
+        !section_fits<unsigned char>(h.tiles_offset, 0))
+      return false;
+
+    const cached_image *images = read_section<cached_image>(h.images_offset);
+    uint64_t tiles_size = file.size() - h.tiles_offset;
+    for (uint64_t i = 0; i < h.num_images; i++)
+    {
+      const cached_image &image = images[i];
+      if (image.width == 0 || image.height == 0 || image.width > max_image_size || image.height > max_image_size ||
+          (image.format != uint32_t(texel_format::srgb8) && image.format != uint32_t(texel_format::unorm8)) ||
+          image.offset > tiles_size)
+        return false;
+      mip_chain layout(image.width, image.height, texel_format(image.format), static_cast<const unsigned char *>(nullptr));
+      if (layout.num_tiles() > (tiles_size - image.offset) / layout.tile_bytes())
+        return false;
+    }
+
+    auto valid_image = [&](int32_t image)
+    { return image >= -1 && image < int64_t(h.num_images); };
+    const cached_material *cached_materials = read_section<cached_material>(h.materials_offset);
+    for (uint64_t i = 0; i < h.num_materials; i++)
+    {
+      const cached_material &m = cached_materials[i];
+      if (!valid_image(m.image) || !valid_image(m.metallic_roughness_image) || !valid_image(m.normal_image) ||
+          !valid_image(m.emissive_image) || m.mode < int32_t(alpha_mode::opaque) || m.mode > int32_t(alpha_mode::blend))
+        return false;
+    }
+
+    const cached_triangle *triangles = read_section<cached_triangle>(h.triangles_offset);
+    for (uint64_t i = 0; i < h.num_triangles; i++)
+    {
+      if (triangles[i].material < -1 || triangles[i].material >= int64_t(h.num_materials))
+        return false;
+    }
+
+    // Children come before their parents, which also rules out cycles
+    const cached_node *nodes = read_section<cached_node>(h.nodes_offset);
+    for (uint64_t i = 0; i < h.num_nodes; i++)
+    {
+      const cached_node &node = nodes[i];
+      bool node_valid = node.kind == node_bvh         ? node.a < i && node.b < i
+                        : node.kind == node_triangle  ? node.a < h.num_triangles
+                        : node.kind == node_transform ? node.a < i && node.b < h.num_matrices
+                                                      : false;
+      if (!node_valid)
+        return false;
+    }
+    return true;
+  }
+
+  template <typename T>
+  const T *read_section(uint64_t offset) const
+  {
+    return reinterpret_cast<const T *>(file.data() + offset);
+  }
+};
+
+#endif
@@ -0,0 +1,166 @@
+#ifndef SPARSE_GRID_H
+#define SPARSE_GRID_H
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <vector>
+
+#include "aabb.h"
+
+// Scalar field over a box, e.g. the density of smoke, sampled at the centers of an
+// nx x ny x nz grid of voxels and trilinearly interpolated between them. Values are
+// clamped to the edge of the grid.
+//
+// Voxels are stored in bricks of brick_size^3, and bricks whose voxels are all zero
+// aren't allocated, so a plume of smoke in a big box costs memory for the plume only.
+// Every brick also keeps a majorant: the largest value the field reaches anywhere in
+// the brick, which is what tracking through a volume steps with.
+class sparse_grid
+{
+public:
+  static constexpr int brick_size = 8;
+  static constexpr int brick_voxels = brick_size * brick_size * brick_size;
+
+  // All zero
+  sparse_grid(const aabb &bounds, int nx, int ny, int nz) : bounds(bounds)
+  {
+    n[0] = std::max(nx, 1);
+    n[1] = std::max(ny, 1);
+    n[2] = std::max(nz, 1);
+    for (int axis = 0; axis < 3; axis++)
+    {
+      bricks[axis] = (n[axis] + brick_size - 1) / brick_size;
+      voxel_size[axis] = bounds.axis_interval(axis).size() / n[axis];
+    }
+    brick_index.assign(size_t(bricks[0]) * bricks[1] * bricks[2], -1);
+    majorants.assign(brick_index.size(), 0);
+  }
+
+  // Filled with value(center of each voxel)
+  sparse_grid(const aabb &bounds, int nx, int ny, int nz, const std::function<double(const point3 &)> &value) : sparse_grid(bounds, nx, ny, nz)
+  {
+    for (int z = 0; z < n[2]; z++)
+      for (int y = 0; y < n[1]; y++)
+        for (int x = 0; x < n[0]; x++)
+          set(x, y, z, float(value(voxel_center(x, y, z))));
+    update_majorants();
+  }
+
+  const aabb &bounding_box() const { return bounds; }
+  int resolution(int axis) const { return n[axis]; }
+  int bricks_along(int axis) const { return bricks[axis]; }
+  size_t allocated_bricks() const { return voxels.size() / brick_voxels; }
+
+  point3 voxel_center(int x, int y, int z) const
+  {
+    return point3(bounds.x.min + (x + 0.5) * voxel_size[0],
+                  bounds.y.min + (y + 0.5) * voxel_size[1],
+                  bounds.z.min + (z + 0.5) * voxel_size[2]);
+  }
+
+  // Call update_majorants() once done setting voxels
+  void set(int x, int y, int z, float value)
+  {
+    int brick = brick_of(x / brick_size, y / brick_size, z / brick_size);
+    if (brick_index[brick] < 0)
+    {
+      if (value == 0)
+        return;
+      brick_index[brick] = int(voxels.size() / brick_voxels);
+      voxels.resize(voxels.size() + brick_voxels, 0.0f);
+    }
+    voxels[size_t(brick_index[brick]) * brick_voxels + offset_in_brick(x, y, z)] = value;
+  }
+
+  float voxel(int x, int y, int z) const
+  {
+    x = std::clamp(x, 0, n[0] - 1);
+    y = std::clamp(y, 0, n[1] - 1);
+    z = std::clamp(z, 0, n[2] - 1);
+    int brick = brick_index[brick_of(x / brick_size, y / brick_size, z / brick_size)];
+    if (brick < 0)
+      return 0;
+    return voxels[size_t(brick) * brick_voxels + offset_in_brick(x, y, z)];
+  }
+
+  double value(const point3 &p) const
+  {
+    // continuous voxel coordinates, with voxel centers on the integers
+    double g[3];
+    int i[3];
+    for (int axis = 0; axis < 3; axis++)
+    {
+      g[axis] = (p[axis] - bounds.axis_interval(axis).min) / voxel_size[axis] - 0.5;
+      i[axis] = int(std::floor(g[axis]));
+      g[axis] -= i[axis];
+    }
+
+    double result = 0;
+    for (int corner = 0; corner < 8; corner++)
+    {
+      int dx = corner & 1, dy = (corner >> 1) & 1, dz = corner >> 2;
+      double weight = (dx ? g[0] : 1 - g[0]) * (dy ? g[1] : 1 - g[1]) * (dz ? g[2] : 1 - g[2]);
+      if (weight > 0)
+        result += weight * voxel(i[0] + dx, i[1] + dy, i[2] + dz);
+    }
+    return result;
+  }
+
+  // Largest value anywhere inside brick (bx, by, bz)
+  double majorant(int bx, int by, int bz) const { return majorants[brick_of(bx, by, bz)]; }
+
+  // Brick containing p, which should be inside bounds
+  void brick_at(const point3 &p, int brick[3]) const
+  {
+    for (int axis = 0; axis < 3; axis++)
+    {
+      double voxel = (p[axis] - bounds.axis_interval(axis).min) / voxel_size[axis];
+      brick[axis] = std::clamp(int(std::floor(voxel)) / brick_size, 0, bricks[axis] - 1);
+    }
+  }
+
+  // Position along axis where brick number brick starts
+  double brick_start(int axis, int brick) const
+  {
+    return bounds.axis_interval(axis).min + brick * brick_size * voxel_size[axis];
+  }
+
+  // Interpolation inside a brick also reads the voxels just around it, so the majorant
+  // is their maximum as well
+  void update_majorants()
+  {
+    for (int bz = 0; bz < bricks[2]; bz++)
+      for (int by = 0; by < bricks[1]; by++)
+        for (int bx = 0; bx < bricks[0]; bx++)
+        {
+          float largest = 0;
+          for (int z = bz * brick_size - 1; z <= (bz + 1) * brick_size; z++)
+            for (int y = by * brick_size - 1; y <= (by + 1) * brick_size; y++)
+              for (int x = bx * brick_size - 1; x <= (bx + 1) * brick_size; x++)
+                largest = std::max(largest, voxel(x, y, z));
+          majorants[brick_of(bx, by, bz)] = largest;
+        }
+  }
+
+private:
+  aabb bounds;
+  int n[3];
+  int bricks[3];
+  double voxel_size[3];
+  std::vector<int> brick_index; // into voxels, in bricks, or -1 for all zero
+  std::vector<float> voxels;
+  std::vector<float> majorants;
+
+  int brick_of(int bx, int by, int bz) const
+  {
+    return (bz * bricks[1] + by) * bricks[0] + bx;
+  }
+
+  static int offset_in_brick(int x, int y, int z)
+  {
+    return ((z % brick_size) * brick_size + y % brick_size) * brick_size + x % brick_size;
+  }
+};
+
+#endif
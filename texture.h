@@ -8,6 +8,7 @@
 
 #include <memory>
 #include "color.h"
+#include "mipmap.h"
 #include <algorithm>
 // #include "rtw_stb_image.h"
 
@@ -19,6 +20,26 @@ public:
   virtual ~texture() = default;
 
   virtual color value(double u, double v, const point3 &p) const = 0;
+
+  // uv_footprint is how wide the pixel being shaded is in uv space, so image textures can
+  // pick a mip level. Textures that don't filter ignore it.
+  virtual color value(double u, double v, const point3 &p, double uv_footprint) const
+  {
+    return value(u, v, p);
+  }
+
+  // Opacity at (u, v), for alpha tested and blended materials
+  virtual double alpha(double u, double v) const
+  {
+    return 1;
+  }
+
+  // Hash of everything value() depends on, so a bake of the texture can be cached (see
+  // baked_texture), or 0 if there's no telling, e.g. for images
+  virtual uint64_t content_hash() const
+  {
+    return 0;
+  }
 };
 
 class solid_color : public texture
@@ -33,6 +54,11 @@ public:
     return albedo;
   }
 
+  uint64_t content_hash() const override
+  {
+    return fnv1a(&albedo, sizeof(albedo), fnv1a("solid_color", 11));
+  }
+
 private:
   color albedo;
 };
@@ -55,51 +81,117 @@ public:
     return isEven ? even->value(u, v, p) : odd->value(u, v, p);
   }
 
+  uint64_t content_hash() const override
+  {
+    uint64_t hashes[2] = {even->content_hash(), odd->content_hash()};
+    if (hashes[0] == 0 || hashes[1] == 0)
+      return 0;
+    return fnv1a(hashes, sizeof(hashes), fnv1a(&inv_scale, sizeof(inv_scale), fnv1a("checker_texture", 15)));
+  }
+
 private:
   double inv_scale;
   std::shared_ptr<texture> even;
   std::shared_ptr<texture> odd;
 };
 
+// Another texture times a constant color, like a glTF texture and its factor
+class scaled_texture : public texture
+{
+public:
+  scaled_texture(std::shared_ptr<texture> source, const color &scale) : source(source), scale(scale) {}
+
+  color value(double u, double v, const point3 &p) const override
+  {
+    return scale * source->value(u, v, p);
+  }
+
+  color value(double u, double v, const point3 &p, double uv_footprint) const override
+  {
+    return scale * source->value(u, v, p, uv_footprint);
+  }
+
+  double alpha(double u, double v) const override
+  {
+    return source->alpha(u, v);
+  }
+
+  uint64_t content_hash() const override
+  {
+    uint64_t source_hash = source->content_hash();
+    if (source_hash == 0)
+      return 0;
+    return fnv1a(&scale, sizeof(scale), fnv1a(&source_hash, sizeof(source_hash), fnv1a("scaled_texture", 14)));
+  }
+
+private:
+  std::shared_ptr<texture> source;
+  color scale;
+};
+
+// Filtered lookups into a linear float mip chain. The chain can be shared by several
+// textures, e.g. one per gltf image however many materials use it.
 class image_texture : public texture
 {
 public:
-  image_texture(Image image) : image(image) {}
+  image_texture(shared_ptr<const mip_chain> mips) : mips(mips) {}
+  // Decodes the image right away, so its pixels only need to live until this returns
+  image_texture(const image_view &image, bool srgb = true) : mips(make_shared<mip_chain>(image, srgb)) {}
+  image_texture(const Image &image, bool srgb = true) : image_texture(image_view{image.image.data(), image.width, image.height, image.component}, srgb) {}
 
   color value(double u, double v, const point3 &p) const override
+  {
+    return value(u, v, p, 0);
+  }
+
+  color value(double u, double v, const point3 &p, double uv_footprint) const override
   {
     u = interval(0, 1).clamp(u);
     v = 1.0 - interval(0, 1).clamp(v); // flip v to be image coordinates
 
-    int i = u * image.width;
-    int j = v * image.height;
-    int start_index = 4 * i + 4 * image.width * j;
-    double color_scale = 1.0 / 255.0;
-    double r = color_scale * image.image[start_index];
-    double g = color_scale * image.image[start_index + 1];
-    double b = color_scale * image.image[start_index + 2];
-    return color(r, g, b);
+    float rgba[4];
+    mips->trilinear(u, v, uv_footprint, rgba);
+    return color(rgba[0], rgba[1], rgba[2]);
+  }
+
+  double alpha(double u, double v) const override
+  {
+    float rgba[4];
+    mips->bilinear(0, interval(0, 1).clamp(u), 1.0 - interval(0, 1).clamp(v), rgba);
+    return rgba[3];
   }
 
 private:
-  Image image;
+  shared_ptr<const mip_chain> mips;
 };
 
 class noise_texture : public texture
 {
 public:
   noise_texture() : noise_texture(1.0) {}
-  noise_texture(double scale) : scale(scale), perlin_generator() {}
+  // num_frequencies: octaves of noise summed per lookup, see perlin::fbm
+  noise_texture(double scale, int num_frequencies = 1) : scale(scale), num_frequencies(num_frequencies), perlin_generator() {}
 
   color value(double u, double v, const point3 &p) const override
   {
-    return color(1) * 0.5 * (1.0 + perlin_generator.noise(p * scale));
+    double noise = perlin_generator.fbm(p * scale, num_frequencies);
+    return color(1) * 0.5 * (1.0 + noise);
     // return color(1) * perlin_generator.turb(p, 7);
     // return color(0.5) * (1 + std::sin(scale * p.z() + 10 * perlin_generator.turb(p + vec3(p.x(), 0, 0), 7)));
   }
 
+  uint64_t content_hash() const override
+  {
+    uint64_t hash = fnv1a("noise_texture", 13);
+    hash = fnv1a(&scale, sizeof(scale), hash);
+    hash = fnv1a(&num_frequencies, sizeof(num_frequencies), hash);
+    uint64_t generator = perlin_generator.hash();
+    return fnv1a(&generator, sizeof(generator), hash);
+  }
+
 private:
   double scale;
+  int num_frequencies;
   perlin perlin_generator;
 };
 
@@ -0,0 +1,126 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Fixed-size pool of texture tiles read on demand from files on disk, e.g. the tiled mip
+// chains in a scene cache. When the pool is full the least recently used tile is
+// replaced, so resident texture memory stays under the budget however large the textures
+// are. Not thread safe; every render process has its own cache.
+class texture_cache
+{
+public:
+  // Every tile in a file has the same size, in bytes
+  texture_cache(size_t budget_bytes, size_t tile_bytes) : tile_bytes(tile_bytes)
+  {
+    // A bilinear lookup can touch 4 tiles at once and all of them have to stay resident
+    size_t num_slots = std::max(budget_bytes / tile_bytes, size_t(8));
+    storage.resize(num_slots * tile_bytes);
+    slots.resize(num_slots);
+    for (size_t i = 0; i < num_slots; i++)
+    {
+      slots[i].prev = i == 0 ? -1 : int(i) - 1;
+      slots[i].next = i + 1 == num_slots ? -1 : int(i) + 1;
+    }
+    head = 0;
+    tail = num_slots - 1;
+  }
+
+  texture_cache(const texture_cache &) = delete;
+  texture_cache &operator=(const texture_cache &) = delete;
+
+  ~texture_cache()
+  {
+    for (FILE *file : files)
+      fclose(file);
+  }
+
+  // Returns the id to read tiles from filename with, or -1 if it can't be opened
+  int add_file(const std::string &filename)
+  {
+    FILE *file = fopen(filename.c_str(), "rb");
+    if (!file)
+      return -1;
+    files.push_back(file);
+    return files.size() - 1;
+  }
+
+  // The tile starting offset bytes into file. The pointer stays valid until more tiles
+  // have been requested than fit in the cache.
+  const unsigned char *tile(int file, uint64_t offset)
+  {
+    uint64_t key = (uint64_t(file) << 48) | (offset / tile_bytes);
+    auto found = lookup.find(key);
+    int slot;
+    if (found != lookup.end())
+    {
+      hits++;
+      slot = found->second;
+    }
+    else
+    {
+      misses++;
+      // Reuse the least recently used slot
+      slot = tail;
+      if (slots[slot].resident)
+        lookup.erase(slots[slot].key);
+      slots[slot].key = key;
+      slots[slot].resident = true;
+      lookup[key] = slot;
+
+      unsigned char *data = slot_data(slot);
+      if (fseek(files[file], long(offset), SEEK_SET) != 0 || fread(data, 1, tile_bytes, files[file]) != tile_bytes)
+      {
+        std::fill(data, data + tile_bytes, 0);
+      }
+    }
+    move_to_front(slot);
+    return slot_data(slot);
+  }
+
+  size_t hits = 0;
+  size_t misses = 0;
+
+private:
+  struct slot_entry
+  {
+    uint64_t key = 0;
+    bool resident = false;
+    int prev, next; // recency list, most recent first
+  };
+
+  size_t tile_bytes;
+  std::vector<unsigned char> storage;
+  std::vector<slot_entry> slots;
+  std::unordered_map<uint64_t, int> lookup;
+  std::vector<FILE *> files;
+  int head, tail;
+
+  unsigned char *slot_data(int slot)
+  {
+    return storage.data() + slot * tile_bytes;
+  }
+
+  void move_to_front(int slot)
+  {
+    if (slot == head)
+      return;
+    slot_entry &entry = slots[slot];
+    slots[entry.prev].next = entry.next;
+    if (entry.next >= 0)
+      slots[entry.next].prev = entry.prev;
+    else
+      tail = entry.prev;
+    entry.prev = -1;
+    entry.next = head;
+    slots[head].prev = slot;
+    head = slot;
+  }
+};
+
+#endif
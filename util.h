@@ -2,6 +2,7 @@
 #define UTIL_H
 
 #include <cmath>
+#include <cstdint>
 #include <iostream>
 #include <limits>
 #include <memory>
@@ -56,12 +57,43 @@ inline double clamp(double min, double value, double max)
 	return value;
 }
 
+// 64-bit FNV-1a hash, chained through hash, for cache keys
+inline uint64_t fnv1a(const void *data, size_t size, uint64_t hash = 14695981039346656037ull)
+{
+	const unsigned char *bytes = static_cast<const unsigned char *>(data);
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+// Scrambles the bits of x (the splitmix64 finalizer), e.g. to turn a combination of
+// values into a well distributed random number
+inline uint64_t mix_bits(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ull;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebull;
+	x ^= x >> 31;
+	return x;
+}
+
+// Double from 0 to 1 determined entirely by hash
+inline double hash_to_double(uint64_t hash)
+{
+	return (mix_bits(hash) >> 11) * 0x1.0p-53;
+}
+
 #include "interval.h"
 #include "color.h"
 #include "ray.h"
 #include "vec3.h"
 #include "vertex.h"
 #include "quat.h"
+#include "mat4.h"
 #include "perlin.h"
 #include "material.h"
 #include "aabb.h"
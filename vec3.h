@@ -134,15 +134,30 @@ inline vec3 unit_vector(const vec3 &v)
 	return v / v.length();
 }
 
-inline vec3 random_in_unit_disk()
+// Uniformly distributed over the unit disk, from two uniform numbers
+inline vec3 point_in_unit_disk(double u1, double u2)
 {
-	double theta = random_double();
-	double radius = std::sqrt(random_double());
+	double theta = 2 * pi * u1;
+	double radius = std::sqrt(u2);
 	double x = radius * std::cos(theta);
 	double y = radius * std::sin(theta);
 	return vec3(x, y, 0);
 }
 
+inline vec3 random_in_unit_disk()
+{
+	return point_in_unit_disk(random_double(), random_double());
+}
+
+// Uniformly distributed over the unit sphere, from two uniform numbers
+inline vec3 sphere_direction(double u1, double u2)
+{
+	double z = 1 - 2 * u1;
+	double r = std::sqrt(std::fmax(0.0, 1 - z * z));
+	double phi = 2 * pi * u2;
+	return vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
 inline vec3 random_unit_vector()
 {
 	while (true)